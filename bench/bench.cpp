@@ -0,0 +1,447 @@
+// Microbenchmarks for the hot paths of the game, built from main.cpp with its main() left out.
+// Every case starts each timed batch from the same seeded state, so two builds time the same
+// work. Results print as a table and, with --json FILE, in Google Benchmark's JSON layout, so
+// its compare.py can diff two commits.
+//
+//   asciidungeon-bench [--filter TEXT] [--json FILE] [--min-time MS] [--repetitions N] [--seed N]
+#define ASCIIDUNGEON_NO_MAIN
+#include "main.cpp"
+
+#include <ctime>
+
+// Runs the registered cases. setup runs untimed before every batch and run(iterations) is the
+// timed part. The batch size grows until one batch takes at least minTimeMs; then repetitions
+// batches of that size are timed, and the median time per iteration is reported.
+class BenchHarness {
+public:
+	struct Case {
+		string name;
+		function<void()> setup;
+		function<void(long long)> run;
+	};
+
+	struct Result {
+		string name;
+		long long iterations;
+		double medianNs, minNs, maxNs, cpuNs;
+	};
+
+	string filter;
+	double minTimeMs = 50.0;
+	int repetitions = 5;
+	vector<Result> results;
+
+	void Add(const string& name, function<void()> setup, function<void(long long)> run) {
+		cases.push_back({ name, move(setup), move(run) });
+	}
+
+	void RunAll(ostream& out) {
+		out << left << setw(36) << "case" << right << setw(12) << "iterations" << setw(14) << "median ns"
+			<< setw(14) << "min ns" << setw(14) << "max ns" << setw(14) << "cpu ns" << "\n";
+
+		for (const Case& benchCase : cases) {
+			if (!filter.empty() && benchCase.name.find(filter) == string::npos) {
+				continue;
+			}
+			Result result = Run(benchCase);
+			results.push_back(result);
+			out << left << setw(36) << result.name << right << setw(12) << result.iterations << fixed << setprecision(1)
+				<< setw(14) << result.medianNs << setw(14) << result.minNs << setw(14) << result.maxNs
+				<< setw(14) << result.cpuNs << defaultfloat << setprecision(6) << "\n";
+		}
+	}
+
+	bool WriteJson(const string& path, const string& executable, unsigned int seed) const {
+		ofstream out(path);
+
+		if (!out) {
+			return false;
+		}
+		out << "{\n  \"context\": {\n";
+		out << "    \"executable\": \"" << Escape(executable) << "\",\n";
+#ifdef NDEBUG
+		out << "    \"library_build_type\": \"release\",\n";
+#else
+		out << "    \"library_build_type\": \"debug\",\n";
+#endif
+		out << "    \"seed\": " << seed << ",\n";
+		out << "    \"repetitions\": " << repetitions << ",\n";
+		out << "    \"min_time_ms\": " << minTimeMs << "\n  },\n  \"benchmarks\": [";
+
+		for (size_t i = 0; i < results.size(); ++i) {
+			const Result& result = results[i];
+			out << (i ? "," : "") << "\n    {\n";
+			out << "      \"name\": \"" << Escape(result.name) << "\",\n";
+			out << "      \"run_name\": \"" << Escape(result.name) << "\",\n";
+			out << "      \"run_type\": \"iteration\",\n";
+			out << "      \"iterations\": " << result.iterations << ",\n";
+			out << "      \"real_time\": " << result.medianNs << ",\n";
+			out << "      \"cpu_time\": " << result.cpuNs << ",\n";
+			out << "      \"min_time\": " << result.minNs << ",\n";
+			out << "      \"max_time\": " << result.maxNs << ",\n";
+			out << "      \"time_unit\": \"ns\"\n    }";
+		}
+		out << "\n  ]\n}\n";
+		return (bool)out;
+	}
+
+private:
+	typedef chrono::steady_clock Clock;
+	vector<Case> cases;
+
+	Result Run(const Case& benchCase) const {
+		long long iterations = 1;
+
+		while (true) {
+			benchCase.setup();
+			double ns = TimeBatch(benchCase, iterations, nullptr);
+
+			if (ns >= minTimeMs * 1e6 || iterations >= (1LL << 40)) {
+				break;
+			}
+			double scale = ns > 0 ? minTimeMs * 1e6 * 1.2 / ns : 10.0;
+			iterations = (long long)(iterations * max(2.0, min(10.0, scale)));
+		}
+		vector<double> perIteration;
+		double cpuTotal = 0.0;
+
+		for (int repetition = 0; repetition < repetitions; ++repetition) {
+			benchCase.setup();
+			double cpuNs = 0.0;
+			perIteration.push_back(TimeBatch(benchCase, iterations, &cpuNs) / iterations);
+			cpuTotal += cpuNs / iterations;
+		}
+		sort(perIteration.begin(), perIteration.end());
+		return { benchCase.name, iterations, perIteration[perIteration.size() / 2], perIteration.front(),
+			perIteration.back(), cpuTotal / repetitions };
+	}
+
+	static double TimeBatch(const Case& benchCase, long long iterations, double* cpuNs) {
+		clock_t cpuStart = clock();
+		auto start = Clock::now();
+		benchCase.run(iterations);
+		double ns = (double)chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+
+		if (cpuNs) {
+			*cpuNs = (double)(clock() - cpuStart) * 1e9 / CLOCKS_PER_SEC;
+		}
+		return ns;
+	}
+
+	static string Escape(const string& text) {
+		string escaped;
+
+		for (char c : text) {
+			if (c == '"' || c == '\\') {
+				escaped += '\\';
+			}
+			escaped += c;
+		}
+		return escaped;
+	}
+};
+
+// Terminal that keeps nothing: the compositor still builds and "writes" its output, so render
+// cases pay for everything but the console.
+class NullTerminal : public TerminalBackend {
+public:
+	size_t bytesWritten = 0;
+
+	void Setup(int, int, int) override {}
+	void Clear() override {}
+	void SetCursor(int, int) override {}
+	void SetColor(unsigned char) override {}
+	void Write(const char*, size_t size) override { bytesWritten += size; }
+	void Wait(int) override {}
+	bool KeyAvailable() override { return false; }
+	int ReadKey() override { return 27; }
+};
+
+// Keeps a result alive so the optimizer cannot drop the work that produced it.
+static volatile size_t benchSink;
+
+typedef Game::EntityManager GameEntities;
+typedef Game::EntityManager::AIController AI;
+
+// An 80x30 level from seed with the player at (1, 1) and count enemies. With walledIn, the two
+// tiles next to the player are walls, so nothing ever reaches it and no encounter starts.
+static void BuildLevel(unsigned int seed, int count, bool walledIn, LevelMap& level, EntityGrid& grid) {
+	mt19937 generator(seed);
+	level.Load(Engine::LevelGenerator::GenerateLevel((int)GameFieldWidth, (int)GameFieldHeight, generator));
+
+	if (walledIn) {
+		level.Set({ 2, 1 }, TileWall);
+		level.Set({ 1, 2 }, TileWall);
+	}
+	grid.Clear();
+	grid.Set({ 1, 1 }, TilePlayer);
+	generator.seed(seed);
+	GameEntities::PlaceEntitiesRandomly(level, grid, ContentTable::Default(), TileEnemy, count, generator);
+}
+
+static vector<pair<GridPosition, GridPosition>> RandomGroundPairs(const LevelMap& level, unsigned int seed, int count) {
+	vector<GridPosition> ground = GameEntities::GetWalkableTiles(level);
+	mt19937 generator(seed);
+	uniform_int_distribution<size_t> pick(0, ground.size() - 1);
+	vector<pair<GridPosition, GridPosition>> pairs;
+
+	for (int i = 0; i < count; ++i) {
+		pairs.push_back({ ground[pick(generator)], ground[pick(generator)] });
+	}
+	return pairs;
+}
+
+int main(int argc, char* argv[]) {
+	BenchHarness harness;
+	unsigned int seed = 1;
+	string jsonPath;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--filter" && hasValue) {
+			harness.filter = argv[++i];
+		}
+		else if (arg == "--json" && hasValue) {
+			jsonPath = argv[++i];
+		}
+		else if (arg == "--min-time" && hasValue) {
+			harness.minTimeMs = max(1.0, atof(argv[++i]));
+		}
+		else if (arg == "--repetitions" && hasValue) {
+			harness.repetitions = max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--seed" && hasValue) {
+			seed = (unsigned int)strtoul(argv[++i], nullptr, 10);
+		}
+		else {
+			cerr << "usage: " << argv[0] << " [--filter TEXT] [--json FILE] [--min-time MS] [--repetitions N] [--seed N]\n";
+			return 2;
+		}
+	}
+	NullTerminal sink;
+	Game::Options options;
+	options.seed = seed;
+	Game game(sink, options);
+
+	mt19937 generator;
+	harness.Add("GenerateLevel/80x30",
+		[&]() { generator.seed(seed); },
+		[&](long long iterations) {
+			for (long long i = 0; i < iterations; ++i) {
+				benchSink = Engine::LevelGenerator::GenerateLevel((int)GameFieldWidth, (int)GameFieldHeight, generator).size();
+			}
+		});
+
+	LevelMap streamed(4096, 4096);
+	harness.Add("GenerateLevel/streamed/4096x4096",
+		[&]() { generator.seed(seed); },
+		[&](long long iterations) {
+			for (long long i = 0; i < iterations; ++i) {
+				Engine::LevelGenerator::GenerateLevel(streamed, { 2048, 2048 }, generator);
+				benchSink = streamed.AllocatedChunks();
+			}
+		});
+
+	LevelMap level;
+	EntityGrid grid;
+	vector<pair<GridPosition, GridPosition>> pairs;
+	harness.Add("AStarPath/80x30",
+		[&]() {
+			BuildLevel(seed, 20, false, level, grid);
+			pairs = RandomGroundPairs(level, seed, 256);
+		},
+		[&](long long iterations) {
+			for (long long i = 0; i < iterations; ++i) {
+				const auto& query = pairs[i & 255];
+				benchSink = game.ai.AStarPath(query.first, query.second, level, grid).size();
+			}
+		});
+
+	harness.Add("HasLineOfSight/80x30",
+		[&]() {
+			BuildLevel(seed, 0, false, level, grid);
+			pairs = RandomGroundPairs(level, seed, 256);
+		},
+		[&](long long iterations) {
+			size_t visible = 0;
+			for (long long i = 0; i < iterations; ++i) {
+				const auto& query = pairs[i & 255];
+				visible += AI::HasLineOfSight(query.first, query.second, level);
+			}
+			benchSink = visible;
+		});
+
+	harness.Add("PlanPursuits/20",
+		[&]() {
+			BuildLevel(seed, 20, false, level, grid);
+			game.ai.Reset();
+		},
+		[&](long long iterations) {
+			for (long long i = 0; i < iterations; ++i) {
+				game.ai.PlanPursuits(level, grid, { 1, 1 });
+			}
+			benchSink = game.ai.pursuits.size();
+		});
+
+	// The player is walled in so no encounter screen starts. That also makes the pursuer's path
+	// search fail on every re-evaluation after searching all the open tiles. So these cases carry
+	// the worst-case A*, which shrinks as more enemies block tiles.
+	for (int count : { 10, 100, 1000 }) {
+		harness.Add("UpdateEntities/" + to_string(count),
+			[&, count]() {
+				BuildLevel(seed, count, true, level, grid);
+				game.ai.Reset();
+			},
+			[&](long long iterations) {
+				for (long long i = 0; i < iterations; ++i) {
+					GameEntities::UpdateEntities(game, level, grid, { 1, 1 });
+				}
+				benchSink = grid.Size();
+			});
+	}
+
+	// Every enemy chases as one group. A shop screen stays open so nobody starts a fight, so
+	// after the first ticks this is the cost of a crowd queueing up around the player.
+	for (int count : { 10, 100, 1000 }) {
+		harness.Add("UpdateEntities/pursuers/" + to_string(count),
+			[&, count]() {
+				BuildLevel(seed, count, false, level, grid);
+				game.ai.Reset();
+				game.ai.pursuerCount = count;
+				game.encounters.OpenScreen(GameEntities::Encounters::Screen::Shop);
+			},
+			[&](long long iterations) {
+				for (long long i = 0; i < iterations; ++i) {
+					GameEntities::UpdateEntities(game, level, grid, { 1, 1 });
+				}
+				benchSink = grid.Size();
+			});
+	}
+
+	harness.Add("PlaceEntitiesRandomly/20",
+		[&]() {
+			BuildLevel(seed, 0, false, level, grid);
+			generator.seed(seed);
+		},
+		[&](long long iterations) {
+			for (long long i = 0; i < iterations; ++i) {
+				grid.Clear();
+				grid.Set({ 1, 1 }, TilePlayer);
+				GameEntities::PlaceEntitiesRandomly(level, grid, ContentTable::Default(), TileEnemy, 20, generator);
+			}
+			benchSink = grid.Size();
+		});
+
+	ContentTable content;
+	string contentError;
+	harness.Add("ContentTable/Compile/builtin",
+		[&]() {},
+		[&](long long iterations) {
+			for (long long i = 0; i < iterations; ++i) {
+				ContentTable::Compile(ContentTable::DefaultSource, content, contentError);
+			}
+			benchSink = content.Types().size();
+		});
+
+	harness.Add("Render/FullView",
+		[&]() {
+			BuildLevel(seed, 20, false, level, grid);
+			game.renderer.FollowPlayer(level, { 1, 1 });
+			game.renderer.DrawInitialMap(level, grid);
+		},
+		[&](long long iterations) {
+			for (long long i = 0; i < iterations; ++i) {
+				game.compositor.Invalidate();
+				game.renderer.DrawView(level, grid);
+			}
+			benchSink = sink.bytesWritten;
+		});
+
+	harness.Add("Render/EntityMove",
+		[&]() {
+			BuildLevel(seed, 20, false, level, grid);
+			game.renderer.FollowPlayer(level, { 1, 1 });
+			game.renderer.DrawInitialMap(level, grid);
+			generator.seed(seed);
+		},
+		[&](long long iterations) {
+			const GridPosition steps[] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+
+			for (long long i = 0; i < iterations; ++i) {
+				EntityGrid::EntityId id = (EntityGrid::EntityId)(generator() % grid.Slots());
+				GridPosition from = grid.Position(id);
+				GridPosition step = steps[generator() & 3];
+				GridPosition to{ from.x + step.x, from.y + step.y };
+
+				if (grid.Type(id) != TileEnemy || !level.IsGround(to) || grid.Has(to)) {
+					continue;
+				}
+				grid.Move(from, to);
+				game.renderer.ComposeCell(level, grid, from);
+				game.renderer.ComposeCell(level, grid, to);
+				game.compositor.Present();
+			}
+			benchSink = sink.bytesWritten;
+		});
+
+	const string messages[] = { "HP:100/100 ATK:10 DEF:5 LVL:1 GOLD:100", "HP:97/100 ATK:10 DEF:5 LVL:1 GOLD:100" };
+	harness.Add("Render/HUD",
+		[&]() {
+			BuildLevel(seed, 0, false, level, grid);
+			game.renderer.DrawInitialMap(level, grid);
+		},
+		[&](long long iterations) {
+			for (long long i = 0; i < iterations; ++i) {
+				game.hud.DrawHUDBar(2, messages[i & 1]);
+				game.compositor.Present();
+			}
+			benchSink = sink.bytesWritten;
+		});
+
+	// One stat changing every frame, as when gold is counted up; the status line only re-forms
+	// the changed field.
+	harness.Add("Render/HUDStatus",
+		[&]() {
+			BuildLevel(seed, 0, false, level, grid);
+			game.renderer.DrawInitialMap(level, grid);
+			game.player = Game::StartingPlayer();
+		},
+		[&](long long iterations) {
+			for (long long i = 0; i < iterations; ++i) {
+				game.player.money = 100 + (int)(i & 1);
+				game.hud.DrawStatus(2, game.player);
+				game.compositor.Present();
+			}
+			benchSink = sink.bytesWritten;
+		});
+
+	// Opening the shop panel over the map and closing it again: compose the panel, then recompose
+	// the view under it. Only the panel's rectangle reaches the terminal.
+	harness.Add("Render/OverlayOpenClose",
+		[&]() {
+			BuildLevel(seed, 20, false, level, grid);
+			game.renderer.FollowPlayer(level, { 1, 1 });
+			game.renderer.DrawInitialMap(level, grid);
+			game.player = Game::StartingPlayer();
+			game.encounters.OpenScreen(Game::EntityManager::Encounters::Screen::Shop);
+			game.encounters.Describe(game);
+		},
+		[&](long long iterations) {
+			for (long long i = 0; i < iterations; ++i) {
+				game.overlay.Compose(2);
+				game.compositor.Present();
+				game.renderer.DrawView(level, grid);
+			}
+			benchSink = sink.bytesWritten;
+		});
+
+	harness.RunAll(cout);
+
+	if (!jsonPath.empty() && !harness.WriteJson(jsonPath, argv[0], seed)) {
+		cerr << "could not write " << jsonPath << "\n";
+		return 1;
+	}
+	return 0;
+}
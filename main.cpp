@@ -4,21 +4,53 @@
 #include <map>
 #include <tuple>
 #include <queue>
-#include <conio.h>
-#include <Windows.h>
 #include <sstream>
+#include <fstream>
 #include <chrono>
+#include <thread>
 #include <algorithm>
 #include <cctype>
 #include<unordered_map>
+#include <charconv>
+#include <string_view>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <atomic>
+#include <iomanip>
+#include <functional>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef _WIN32
+#include <conio.h>
+#include <Windows.h>
 #include <VersionHelpers.h>
+#else
+#include <termios.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
 
 using namespace std;
 
-random_device rd;
-mt19937 rng(rd());
+// Size of the view on screen. The world itself can be larger; --world sets its size.
 const size_t GameFieldWidth = 80;
 const size_t GameFieldHeight = 30;
+// Rows under the view taken by the HUD: a spacer and the three rows of the HUD bar.
+const size_t HudHeight = 4;
+const int MaxWorldSize = 1 << 16;
 const char TileWall = '#';
 const char TileGround = ' ';
 const char TilePlayer = 'P';
@@ -26,7 +58,6 @@ const char TileEnemy = 'E';
 const char TileMerchant = 'M';
 const char TileBoss = 'B';
 const char TileMiniBoss = 'b';
-bool isPaused = false;
 
 struct GridPosition {
 	int x, y;
@@ -36,1275 +67,7245 @@ struct GridPosition {
 	bool operator!=(const GridPosition& other) const { return !(*this == other); }
 };
 
+struct GridRect {
+	int x, y, width, height;
+	bool Contains(GridPosition pos) const { return pos.x >= x && pos.x < x + width && pos.y >= y && pos.y < y + height; }
+	int Area() const { return width * height; }
+	int Index(GridPosition pos) const { return (pos.y - y) * width + (pos.x - x); }
+	GridPosition At(int index) const { return { x + index % width, y + index / width }; }
+	bool operator==(const GridRect& other) const { return x == other.x && y == other.y && width == other.width && height == other.height; }
+	bool operator!=(const GridRect& other) const { return !(*this == other); }
+};
+
 struct Player {
 	int hp, maxHp, attack, defense, level, money;
 };
 
-class Engine {
+// One bit per tile, each row packed into 64-bit words: bit i of word w is column 64 * w + i.
+// FloodFill grows a region through open tiles a whole word at a time, so an 80x30 map is two
+// words per row and a reachability check touches under half a kilobyte.
+class Bitboard {
 public:
-
-	static void HideCursor() {
-		HANDLE consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-		CONSOLE_CURSOR_INFO cursorInfo;
-		GetConsoleCursorInfo(consoleHandle, &cursorInfo);
-		cursorInfo.bVisible = FALSE;
-		SetConsoleCursorInfo(consoleHandle, &cursorInfo);
+	Bitboard(int width = 0, int height = 0)
+		: width(width), height(height), wordsPerRow((width + 63) / 64), bits(wordsPerRow * height, 0) {
 	}
 
-	static void SetConsoleSize(int width, int height, int marginX = 2) {
-		HANDLE consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-		COORD bufferSize = { (SHORT)(width + marginX * 2), (SHORT)(height + 5) };
-		SetConsoleScreenBufferSize(consoleHandle, bufferSize);
-		SMALL_RECT windowSize = { 0, 0, bufferSize.X - 1, bufferSize.Y - 1 };
-		SetConsoleWindowInfo(consoleHandle, TRUE, &windowSize);
+	int Width() const { return width; }
+	int Height() const { return height; }
+	int WordsPerRow() const { return wordsPerRow; }
 
-		HWND hwnd = GetConsoleWindow();
-		LONG style = GetWindowLong(hwnd, GWL_STYLE);
-		style &= ~WS_MAXIMIZEBOX;
-		style &= ~WS_SIZEBOX;
-		SetWindowLong(hwnd, GWL_STYLE, style);
+	bool Get(int x, int y) const {
+		return (bits[y * wordsPerRow + (x >> 6)] >> (x & 63)) & 1;
 	}
 
-	static void ClearConsole() {
-		HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-		CONSOLE_SCREEN_BUFFER_INFO csbi;
-		GetConsoleScreenBufferInfo(hConsole, &csbi);
-		DWORD consoleSize = csbi.dwSize.X * csbi.dwSize.Y;
-		COORD topLeft = { 0, 0 };
-		DWORD charsWritten;
-		FillConsoleOutputCharacter(hConsole, ' ', consoleSize, topLeft, &charsWritten);
-		FillConsoleOutputAttribute(hConsole, csbi.wAttributes, consoleSize, topLeft, &charsWritten);
-		SetConsoleCursorPosition(hConsole, topLeft);
+	void Set(int x, int y) {
+		bits[y * wordsPerRow + (x >> 6)] |= 1ull << (x & 63);
 	}
 
-	class LevelGenerator {
-	public:
-		static int RandomInt(int minValue, int maxValue) {
-			uniform_int_distribution<> dist(minValue, maxValue);
-			return dist(rng);
-		}
-
-		static vector<char> GenerateLevel() {
-			vector<char> level(GameFieldWidth * GameFieldHeight, TileGround);
+	void Reset(int x, int y) {
+		bits[y * wordsPerRow + (x >> 6)] &= ~(1ull << (x & 63));
+	}
 
-			for (int x = 0; x < GameFieldWidth; ++x) {
-				level[x] = TileWall;
-				level[(GameFieldHeight - 1) * GameFieldWidth + x] = TileWall;
-			}
-			for (int y = 0; y < GameFieldHeight; ++y) {
-				level[y * GameFieldWidth] = TileWall;
-				level[y * GameFieldWidth + (GameFieldWidth - 1)] = TileWall;
-			}
-			int playerStartX = 1, playerStartY = 1;
-			int walkableTiles = GameFieldWidth * GameFieldHeight - 2 * GameFieldWidth - 2 * (GameFieldHeight - 2) - 1;
-			int maxClusters = 150;
+	void Clear() {
+		fill(bits.begin(), bits.end(), 0);
+	}
 
-			for (int attempt = 0; attempt < maxClusters; ++attempt) {
-				int clusterWidth = RandomInt(2, 4);
-				int clusterHeight = RandomInt(2, 4);
-				int clusterX = RandomInt(1, GameFieldWidth - clusterWidth - 2);
-				int clusterY = RandomInt(1, GameFieldHeight - clusterHeight - 2);
-				vector<int> clusterIndices;
+	uint64_t* Row(int y) { return &bits[y * wordsPerRow]; }
+	const uint64_t* Row(int y) const { return &bits[y * wordsPerRow]; }
 
-				for (int dy = 0; dy < clusterHeight; ++dy) {
-					for (int dx = 0; dx < clusterWidth; ++dx) {
-						int index = (clusterY + dy) * GameFieldWidth + (clusterX + dx);
+	int Count() const {
+		int count = 0;
 
-						if (level[index] == TileGround) {
-							clusterIndices.push_back(index);
-							level[index] = TileWall;
-						}
-					}
-				}
-				vector<bool> visited(GameFieldWidth * GameFieldHeight, false);
-				queue<GridPosition> bfsQueue;
-				bfsQueue.push({ playerStartX, playerStartY });
-				visited[playerStartY * GameFieldWidth + playerStartX] = true;
-				int reachableCount = 1;
-				const int dxArr[] = { 1, -1, 0, 0 };
-				const int dyArr[] = { 0, 0, 1, -1 };
+		for (uint64_t word : bits) {
+			count += PopCount(word);
+		}
+		return count;
+	}
 
-				while (!bfsQueue.empty()) {
-					GridPosition current = bfsQueue.front(); bfsQueue.pop();
+	// Grows region, which holds the seeds, to every open tile 4-connected to them, and returns
+	// its size. Seeds need not be open themselves. Each round sweeps down and then up the rows:
+	// a row takes in the open tiles under the row before it and then fills along its open runs
+	// in both directions, so a round follows any path that turns vertically at most twice.
+	static int FloodFill(const Bitboard& open, Bitboard& region) {
+		bool changed = true;
 
-					for (int d = 0; d < 4; ++d) {
-						int nx = current.x + dxArr[d];
-						int ny = current.y + dyArr[d];
+		while (changed) {
+			changed = false;
 
-						if (nx > 0 && nx < GameFieldWidth - 1 && ny > 0 && ny < GameFieldHeight - 1) {
-							int idx = ny * GameFieldWidth + nx;
+			for (int y = 0; y < region.height; ++y) {
+				changed |= SpreadRow(open, region, y, y - 1);
+			}
+			for (int y = region.height - 1; y >= 0; --y) {
+				changed |= SpreadRow(open, region, y, y + 1);
+			}
+		}
+		return region.Count();
+	}
 
-							if (!visited[idx] && level[idx] == TileGround) {
-								visited[idx] = true;
-								++reachableCount;
-								bfsQueue.push({ nx, ny });
-							}
-						}
-					}
-				}
-				if (reachableCount < walkableTiles - (int)clusterIndices.size()) {
-					for (int idx : clusterIndices) {
-						level[idx] = TileGround;
-					}
-				}
-				else {
-					walkableTiles -= (int)clusterIndices.size();
+	// Calls visit(x, y) for every set bit, row by row and left to right.
+	template <typename Visit>
+	void ForEach(Visit visit) const {
+		for (int y = 0; y < height; ++y) {
+			for (int w = 0; w < wordsPerRow; ++w) {
+				for (uint64_t word = bits[y * wordsPerRow + w]; word; word &= word - 1) {
+					visit(w * 64 + LowestBit(word), y);
 				}
 			}
-			return level;
 		}
-	};
+	}
 
-	class LevelRenderer {
-	public:
-		static void DrawInitialMap(const vector<char>& levelData, const map<GridPosition, char>& entityMap, int marginX = 2);
-		static void DrawRow(const vector<char>& levelData, const map<GridPosition, char>& entityMap, int row, int marginX = 2);
-		static void DrawChangedRows(const vector<char>& levelData, const map<GridPosition, char>& entityMap, int prevRow, int curRow, int marginX = 2);
-	private:
-		static void SetTileColor(HANDLE hConsole, char ch);
-	};
-};
+	static int PopCount(uint64_t word) {
+#ifdef _MSC_VER
+		return (int)__popcnt64(word);
+#else
+		return __builtin_popcountll(word);
+#endif
+	}
+
+	static int LowestBit(uint64_t word) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, word);
+		return (int)index;
+#else
+		return __builtin_ctzll(word);
+#endif
+	}
+
+private:
+	int width, height, wordsPerRow;
+	vector<uint64_t> bits;
+
+	// Kogge-Stone fills: spread the set bits of seeds through runs of open bits toward higher
+	// and lower columns, in six shift steps each.
+	static uint64_t FillUp(uint64_t seeds, uint64_t open) {
+		seeds |= open & (seeds << 1); open &= open << 1;
+		seeds |= open & (seeds << 2); open &= open << 2;
+		seeds |= open & (seeds << 4); open &= open << 4;
+		seeds |= open & (seeds << 8); open &= open << 8;
+		seeds |= open & (seeds << 16); open &= open << 16;
+		return seeds | (open & (seeds << 32));
+	}
 
-void Engine::LevelRenderer::DrawInitialMap(const vector<char>& levelData, const map<GridPosition, char>& entityMap, int marginX) {
-	HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-	COORD pos = { 0, 0 };
-	SetConsoleCursorPosition(hConsole, pos);
+	static uint64_t FillDown(uint64_t seeds, uint64_t open) {
+		seeds |= open & (seeds >> 1); open &= open >> 1;
+		seeds |= open & (seeds >> 2); open &= open >> 2;
+		seeds |= open & (seeds >> 4); open &= open >> 4;
+		seeds |= open & (seeds >> 8); open &= open >> 8;
+		seeds |= open & (seeds >> 16); open &= open >> 16;
+		return seeds | (open & (seeds >> 32));
+	}
 
-	for (int y = 0; y < GameFieldHeight; ++y) {
-		for (int i = 0; i < marginX; ++i) {
-			cout << ' ';
+	static bool SpreadRow(const Bitboard& open, Bitboard& region, int y, int from) {
+		uint64_t* row = region.Row(y);
+		const uint64_t* mask = open.Row(y);
+		const uint64_t* neighbour = from >= 0 && from < region.height ? region.Row(from) : nullptr;
+		int words = region.wordsPerRow;
+		bool changed = false;
+		uint64_t carry = 0;
+
+		for (int w = 0; w < words; ++w) {
+			uint64_t grown = row[w] | (mask[w] & (carry | (neighbour ? neighbour[w] : 0)));
+			grown = FillUp(grown, mask[w]);
+			carry = grown >> 63;
+			changed |= grown != row[w];
+			row[w] = grown;
 		}
-		for (int x = 0; x < GameFieldWidth; ++x) {
-			GridPosition gp{ x, y };
-			char ch = entityMap.count(gp) ? entityMap.at(gp) : levelData[y * GameFieldWidth + x];
-			SetTileColor(hConsole, ch);
-			cout << ch;
+		carry = 0;
+
+		for (int w = words - 1; w >= 0; --w) {
+			uint64_t grown = FillDown(row[w] | (mask[w] & carry), mask[w]);
+			carry = grown << 63;
+			changed |= grown != row[w];
+			row[w] = grown;
 		}
-		cout << '\n';
+		return changed;
 	}
-	SetConsoleTextAttribute(hConsole, 7);
-}
+};
 
-void Engine::LevelRenderer::DrawRow(const vector<char>& levelData, const map<GridPosition, char>& entityMap, int row, int marginX) {
-	if (row < 0 || row >= GameFieldHeight) {
-		return;
+// A width x height grid kept as ChunkSize x ChunkSize blocks. A block is allocated the first time
+// one of its tiles is written; reads from a block that never was return the fill value, so a
+// huge grid only costs memory where something has been put.
+template <typename T>
+class ChunkedGrid {
+public:
+	static constexpr int ChunkShift = 5;
+	static constexpr int ChunkSize = 1 << ChunkShift;
+
+	ChunkedGrid(int width, int height, T fill)
+		: width(width), height(height), chunksX((width + ChunkSize - 1) >> ChunkShift),
+		chunksY((height + ChunkSize - 1) >> ChunkShift), fill(fill), chunks(chunksX * chunksY) {
 	}
-	HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-	COORD pos = { 0, (SHORT)row };
-	SetConsoleCursorPosition(hConsole, pos);
 
-	for (int i = 0; i < marginX; ++i) {
-		cout << ' ';
+	int Width() const { return width; }
+	int Height() const { return height; }
+	int ChunksX() const { return chunksX; }
+	int ChunksY() const { return chunksY; }
+
+	bool InBounds(GridPosition pos) const {
+		return pos.x >= 0 && pos.x < width && pos.y >= 0 && pos.y < height;
 	}
-	for (int x = 0; x < GameFieldWidth; ++x) {
-		GridPosition gp{ x, row };
-		char ch = entityMap.count(gp) ? entityMap.at(gp) : levelData[row * GameFieldWidth + x];
-		SetTileColor(hConsole, ch);
-		cout << ch;
+
+	T Get(GridPosition pos) const {
+		if (!InBounds(pos)) {
+			return fill;
+		}
+		const vector<T>& chunk = chunks[ChunkIndex(pos)];
+		return chunk.empty() ? fill : chunk[LocalIndex(pos)];
 	}
-	SetConsoleTextAttribute(hConsole, 7);
-}
 
-void Engine::LevelRenderer::DrawChangedRows(const vector<char>& levelData, const map<GridPosition, char>& entityMap, int prevRow, int curRow, int marginX) {
-	if (prevRow != curRow) {
-		DrawRow(levelData, entityMap, prevRow, marginX);
+	// Writable tile; allocates its block on first use.
+	T& Ref(GridPosition pos) {
+		vector<T>& chunk = chunks[ChunkIndex(pos)];
+
+		if (chunk.empty()) {
+			chunk.assign(ChunkSize * ChunkSize, fill);
+			++allocated;
+		}
+		return chunk[LocalIndex(pos)];
 	}
-	DrawRow(levelData, entityMap, curRow, marginX);
-}
 
-void Engine::LevelRenderer::SetTileColor(HANDLE hConsole, char ch) {
-	switch (ch) {
-	case TileWall: {
-		SetConsoleTextAttribute(hConsole, 8);
-		break;
+	void Set(GridPosition pos, T value) {
+		Ref(pos) = value;
 	}
-	case TilePlayer: {
-		SetConsoleTextAttribute(hConsole, 9);
-		break;
+
+	// Copies count tiles of row y starting at x into out, one block at a time.
+	void ReadRow(int y, int x, int count, T* out) const {
+		while (count > 0) {
+			int run = min(count, ChunkSize - (x & (ChunkSize - 1)));
+
+			if (y < 0 || y >= height || x < 0 || x >= width || chunks[ChunkIndex({ x, y })].empty()) {
+				std::fill(out, out + run, fill);
+			}
+			else {
+				const T* source = &chunks[ChunkIndex({ x, y })][LocalIndex({ x, y })];
+				copy(source, source + min(run, width - x), out);
+				std::fill(out + min(run, width - x), out + run, fill);
+			}
+			out += run;
+			x += run;
+			count -= run;
+		}
 	}
-	case TileEnemy: {
-		SetConsoleTextAttribute(hConsole, 14);
-		break;
+
+	// Copies count tiles from in into row y starting at x, one block at a time.
+	void WriteRow(int y, int x, int count, const T* in) {
+		while (count > 0) {
+			int run = min(count, ChunkSize - (x & (ChunkSize - 1)));
+			copy(in, in + run, &Ref({ x, y }));
+			in += run;
+			x += run;
+			count -= run;
+		}
 	}
-	case TileMerchant: {
-		SetConsoleTextAttribute(hConsole, 11);
-		break;
+
+	void Clear() {
+		for (vector<T>& chunk : chunks) {
+			vector<T>().swap(chunk);
+		}
+		allocated = 0;
 	}
-	case TileMiniBoss: {
-		SetConsoleTextAttribute(hConsole, 13);
-		break;
+
+	size_t AllocatedChunks() const {
+		return allocated;
 	}
-	case TileBoss: {
-		SetConsoleTextAttribute(hConsole, 4);
-		break;
+
+	size_t MemoryBytes() const {
+		return chunks.size() * sizeof(vector<T>) + allocated * ChunkSize * ChunkSize * sizeof(T);
 	}
-	default: {
-		SetConsoleTextAttribute(hConsole, 7);
-		break;
+
+private:
+	int width, height, chunksX, chunksY;
+	T fill;
+	vector<vector<T>> chunks;
+	size_t allocated = 0;
+
+	int ChunkIndex(GridPosition pos) const {
+		return (pos.y >> ChunkShift) * chunksX + (pos.x >> ChunkShift);
 	}
+
+	static int LocalIndex(GridPosition pos) {
+		return ((pos.y & (ChunkSize - 1)) << ChunkShift) | (pos.x & (ChunkSize - 1));
 	}
-}
+};
 
-class Game {
+// The tiles of a level, with a parallel bitmap of the ground tiles for walkability tests and
+// scans. A world that fits in the active area is generated whole; a larger one
+// is streamed: only the chunks around the player are generated, as they come into range, and
+// AI, pathfinding and entity updates stay inside that active area. Tiles of chunks that were
+// never generated read as wall.
+class LevelMap {
 public:
-	vector<char> LevelData;
-	map<GridPosition, char> EntityMap;
-	Player player;
-	GridPosition playerPos;
-	enum class Direction { Up, Down, Left, Right, None };
+	static constexpr int ChunkSize = ChunkedGrid<char>::ChunkSize;
+	static constexpr int ActiveRadius = 3;
+	static constexpr int ActiveSpan = (2 * ActiveRadius + 1) * ChunkSize;
+	static constexpr int RegionColumns = 4;
+	static constexpr int RegionRows = 2;
+	static constexpr int RegionCount = RegionColumns * RegionRows;
+
+	// Open tiles of the active area grouped by region: the area is cut into RegionColumns x
+	// RegionRows blocks, and region r owns tiles[regionBegin[r], regionBegin[r + 1]). Order
+	// within a region is up to whoever draws from it.
+	struct OpenTileIndex {
+		vector<GridPosition> tiles;
+		int regionBegin[RegionCount + 1] = {};
+	};
 
-	Game() {
-		player = { 100, 100, 10, 5, 1, 100 };
-		playerPos = { 1, 1 };
-		GenerateNewLevel();
+	uint32_t seed = 0;
+	GridPosition start{ 1, 1 };
+
+	LevelMap(int width = (int)GameFieldWidth, int height = (int)GameFieldHeight)
+		: tiles(width, height, TileWall), ground((width + 63) / 64, height, 0),
+		generated(tiles.ChunksX() * tiles.ChunksY(), false) {
+		ResetActiveArea();
 	}
 
-	void DrawHUD(const string& message = "") {
-		string msg = message.empty() ? PlayerStatus() : message;
-		HUDBar::DrawHUDBar(2, msg);
+	int Width() const { return tiles.Width(); }
+	int Height() const { return tiles.Height(); }
+	int ChunksX() const { return tiles.ChunksX(); }
+	int ChunksY() const { return tiles.ChunksY(); }
+
+	char At(GridPosition pos) const {
+		return tiles.Get(pos);
 	}
 
-	string PlayerStatus() const {
-		stringstream ss;
-		ss << "HP:" << player.hp << "/" << player.maxHp
-			<< " ATK:" << player.attack
-			<< " DEF:" << player.defense
-			<< " LVL:" << player.level
-			<< " GOLD:" << player.money;
-		return ss.str();
+	bool IsGround(GridPosition pos) const {
+		return InBounds(pos) && (GroundWord(pos.x >> 6, pos.y) >> (pos.x & 63)) & 1;
 	}
 
-	static string PlayerStatusStatic(const Player& player) {
-		stringstream ss;
-		ss << "HP:" << player.hp << "/" << player.maxHp
-			<< " ATK:" << player.attack
-			<< " DEF:" << player.defense
-			<< " LVL:" << player.level
-			<< " GOLD:" << player.money;
-		return ss.str();
+	// Bit i is set when tile (64 * wordX + i, y) is ground.
+	uint64_t GroundWord(int wordX, int y) const {
+		return ground.Get({ wordX, y });
 	}
 
-	class InputManager {
-	public:
-		static bool up, down, left, right;
+	bool InBounds(GridPosition pos) const {
+		return tiles.InBounds(pos);
+	}
 
-		static void Update() {
-			while (_kbhit()) {
-				char key = _getch();
-				key = tolower(key);
+	void Set(GridPosition pos, char tile) {
+		tiles.Set(pos, tile);
+		uint64_t bit = 1ull << (pos.x & 63);
+		uint64_t& word = ground.Ref({ pos.x >> 6, pos.y });
+		uint64_t before = word;
+		word = tile == TileGround ? word | bit : word & ~bit;
+		openTilesValid = openTilesValid && word == before;
+	}
 
-				switch (key) {
-				case 'w': {
-					up = true;
-					break;
-				}
-				case 's': {
-					down = true;
-					break;
-				}
-				case 'a': {
-					left = true;
-					break;
-				}
-				case 'd': {
-					right = true;
-					break;
-				}
-				case 27: {
-					exit(0);
-					break;
+	// Calls visit(pos) for every open tile of the active area, row by row. Reads the ground
+	// bitmap a word at a time and only visits the set bits.
+	template <typename Visit>
+	void ForEachOpenTile(Visit visit) const {
+		for (int y = active.y; y < active.y + active.height; ++y) {
+			for (int wordX = active.x >> 6; wordX * 64 < active.x + active.width; ++wordX) {
+				int first = max(0, active.x - wordX * 64), last = min(64, active.x + active.width - wordX * 64);
+				uint64_t word = GroundWord(wordX, y) & (~0ull << first);
+
+				if (last < 64) {
+					word &= (1ull << last) - 1;
 				}
+				for (; word; word &= word - 1) {
+					visit(GridPosition{ wordX * 64 + Bitboard::LowestBit(word), y });
 				}
 			}
 		}
-		static void Reset() {
-			up = down = left = right = false;
+	}
+
+	// The index of open tiles, built on first use after the tiles or the active area change.
+	OpenTileIndex& OpenTiles() {
+		if (!openTilesValid) {
+			BuildOpenTiles();
 		}
-	};
+		return openTiles;
+	}
 
-	class HUDBar {
-	public:
-		static string lastMessage;
+	int RegionOf(GridPosition pos) const {
+		int column = (pos.x - active.x) * RegionColumns / max(1, active.width);
+		int row = (pos.y - active.y) * RegionRows / max(1, active.height);
+		return row * RegionColumns + column;
+	}
 
-		static void DrawHUDBar(int marginX, const string& message) {
-			if (message == lastMessage) {
-				return;
-			}
-			lastMessage = message;
-			HANDLE consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-			SetConsoleTextAttribute(consoleHandle, 7);
-			COORD pos = { 0, (SHORT)(GameFieldHeight + 1) };
-			SetConsoleCursorPosition(consoleHandle, pos);
-			string margin(marginX, ' ');
-			cout << margin;
+	void ReadRow(int y, int x, int count, char* out) const {
+		tiles.ReadRow(y, x, count, out);
+	}
 
-			for (int i = 0; i < GameFieldWidth; ++i) {
-				cout << '=';
-			}
-			cout << '\n';
-			cout << margin;
-			SetConsoleTextAttribute(consoleHandle, 14);
-			cout << message;
+	bool Streamed() const {
+		return Width() > ActiveSpan || Height() > ActiveSpan;
+	}
 
-			if ((int)message.size() < GameFieldWidth) {
-				cout << string(GameFieldWidth - message.size(), ' ');
-			}
-			cout << '\n';
-			SetConsoleTextAttribute(consoleHandle, 7);
-			cout << margin;
+	// Takes a whole level laid out row by row.
+	void Load(const vector<char>& level) {
+		LoadArea({ 0, 0, Width(), Height() }, level);
+	}
 
-			for (int i = 0; i < GameFieldWidth; ++i) {
-				cout << '=';
-			}
-			cout << '\n';
-		}
+	// Takes the tiles of area, row by row, marks the chunks it covers as generated and makes it
+	// the active area. area must be whole chunks, or end at the world's edge.
+	void LoadArea(const GridRect& area, const vector<char>& level) {
+		for (int y = 0; y < area.height; ++y) {
+			const char* row = &level[y * area.width];
+			tiles.WriteRow(area.y + y, area.x, area.width, row);
 
-		static void ClearHUDBar(int marginX) {
-			HANDLE consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-			SetConsoleTextAttribute(consoleHandle, 7);
-			COORD pos = { 0, (SHORT)(GameFieldHeight + 1) };
-			SetConsoleCursorPosition(consoleHandle, pos);
-			string margin(marginX, ' ');
+			for (int x = 0; x < area.width;) {
+				uint64_t& word = ground.Ref({ (area.x + x) >> 6, area.y + y });
+				int end = min(area.width, x + 64 - ((area.x + x) & 63));
 
-			for (int i = 0; i < 3; ++i) {
-				cout << margin;
-				for (int j = 0; j < GameFieldWidth; ++j) cout << ' ';
-				cout << '\n';
+				for (; x < end; ++x) {
+					uint64_t bit = 1ull << ((area.x + x) & 63);
+					word = row[x] == TileGround ? word | bit : word & ~bit;
+				}
 			}
-			lastMessage = "";
 		}
-	};
-
-	class EntityManager {
-	public:
-
-		class Encounters {
-		public:
-			static bool showingMessage;
-			static chrono::steady_clock::time_point lastMessageTime;
-			static string currentMessage;
-
-			static void HandleEncounter(Game& game, char entityType) {
-				switch (entityType) {
-				case TileEnemy: {
-					currentMessage = "Encountered an enemy!";
-					EnemyEncounter(game);
-					break;
-				}
-				case TileMerchant: {
-					currentMessage = "Encountered a merchant!";
-					MerchantEncounter(game);
-					break;
-				}
-				case TileBoss: {
-					currentMessage = "Encountered a boss!";
-					BossEncounter(game);
-					break;
-				}
-				case TileMiniBoss: {
-					currentMessage = "Encountered a miniboss!";
-					MinibossEncounter(game);
-					break;
-				}
-				default: {
-					currentMessage = "";
-					return;
-				}
-				}
-				showingMessage = true;
-				lastMessageTime = chrono::steady_clock::now();
-				Game::HUDBar::DrawHUDBar(2, currentMessage);
+		for (int cy = area.y / ChunkSize; cy * ChunkSize < area.y + area.height; ++cy) {
+			for (int cx = area.x / ChunkSize; cx * ChunkSize < area.x + area.width; ++cx) {
+				MarkGenerated(cx, cy);
 			}
+		}
+		active = area;
+		openTilesValid = false;
+	}
 
-			static void EnemyEncounter(Game& game) {
-				Combat::StartCombat(game, TileEnemy);
-			}
+	void Clear() {
+		tiles.Clear();
+		ground.Clear();
+		fill(generated.begin(), generated.end(), false);
+		ResetActiveArea();
+		openTilesValid = false;
+	}
 
-			static void MerchantEncounter(Game& game) {
-				Shop::OpenShop(game);
-			}
+	bool ChunkGenerated(int cx, int cy) const {
+		return generated[cy * ChunksX() + cx];
+	}
 
-			static void BossEncounter(Game& game) {
-				Combat::StartCombat(game, TileBoss);
-			}
+	void MarkGenerated(int cx, int cy) {
+		generated[cy * ChunksX() + cx] = true;
+	}
 
-			static void MinibossEncounter(Game& game) {
-				Combat::StartCombat(game, TileMiniBoss);
-			}
+	const GridRect& ActiveArea() const {
+		return active;
+	}
 
-			static void UpdateHUD(Player& player) {
-				using namespace chrono;
+	// Moves the active area of a streamed world to the chunks around pos. Returns whether it moved.
+	bool CenterActiveArea(GridPosition pos) {
+		if (!Streamed()) {
+			return false;
+		}
+		GridRect area = AreaAround(Width(), Height(), pos);
 
-				if (showingMessage) {
-					auto now = steady_clock::now();
+		if (area == active) {
+			return false;
+		}
+		active = area;
+		openTilesValid = false;
+		return true;
+	}
 
-					if (duration_cast<milliseconds>(now - lastMessageTime).count() >= 2000) {
-						showingMessage = false;
-						Game::HUDBar::DrawHUDBar(2, Game::PlayerStatusStatic(player));
-					}
-				}
-			}
-		};
+	// The active area of a width x height world with the player at pos.
+	static GridRect AreaAround(int width, int height, GridPosition pos) {
+		if (width <= ActiveSpan && height <= ActiveSpan) {
+			return { 0, 0, width, height };
+		}
+		int chunksX = (width + ChunkSize - 1) / ChunkSize, chunksY = (height + ChunkSize - 1) / ChunkSize;
+		int firstX = max(0, pos.x / ChunkSize - ActiveRadius), firstY = max(0, pos.y / ChunkSize - ActiveRadius);
+		int lastX = min(chunksX - 1, pos.x / ChunkSize + ActiveRadius), lastY = min(chunksY - 1, pos.y / ChunkSize + ActiveRadius);
+		return { firstX * ChunkSize, firstY * ChunkSize,
+			min(width, (lastX + 1) * ChunkSize) - firstX * ChunkSize, min(height, (lastY + 1) * ChunkSize) - firstY * ChunkSize };
+	}
 
-		class Shop {
-		public:
-			static void OpenShop(Game& game) {
-				game.Pause();
-				Engine::ClearConsole();
-
-				bool inShop = true;
-
-				auto getChoice = []() -> char {
-					char c = std::tolower(_getch());
-					std::cout << c << "\n";
-					return c;
-					};
-
-				auto confirmAction = [](const std::string& msg) -> bool {
-					std::cout << msg << " (y/n): ";
-					char c;
-					while (true) {
-						c = std::tolower(_getch());
-						if (c == 'y') { std::cout << "y\n"; return true; }
-						if (c == 'n') { std::cout << "n\n"; return false; }
-					}
-					};
-
-				while (inShop) {
-					while (true) {
-						Engine::ClearConsole();
-						std::cout << "=== MERCHANT'S SHOP ===\n";
-						std::cout << "Welcome, traveler!\n\n";
-						std::cout << "Your current stats:\n";
-						std::cout << "HP: " << game.player.hp << "/" << game.player.maxHp << "\n";
-						std::cout << "ATK: " << game.player.attack << "\n";
-						std::cout << "DEF: " << game.player.defense << "\n";
-						std::cout << "LVL: " << game.player.level << "\n";
-						std::cout << "Gold: " << game.player.money << "\n\n";
-
-						std::cout << "Choose an option:\n";
-						std::cout << "[H] Heal to full HP (10 gold)\n";
-						std::cout << "[1] Upgrade Max HP (+10) (20 gold)\n";
-						std::cout << "[2] Upgrade Attack (+2) (15 gold)\n";
-						std::cout << "[3] Upgrade Defense (+2) (15 gold)\n";
-						std::cout << "[E] Exit Shop\n\n";
-						std::cout << "Enter your choice: ";
-
-						char choice = getChoice();
-						bool validInput = true;
-
-						switch (choice) {
-						case 'h':
-							if (game.player.money >= 10 && confirmAction("Heal to full HP for 10 gold?")) {
-								game.player.hp = game.player.maxHp;
-								game.player.money -= 10;
-								std::cout << "You have been fully healed!\n";
-							}
-							else validInput = false;
-							break;
+	size_t AllocatedChunks() const {
+		return tiles.AllocatedChunks();
+	}
 
-						case '1':
-							if (game.player.money >= 20 && confirmAction("Upgrade Max HP for 20 gold?")) {
-								game.player.maxHp += 10;
-								game.player.money -= 20;
-								std::cout << "Your maximum HP increased to " << game.player.maxHp << "!\n";
-							}
-							else validInput = false;
-							break;
+	size_t MemoryBytes() const {
+		return tiles.MemoryBytes() + ground.MemoryBytes() + generated.size() / 8
+			+ openTiles.tiles.capacity() * sizeof(GridPosition);
+	}
 
-						case '2':
-							if (game.player.money >= 15 && confirmAction("Upgrade Attack for 15 gold?")) {
-								game.player.attack += 2;
-								game.player.money -= 15;
-								std::cout << "Your attack increased to " << game.player.attack << "!\n";
-							}
-							else validInput = false;
-							break;
+private:
+	ChunkedGrid<char> tiles;
+	ChunkedGrid<uint64_t> ground;
+	vector<bool> generated;
+	GridRect active;
+	OpenTileIndex openTiles;
+	bool openTilesValid = false;
+
+	// Counts the open tiles of each region, then writes each one into its region's slice.
+	void BuildOpenTiles() {
+		int* begin = openTiles.regionBegin;
+		fill(begin, begin + RegionCount + 1, 0);
+		ForEachOpenTile([&](GridPosition pos) { begin[RegionOf(pos) + 1]++; });
+
+		for (int region = 0; region < RegionCount; ++region) {
+			begin[region + 1] += begin[region];
+		}
+		int next[RegionCount];
+		copy(begin, begin + RegionCount, next);
+		openTiles.tiles.resize(begin[RegionCount]);
+		ForEachOpenTile([&](GridPosition pos) { openTiles.tiles[next[RegionOf(pos)]++] = pos; });
+		openTilesValid = true;
+	}
 
-						case '3':
-							if (game.player.money >= 15 && confirmAction("Upgrade Defense for 15 gold?")) {
-								game.player.defense += 2;
-								game.player.money -= 15;
-								std::cout << "Your defense increased to " << game.player.defense << "!\n";
-							}
-							else validInput = false;
-							break;
+	void ResetActiveArea() {
+		active = Streamed() ? GridRect{ 0, 0, 0, 0 } : GridRect{ 0, 0, Width(), Height() };
+	}
+};
 
-						case 'e':
-							std::cout << "Safe travels, adventurer!\n";
-							inShop = false;
-							break;
+// The entities of a level, kept as parallel arrays indexed by a stable id: position, tile type,
+// hit points, attack, defense and AI state. An id stays with its entity until it is erased, and
+// freed ids are reused from a free list, so per-tick loops walk the arrays in order and only skip
+// the few free slots. Every tile of the occupancy grid stores the id standing on it, and a coarse
+// grid counts the entities in each BlockSize x BlockSize block, so nearest-entity queries skip
+// empty parts of the map.
+class EntityGrid {
+public:
+	typedef uint16_t EntityId;
+	static const EntityId NoEntity = 0xFFFF;
+	static const int BlockShift = 3;
+	static const int BlockSize = 1 << BlockShift;
 
-						default:
-							std::cout << "Invalid choice. Try again...\n";
-							validInput = false;
-							break;
-						}
+	enum class AIState : uint8_t { Wander, Pursue };
 
-						if (validInput) {
-							std::cout << "Press any key to continue...\n";
-							_getch();  							break;
-						}
-						else {
-							std::cout << "Press any key to continue...\n";
-							_getch();
-						}
-					}
-				}
+	struct Stats {
+		int hp, attack, defense;
+	};
 
-				Engine::ClearConsole();
-				game.Resume();
-			}
-		};
+	EntityGrid(int width = (int)GameFieldWidth, int height = (int)GameFieldHeight)
+		: cells(width, height, NoEntity), blocks((width + BlockSize - 1) >> BlockShift, (height + BlockSize - 1) >> BlockShift, 0) {
+		Reserve(64);
+	}
 
-		class Combat {
-		public:
-			static void StartCombat(Game& game, const char enemyType) {
-				Engine::ClearConsole();
-
-				int enemyHp, enemyAttack, enemyDefense, reward;
-				std::string enemyName;
-
-				switch (enemyType) {
-				case TileEnemy:
-					enemyName = "Enemy";
-					enemyHp = 40;
-					enemyAttack = 7;
-					enemyDefense = 2;
-					reward = 10;
-					break;
-				case TileMiniBoss:
-					enemyName = "MiniBoss";
-					enemyHp = 100;
-					enemyAttack = 14;
-					enemyDefense = 4;
-					reward = 50;
-					break;
-				case TileBoss:
-					enemyName = "Boss";
-					enemyHp = 300;
-					enemyAttack = 20;
-					enemyDefense = 8;
-					reward = 200;
-					break;
-				default:
-					return;
-				}
+	bool Has(GridPosition pos) const {
+		return cells.Get(pos) != NoEntity;
+	}
 
-				bool playerAlive = true;
-				game.Pause();
+	EntityId IdAt(GridPosition pos) const {
+		return cells.Get(pos);
+	}
 
-				auto getChoice = []() -> char {
-					char c = std::tolower(_getch());
-					std::cout << c << "\n";
-					return c;
-					};
+	// Returns the entity tile at pos, or 0 when the tile is empty.
+	char At(GridPosition pos) const {
+		EntityId id = cells.Get(pos);
+		return id == NoEntity ? 0 : types[id];
+	}
 
-				auto confirmAction = [](const std::string& msg) -> bool {
-					std::cout << msg << " (y/n): ";
-					char c;
-					while (true) {
-						c = std::tolower(_getch());
-						if (c == 'y') { std::cout << "y\n"; return true; }
-						if (c == 'n') { std::cout << "n\n"; return false; }
-					}
-					};
+	// Puts a new entity on an empty tile, or retypes the one already there.
+	EntityId Set(GridPosition pos, char type, Stats stats = { 0, 0, 0 }) {
+		EntityId& cell = cells.Ref(pos);
 
-				while (enemyHp > 0 && game.player.hp > 0) {
-					int damageToPlayer = max(0, enemyAttack - game.player.defense);
-					game.player.hp -= damageToPlayer;
+		if (cell != NoEntity) {
+			types[cell] = type;
+			return cell;
+		}
+		EntityId id;
 
-					Engine::ClearConsole();
-					if (game.player.hp <= 0) {
-						std::cout << enemyName << " attacks! You take " << damageToPlayer
-							<< " damage. (HP:0/" << game.player.maxHp << ")\n";
-						std::cout << "\nYou were defeated...\n";
-						playerAlive = false;
-						break;
-					}
-					else {
-						std::cout << enemyName << " attacks! You take " << damageToPlayer
-							<< " damage. (HP:" << game.player.hp << "/" << game.player.maxHp << ")\n";
-					}
-					std::cout << enemyName << " HP: " << enemyHp << "\n";
-					std::cout << "Your HP: " << game.player.hp << "\n";
-
-					std::cout << "[A] Attack  [H] Heal  [Q] Run\n";
-					std::cout << "Your choice: ";
-					char action = getChoice();
-					bool validInput = true;
-
-					switch (action) {
-					case 'a': {
-						if (confirmAction("Attack " + enemyName + "?")) {
-							int damageToEnemy = max(0, game.player.attack - enemyDefense);
-							enemyHp -= damageToEnemy;
-							Engine::ClearConsole();
-							std::cout << "You hit " << enemyName << " for " << damageToEnemy
-								<< " damage! (Enemy HP: " << max(0, enemyHp) << ")\n";
-							std::cout << "Your HP: " << game.player.hp << "\n";
-						}
-						else validInput = false;
-						break;
-					}
-					case 'h': {
-						int heal = min(15, game.player.maxHp - game.player.hp);
-						if (confirmAction("Heal " + std::to_string(heal) + " HP?")) {
-							game.player.hp += heal;
-							Engine::ClearConsole();
-							std::cout << "You heal " << heal << " HP. (HP:" << game.player.hp
-								<< "/" << game.player.maxHp << ")\n";
-							std::cout << enemyName << " HP: " << enemyHp << "\n";
-						}
-						else validInput = false;
-						break;
+		if (!freeIds.empty()) {
+			id = freeIds.back();
+			freeIds.pop_back();
+		}
+		else {
+			id = (EntityId)types.size();
+			positions.emplace_back();
+			types.emplace_back();
+			hp.emplace_back();
+			attack.emplace_back();
+			defense.emplace_back();
+			states.emplace_back();
+		}
+		cell = id;
+		positions[id] = pos;
+		types[id] = type;
+		hp[id] = stats.hp;
+		attack[id] = stats.attack;
+		defense[id] = stats.defense;
+		states[id] = AIState::Wander;
+		++blocks.Ref(Block(pos));
+		++live;
+		return id;
+	}
+
+	void Erase(GridPosition pos) {
+		EntityId id = cells.Get(pos);
+
+		if (id == NoEntity) {
+			return;
+		}
+		cells.Set(pos, NoEntity);
+		--blocks.Ref(Block(pos));
+		types[id] = 0;
+		freeIds.push_back(id);
+		--live;
+	}
+
+	// Moves the entity at from onto an empty tile.
+	void Move(GridPosition from, GridPosition to) {
+		EntityId id = cells.Get(from);
+
+		if (id == NoEntity) {
+			return;
+		}
+		cells.Set(from, NoEntity);
+		cells.Set(to, id);
+		positions[id] = to;
+
+		if (Block(from) != Block(to)) {
+			--blocks.Ref(Block(from));
+			++blocks.Ref(Block(to));
+		}
+	}
+
+	// Trades the places of the entities at a and b.
+	void Swap(GridPosition a, GridPosition b) {
+		EntityId first = cells.Get(a), second = cells.Get(b);
+		cells.Set(a, second);
+		cells.Set(b, first);
+		positions[first] = b;
+		positions[second] = a;
+	}
+
+	void Clear() {
+		for (EntityId id = 0; id < Slots(); ++id) {
+			if (types[id]) {
+				cells.Set(positions[id], NoEntity);
+			}
+		}
+		positions.clear();
+		types.clear();
+		hp.clear();
+		attack.clear();
+		defense.clear();
+		states.clear();
+		freeIds.clear();
+		blocks.Clear();
+		live = 0;
+	}
+
+	// Ids run from 0 to Slots() - 1; a free slot has type 0.
+	EntityId Slots() const { return (EntityId)types.size(); }
+	bool Alive(EntityId id) const { return id < Slots() && types[id]; }
+	GridPosition Position(EntityId id) const { return positions[id]; }
+	char Type(EntityId id) const { return types[id]; }
+	int& Hp(EntityId id) { return hp[id]; }
+	int Hp(EntityId id) const { return hp[id]; }
+	int Attack(EntityId id) const { return attack[id]; }
+	int Defense(EntityId id) const { return defense[id]; }
+	AIState& State(EntityId id) { return states[id]; }
+	AIState State(EntityId id) const { return states[id]; }
+
+	// Calls visit(id) for every live entity in id order.
+	template <typename Visit>
+	void ForEach(Visit visit) const {
+		for (EntityId id = 0; id < Slots(); ++id) {
+			if (types[id]) {
+				visit(id);
+			}
+		}
+	}
+
+	size_t Size() const {
+		return live;
+	}
+
+	// The entity inside bounds closest to from in Manhattan distance among those accept(pos, type)
+	// takes, or { -1, -1 }. Ties go to the lower row, then the lower column. Blocks are visited in
+	// rings around from's block, skipping empty ones, until no ring further out can hold anything
+	// closer.
+	template <typename Accept>
+	GridPosition Nearest(GridPosition from, const GridRect& bounds, Accept accept) const {
+		GridPosition best{ -1, -1 };
+		int bestDistance = INT_MAX;
+
+		if (bounds.width <= 0 || bounds.height <= 0) {
+			return best;
+		}
+		GridPosition home = Block(from);
+		int firstX = bounds.x >> BlockShift, lastX = (bounds.x + bounds.width - 1) >> BlockShift;
+		int firstY = bounds.y >> BlockShift, lastY = (bounds.y + bounds.height - 1) >> BlockShift;
+		int rings = max(max(home.x - firstX, lastX - home.x), max(home.y - firstY, lastY - home.y));
+
+		for (int ring = 0; ring <= rings && (ring == 0 || (ring - 1) * BlockSize + 1 <= bestDistance); ++ring) {
+			for (int by = max(firstY, home.y - ring); by <= min(lastY, home.y + ring); ++by) {
+				bool edgeRow = by == home.y - ring || by == home.y + ring;
+				int step = edgeRow || ring == 0 ? 1 : 2 * ring;
+
+				for (int bx = home.x - ring; bx <= home.x + ring; bx += step) {
+					if (bx < firstX || bx > lastX || blocks.Get({ bx, by }) == 0) {
+						continue;
 					}
-					case 'q':
-						if (confirmAction("Flee the battle?")) {
-							std::cout << "You fled the battle!\n";
-							game.Resume();
-							return;
+					int x0 = max(bounds.x, bx << BlockShift), x1 = min(bounds.x + bounds.width, (bx + 1) << BlockShift);
+					int y0 = max(bounds.y, by << BlockShift), y1 = min(bounds.y + bounds.height, (by + 1) << BlockShift);
+
+					for (int y = y0; y < y1; ++y) {
+						for (int x = x0; x < x1; ++x) {
+							EntityId id = cells.Get({ x, y });
+
+							if (id == NoEntity) {
+								continue;
+							}
+							int distance = abs(x - from.x) + abs(y - from.y);
+							bool closer = distance < bestDistance
+								|| (distance == bestDistance && (y < best.y || (y == best.y && x < best.x)));
+
+							if (closer && accept(GridPosition{ x, y }, types[id])) {
+								best = { x, y };
+								bestDistance = distance;
+							}
 						}
-						else validInput = false;
-						break;
-					default:
-						std::cout << "Invalid input.\n";
-						validInput = false;
-						break;
 					}
+				}
+			}
+		}
+		return best;
+	}
+
+	size_t MemoryBytes() const {
+		size_t perEntity = sizeof(GridPosition) + sizeof(char) + 3 * sizeof(int) + sizeof(AIState);
+		return cells.MemoryBytes() + blocks.MemoryBytes() + types.capacity() * perEntity + freeIds.capacity() * sizeof(EntityId);
+	}
+
+private:
+	ChunkedGrid<EntityId> cells;
+	ChunkedGrid<uint16_t> blocks;
+	vector<GridPosition> positions;
+	vector<char> types;
+	vector<int> hp;
+	vector<int> attack;
+	vector<int> defense;
+	vector<AIState> states;
+	vector<EntityId> freeIds;
+	size_t live = 0;
+
+	void Reserve(size_t count) {
+		positions.reserve(count);
+		types.reserve(count);
+		hp.reserve(count);
+		attack.reserve(count);
+		defense.reserve(count);
+		states.reserve(count);
+	}
+
+	static GridPosition Block(GridPosition pos) {
+		return { pos.x >> BlockShift, pos.y >> BlockShift };
+	}
+};
+
+// The game's content: the color of every glyph on the map, the archetypes the waves are made of
+// (role, combat stats, reward and encounter text) and the wave schedule. It is compiled from an
+// INI file into tables indexed by glyph, so the renderer, the AI and the encounters look a type
+// up instead of switching on it. DefaultSource is the built-in content; --content replaces it.
+class ContentTable {
+public:
+	enum class Role : uint8_t { None, Enemy, Boss, Merchant };
+
+	struct Archetype {
+		Role role = Role::None;
+		int hp = 0, attack = 0, defense = 0, reward = 0;
+		string name;
+		string encounter;
+
+		EntityGrid::Stats Stats() const { return { hp, attack, defense }; }
+	};
+
+	// Spawns type on every wave from first to last (0: no last wave) that is a multiple of
+	// every: base plus one per perWaves waves (0: no growth). What it spawns is taken off the
+	// count of takesFrom, and the counts of the types in clears drop to zero.
+	struct SpawnRule {
+		char type = 0;
+		int base = 0, perWaves = 0, every = 1, first = 1, last = 0;
+		char takesFrom = 0;
+		string clears;
+	};
+
+	struct Spawn {
+		char type;
+		int count;
+	};
+
+	static const char* const DefaultSource;
+
+	ContentTable() {
+		fill(begin(colors), end(colors), (unsigned char)7);
+		fill(begin(roles), end(roles), Role::None);
+	}
+
+	unsigned char Color(char glyph) const { return colors[(unsigned char)glyph]; }
+	Role RoleOf(char glyph) const { return roles[(unsigned char)glyph]; }
+	bool Hostile(char glyph) const { return roles[(unsigned char)glyph] == Role::Enemy || roles[(unsigned char)glyph] == Role::Boss; }
+	const Archetype& operator[](char glyph) const { return archetypes[(unsigned char)glyph]; }
+	// Glyphs of the archetypes in the order the file defines them.
+	const vector<char>& Types() const { return types; }
+	const vector<SpawnRule>& Schedule() const { return schedule; }
+	// The text the table was compiled from.
+	const string& Source() const { return source; }
+
+	// What wave spawns, in schedule order; types whose count comes out zero are left out.
+	void WaveSpawns(int wave, vector<Spawn>& spawns) const {
+		spawns.clear();
+		auto count = [&](char type) -> int& {
+			for (Spawn& spawn : spawns) {
+				if (spawn.type == type)
+					return spawn.count;
+			}
+			spawns.push_back({ type, 0 });
+			return spawns.back().count;
+		};
+		for (const SpawnRule& rule : schedule) {
+			if (wave < rule.first || (rule.last > 0 && wave > rule.last) || wave % rule.every != 0) {
+				continue;
+			}
+			int spawned = rule.base + (rule.perWaves > 0 ? wave / rule.perWaves : 0);
+			count(rule.type) += spawned;
+
+			if (rule.takesFrom) {
+				int& from = count(rule.takesFrom);
+				from = max(0, from - spawned);
+			}
+			for (char type : rule.clears) {
+				count(type) = 0;
+			}
+		}
+		spawns.erase(remove_if(spawns.begin(), spawns.end(), [](const Spawn& spawn) { return spawn.count <= 0; }), spawns.end());
+	}
+
+	static const ContentTable& Default() {
+		static const ContentTable table = []() {
+			ContentTable compiled;
+			string error;
+
+			if (!Compile(DefaultSource, compiled, error)) {
+				cerr << "Built-in content: " << error << "\n";
+				abort();
+			}
+			return compiled;
+		}();
+		return table;
+	}
+
+	static bool Load(const string& path, ContentTable& table, string& error) {
+		ifstream in(path, ios::binary);
+
+		if (!in) {
+			error = "Could not read " + path;
+			return false;
+		}
+		string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+		if (!Compile(text, table, error)) {
+			error = path + ": " + error;
+			return false;
+		}
+		return true;
+	}
+
+	static bool Compile(const string& text, ContentTable& table, string& error);
+private:
+	unsigned char colors[256];
+	Role roles[256];
+	Archetype archetypes[256];
+	vector<char> types;
+	vector<SpawnRule> schedule;
+	string source;
+};
+
+const char* const ContentTable::DefaultSource = R"(; ASCII Dungeon content. Colors are console color numbers, 0 to 15.
+
+[tile wall]
+color = 8
+
+[tile ground]
+color = 7
+
+[tile player]
+color = 9
+
+[archetype enemy]
+glyph = E
+color = 14
+name = Enemy
+encounter = Encountered an enemy!
+hp = 40
+attack = 7
+defense = 2
+reward = 10
+
+[archetype miniboss]
+glyph = b
+color = 13
+name = MiniBoss
+encounter = Encountered a miniboss!
+hp = 100
+attack = 14
+defense = 4
+reward = 50
+
+[archetype boss]
+glyph = B
+color = 4
+role = boss
+name = Boss
+encounter = Encountered a boss!
+hp = 300
+attack = 20
+defense = 8
+reward = 200
+
+[archetype merchant]
+glyph = M
+color = 11
+role = merchant
+name = Merchant
+encounter = Encountered a merchant!
+
+; Every wave: 4 enemies plus one per two waves, and a merchant. Every 10th wave turns wave / 10
+; of the enemies into minibosses, and wave 100 is the boss alone.
+[spawn enemy]
+base = 4
+per_waves = 2
+
+[spawn miniboss]
+every = 10
+per_waves = 10
+takes_from = enemy
+
+[spawn boss]
+first = 100
+last = 100
+base = 1
+clears = enemy miniboss
+
+[spawn merchant]
+base = 1
+)";
+
+// One pass over the lines with no copies of the text: "[kind name]" opens a section and
+// "key = value" sets a field of it; lines starting with ; or # are comments. Spawn rules name
+// archetypes, which may come later in the file, so they are resolved at the end.
+bool ContentTable::Compile(const string& text, ContentTable& table, string& error) {
+	enum class Section { None, Tile, Archetype, Spawn };
+	struct PendingSpawn {
+		string_view type, takesFrom, clears;
+		SpawnRule rule;
+		int line;
+	};
+	auto trim = [](string_view s) {
+		while (!s.empty() && (s.front() == ' ' || s.front() == '\t' || s.front() == '\r'))
+			s.remove_prefix(1);
+		while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r'))
+			s.remove_suffix(1);
+		return s;
+	};
+	ContentTable result;
+	unordered_map<string_view, char> archetypeGlyphs;
+	vector<PendingSpawn> spawns;
+	Section section = Section::None;
+	string_view sectionName;
+	char tileGlyph = 0;
+	Archetype archetype;
+	char glyph = 0;
+	unsigned char color = 7;
+	bool hasName = false, hasEncounter = false;
+	int lineNumber = 0, sectionLine = 0;
+
+	auto fail = [&](int line, const string& message) {
+		error = "line " + to_string(line) + ": " + message;
+		return false;
+	};
+	auto number = [&](string_view value, int low, int high, int& out) {
+		int parsed = 0;
+		auto [end, ec] = from_chars(value.data(), value.data() + value.size(), parsed);
+		if (ec != errc() || end != value.data() + value.size() || parsed < low || parsed > high)
+			return false;
+		out = parsed;
+		return true;
+	};
+	auto finishSection = [&]() {
+		if (section != Section::Archetype) {
+			return true;
+		}
+		if (!glyph) {
+			return fail(sectionLine, "archetype " + string(sectionName) + " has no glyph");
+		}
+		if (glyph == TileWall || glyph == TileGround || glyph == TilePlayer || result.roles[(unsigned char)glyph] != Role::None) {
+			return fail(sectionLine, "glyph " + string(1, glyph) + " is already taken");
+		}
+		if (!archetypeGlyphs.emplace(sectionName, glyph).second) {
+			return fail(sectionLine, "archetype " + string(sectionName) + " is defined twice");
+		}
+		if (archetype.role == Role::None) {
+			archetype.role = Role::Enemy;
+		}
+		if (!hasName) {
+			archetype.name = string(sectionName);
+		}
+		if (!hasEncounter) {
+			archetype.encounter = "Encountered " + archetype.name + "!";
+		}
+		result.roles[(unsigned char)glyph] = archetype.role;
+		result.colors[(unsigned char)glyph] = color;
+		result.archetypes[(unsigned char)glyph] = move(archetype);
+		result.types.push_back(glyph);
+		return true;
+	};
+
+	for (size_t lineStart = 0; lineStart < text.size();) {
+		size_t lineEnd = text.find('\n', lineStart);
+		if (lineEnd == string::npos)
+			lineEnd = text.size();
+		string_view line = trim(string_view(text).substr(lineStart, lineEnd - lineStart));
+		lineStart = lineEnd + 1;
+		++lineNumber;
+
+		if (line.empty() || line.front() == ';' || line.front() == '#') {
+			continue;
+		}
+		if (line.front() == '[') {
+			if (line.back() != ']') {
+				return fail(lineNumber, "unterminated section header");
+			}
+			if (!finishSection()) {
+				return false;
+			}
+			string_view header = trim(line.substr(1, line.size() - 2));
+			size_t space = header.find(' ');
+			string_view kind = header.substr(0, space);
+			sectionName = space == string_view::npos ? string_view() : trim(header.substr(space + 1));
+			sectionLine = lineNumber;
+
+			if (sectionName.empty()) {
+				return fail(lineNumber, "section needs a name: [" + string(kind) + " name]");
+			}
+			if (kind == "tile") {
+				section = Section::Tile;
+				tileGlyph = sectionName == "wall" ? TileWall : sectionName == "ground" ? TileGround : sectionName == "player" ? TilePlayer : 0;
+
+				if (!tileGlyph) {
+					return fail(lineNumber, "unknown tile " + string(sectionName));
+				}
+			}
+			else if (kind == "archetype") {
+				section = Section::Archetype;
+				archetype = Archetype();
+				glyph = 0;
+				color = 7;
+				hasName = hasEncounter = false;
+			}
+			else if (kind == "spawn") {
+				section = Section::Spawn;
+				spawns.push_back({ sectionName, {}, {}, SpawnRule(), lineNumber });
+			}
+			else {
+				return fail(lineNumber, "unknown section kind " + string(kind));
+			}
+			continue;
+		}
+		size_t equals = line.find('=');
+		if (equals == string_view::npos) {
+			return fail(lineNumber, "expected key = value");
+		}
+		string_view key = trim(line.substr(0, equals));
+		string_view value = trim(line.substr(equals + 1));
+		bool known = true, valid = true;
+		int parsed = 0;
+
+		switch (section) {
+		case Section::None: {
+			return fail(lineNumber, "key outside a section");
+		}
+		case Section::Tile: {
+			if (key == "color") {
+				valid = number(value, 0, 15, parsed);
+				result.colors[(unsigned char)tileGlyph] = (unsigned char)parsed;
+			}
+			else {
+				known = false;
+			}
+			break;
+		}
+		case Section::Archetype: {
+			if (key == "glyph") {
+				valid = value.size() == 1 && (unsigned char)value[0] > ' ' && value[0] != 127;
+				glyph = valid ? value[0] : 0;
+			}
+			else if (key == "color") {
+				valid = number(value, 0, 15, parsed);
+				color = (unsigned char)parsed;
+			}
+			else if (key == "role") {
+				archetype.role = value == "enemy" ? Role::Enemy : value == "boss" ? Role::Boss : value == "merchant" ? Role::Merchant : Role::None;
+				valid = archetype.role != Role::None;
+			}
+			else if (key == "name") {
+				archetype.name = string(value);
+				hasName = true;
+			}
+			else if (key == "encounter") {
+				archetype.encounter = string(value);
+				hasEncounter = true;
+			}
+			else if (key == "hp") {
+				valid = number(value, 0, 1000000, archetype.hp);
+			}
+			else if (key == "attack") {
+				valid = number(value, 0, 1000000, archetype.attack);
+			}
+			else if (key == "defense") {
+				valid = number(value, 0, 1000000, archetype.defense);
+			}
+			else if (key == "reward") {
+				valid = number(value, 0, 1000000, archetype.reward);
+			}
+			else {
+				known = false;
+			}
+			break;
+		}
+		case Section::Spawn: {
+			PendingSpawn& spawn = spawns.back();
+
+			if (key == "base") {
+				valid = number(value, 0, 100000, spawn.rule.base);
+			}
+			else if (key == "per_waves") {
+				valid = number(value, 0, 100000, spawn.rule.perWaves);
+			}
+			else if (key == "every") {
+				valid = number(value, 1, 100000, spawn.rule.every);
+			}
+			else if (key == "first") {
+				valid = number(value, 0, INT_MAX, spawn.rule.first);
+			}
+			else if (key == "last") {
+				valid = number(value, 0, INT_MAX, spawn.rule.last);
+			}
+			else if (key == "takes_from") {
+				spawn.takesFrom = value;
+			}
+			else if (key == "clears") {
+				spawn.clears = value;
+			}
+			else {
+				known = false;
+			}
+			break;
+		}
+		}
+		if (!known) {
+			return fail(lineNumber, "unknown key " + string(key));
+		}
+		if (!valid) {
+			return fail(lineNumber, "bad value for " + string(key) + ": " + string(value));
+		}
+	}
+	if (!finishSection()) {
+		return false;
+	}
+	auto resolve = [&](string_view name, char& out) {
+		auto found = archetypeGlyphs.find(name);
+		out = found == archetypeGlyphs.end() ? 0 : found->second;
+		return out != 0;
+	};
+	for (PendingSpawn& spawn : spawns) {
+		SpawnRule& rule = spawn.rule;
+
+		if (!resolve(spawn.type, rule.type)) {
+			return fail(spawn.line, "spawn of unknown archetype " + string(spawn.type));
+		}
+		if (!spawn.takesFrom.empty() && !resolve(spawn.takesFrom, rule.takesFrom)) {
+			return fail(spawn.line, "takes_from unknown archetype " + string(spawn.takesFrom));
+		}
+		for (size_t start = 0; start < spawn.clears.size();) {
+			size_t end = min(spawn.clears.find(' ', start), spawn.clears.size());
+			string_view name = spawn.clears.substr(start, end - start);
+			char cleared = 0;
+
+			if (!name.empty()) {
+				if (!resolve(name, cleared)) {
+					return fail(spawn.line, "clears unknown archetype " + string(name));
+				}
+				rule.clears += cleared;
+			}
+			start = end + 1;
+		}
+		result.schedule.push_back(rule);
+	}
+	result.source = text;
+	table = move(result);
+	return true;
+}
+
+// Everything the game needs from the console. The compositor and the text screens only
+// talk to this interface, so the same code runs on the Win32 console and on any VT terminal.
+class TerminalBackend {
+public:
+	virtual ~TerminalBackend() {}
+	virtual void Setup(int width, int height, int marginX) = 0;
+	virtual void Clear() = 0;
+	virtual void SetCursor(int x, int y) = 0;
+	virtual void SetColor(unsigned char color) = 0;
+	virtual void Write(const char* data, size_t size) = 0;
+	virtual bool KeyAvailable() = 0;
+	virtual int ReadKey() = 0;
+
+	virtual void Wait(int milliseconds) {
+		this_thread::sleep_for(chrono::milliseconds(milliseconds));
+	}
+
+	// Blocks until a key can be read or the timeout passes, and says which one happened.
+	virtual bool WaitForInput(int timeoutMs) {
+		if (KeyAvailable()) {
+			return true;
+		}
+		Wait(timeoutMs);
+		return KeyAvailable();
+	}
+
+	static void AppendNumber(string& out, int value) {
+		char digits[12];
+		auto result = to_chars(digits, digits + sizeof(digits), value);
+		out.append(digits, result.ptr);
+	}
+
+	static void AppendCursor(string& out, int x, int y) {
+		out += "\x1b[";
+		AppendNumber(out, y + 1);
+		out += ';';
+		AppendNumber(out, x + 1);
+		out += 'H';
+	}
+
+	// Console attributes keep blue in bit 0 and red in bit 2, ANSI colors the other way around.
+	static void AppendColor(string& out, unsigned char color) {
+		static const char ansiOrder[] = { '0', '4', '2', '6', '1', '5', '3', '7' };
+
+		if (color == 7) {
+			out += "\x1b[0m";
+			return;
+		}
+		out += "\x1b[";
+		out += (color & 8) ? '9' : '3';
+		out += ansiOrder[color & 7];
+		out += 'm';
+	}
+};
+
+// An ostream for the text screens that hands everything to a terminal's Write as it is
+// streamed, so the text stays in order with the cursor and color calls between insertions.
+class TerminalStream : public ostream {
+public:
+	explicit TerminalStream(TerminalBackend& terminal) : ostream(nullptr), buffer(terminal) {
+		rdbuf(&buffer);
+	}
+
+private:
+	class Buffer : public streambuf {
+	public:
+		explicit Buffer(TerminalBackend& terminal) : terminal(terminal) {}
+
+	protected:
+		int_type overflow(int_type c) override {
+			if (!traits_type::eq_int_type(c, traits_type::eof())) {
+				char ch = traits_type::to_char_type(c);
+				terminal.Write(&ch, 1);
+			}
+			return traits_type::not_eof(c);
+		}
+
+		streamsize xsputn(const char* data, streamsize size) override {
+			terminal.Write(data, (size_t)size);
+			return size;
+		}
+
+	private:
+		TerminalBackend& terminal;
+	};
+
+	Buffer buffer;
+};
+
+#ifdef _WIN32
+class Win32Terminal : public TerminalBackend {
+public:
+	void Setup(int width, int height, int marginX) override {
+		HANDLE consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
+		DWORD mode = 0;
+		GetConsoleMode(consoleHandle, &mode);
+		SetConsoleMode(consoleHandle, mode | ENABLE_PROCESSED_OUTPUT | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+
+		CONSOLE_CURSOR_INFO cursorInfo;
+		GetConsoleCursorInfo(consoleHandle, &cursorInfo);
+		cursorInfo.bVisible = FALSE;
+		SetConsoleCursorInfo(consoleHandle, &cursorInfo);
+
+		COORD bufferSize = { (SHORT)(width + marginX * 2), (SHORT)(height + 5) };
+		SetConsoleScreenBufferSize(consoleHandle, bufferSize);
+		SMALL_RECT windowSize = { 0, 0, (SHORT)(bufferSize.X - 1), (SHORT)(bufferSize.Y - 1) };
+		SetConsoleWindowInfo(consoleHandle, TRUE, &windowSize);
+
+		HWND hwnd = GetConsoleWindow();
+		LONG style = GetWindowLong(hwnd, GWL_STYLE);
+		style &= ~WS_MAXIMIZEBOX;
+		style &= ~WS_SIZEBOX;
+		SetWindowLong(hwnd, GWL_STYLE, style);
+	}
+
+	void Clear() override {
+		HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+		CONSOLE_SCREEN_BUFFER_INFO csbi;
+		GetConsoleScreenBufferInfo(hConsole, &csbi);
+		DWORD consoleSize = csbi.dwSize.X * csbi.dwSize.Y;
+		COORD topLeft = { 0, 0 };
+		DWORD charsWritten;
+		FillConsoleOutputCharacter(hConsole, ' ', consoleSize, topLeft, &charsWritten);
+		FillConsoleOutputAttribute(hConsole, csbi.wAttributes, consoleSize, topLeft, &charsWritten);
+		SetConsoleCursorPosition(hConsole, topLeft);
+	}
+
+	void SetCursor(int x, int y) override {
+		COORD pos = { (SHORT)x, (SHORT)y };
+		SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), pos);
+	}
+
+	void SetColor(unsigned char color) override {
+		SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), color);
+	}
+
+	void Write(const char* data, size_t size) override {
+		cout.flush();
+		DWORD written = 0;
+		WriteConsoleA(GetStdHandle(STD_OUTPUT_HANDLE), data, (DWORD)size, &written, nullptr);
+	}
+
+	bool KeyAvailable() override {
+		return _kbhit() != 0;
+	}
+
+	int ReadKey() override {
+		return _getch();
+	}
+
+	// The input handle is signaled by any console event; _kbhit drops the ones that are not
+	// keystrokes, so focus and mouse events only cost a loop iteration.
+	bool WaitForInput(int timeoutMs) override {
+		HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+		auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+
+		while (!_kbhit()) {
+			auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+			if (remaining <= 0 || WaitForSingleObject(input, (DWORD)remaining) != WAIT_OBJECT_0) {
+				return _kbhit() != 0;
+			}
+		}
+		return true;
+	}
+};
+#else
+// VT terminal with termios raw input. Output of every kind is kept in one buffer, in order, and
+// goes out in a single write() whenever the game is about to wait or read a key.
+class AnsiTerminal : public TerminalBackend {
+public:
+	~AnsiTerminal() {
+		Flush();
+	}
+
+	void Setup(int width, int height, int marginX) override {
+		if (!rawMode && tcgetattr(STDIN_FILENO, &savedMode) == 0) {
+			termios raw = savedMode;
+			raw.c_lflag &= ~(ICANON | ECHO);
+			raw.c_cc[VMIN] = 1;
+			raw.c_cc[VTIME] = 0;
+			tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+			rawMode = true;
+			atexit(RestoreMode);
+
+			for (int signalNumber : { SIGINT, SIGTERM, SIGHUP }) {
+				signal(signalNumber, RestoreAndRaise);
+			}
+		}
+		pending += "\x1b[8;";
+		AppendNumber(pending, height + 5);
+		pending += ';';
+		AppendNumber(pending, width + marginX * 2);
+		pending += "t\x1b[?25l";
+		Flush();
+	}
+
+	void Clear() override {
+		pending += "\x1b[0m\x1b[2J\x1b[H";
+	}
+
+	void SetCursor(int x, int y) override {
+		AppendCursor(pending, x, y);
+	}
+
+	void SetColor(unsigned char color) override {
+		AppendColor(pending, color);
+	}
+
+	void Write(const char* data, size_t size) override {
+		pending.append(data, size);
+	}
+
+	void Wait(int milliseconds) override {
+		Flush();
+		TerminalBackend::Wait(milliseconds);
+	}
+
+	bool KeyAvailable() override {
+		Flush();
+		return InputReady(0);
+	}
+
+	bool WaitForInput(int timeoutMs) override {
+		Flush();
+		return InputReady(timeoutMs);
+	}
+
+	// Arrow and function keys arrive as escape sequences; they are swallowed so only a lone
+	// Esc press reads as 27.
+	int ReadKey() override {
+		Flush();
+		unsigned char key = 0;
+
+		if (read(STDIN_FILENO, &key, 1) != 1) {
+			return 0;
+		}
+		if (key == 27 && InputReady(10)) {
+			unsigned char discard[16];
+			read(STDIN_FILENO, discard, sizeof(discard));
+			return 0;
+		}
+		return key;
+	}
+
+private:
+	static termios savedMode;
+	static bool rawMode;
+	string pending;
+
+	void Flush() {
+		WriteAll(pending.data(), pending.size());
+		pending.clear();
+	}
+
+	static void WriteAll(const char* data, size_t size) {
+		while (size > 0) {
+			ssize_t written = write(STDOUT_FILENO, data, size);
+
+			if (written <= 0) {
+				return;
+			}
+			data += written;
+			size -= (size_t)written;
+		}
+	}
+
+	static bool InputReady(int timeoutMs) {
+		fd_set readSet;
+		FD_ZERO(&readSet);
+		FD_SET(STDIN_FILENO, &readSet);
+		timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+		return select(STDIN_FILENO + 1, &readSet, nullptr, nullptr, &timeout) > 0;
+	}
+
+	static void RestoreMode() {
+		const char restore[] = "\x1b[0m\x1b[?25h";
+		WriteAll(restore, sizeof(restore) - 1);
+		tcsetattr(STDIN_FILENO, TCSANOW, &savedMode);
+	}
+
+	// Ctrl+C and kill skip the atexit handlers, so the terminal is restored here before the
+	// signal runs its default course. write and tcsetattr are safe in a signal handler.
+	static void RestoreAndRaise(int signalNumber) {
+		RestoreMode();
+		signal(signalNumber, SIG_DFL);
+		raise(signalNumber);
+	}
+};
+
+termios AnsiTerminal::savedMode;
+bool AnsiTerminal::rawMode = false;
+#endif
+
+// Whole-file I/O for save games. Map gives a read-only view of a file straight from the page
+// cache, so a loader reads fields in place instead of copying the file into a buffer first.
+// WriteAtomically writes a temporary next to the target and renames it over the target, so a
+// crash mid-save leaves the previous file intact. It does not fsync, which keeps an autosave
+// cheap; the rename still never exposes a half-written file.
+class BinaryFile {
+public:
+	BinaryFile() = default;
+	BinaryFile(const BinaryFile&) = delete;
+	BinaryFile& operator=(const BinaryFile&) = delete;
+
+	~BinaryFile() {
+		Unmap();
+	}
+
+	bool Map(const string& path) {
+		Unmap();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER fileSize;
+
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+			Unmap();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		data = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		size = (size_t)fileSize.QuadPart;
+#else
+		descriptor = open(path.c_str(), O_RDONLY);
+		struct stat info;
+
+		if (descriptor < 0 || fstat(descriptor, &info) != 0 || info.st_size == 0) {
+			Unmap();
+			return false;
+		}
+		void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		data = view == MAP_FAILED ? nullptr : (const char*)view;
+		size = (size_t)info.st_size;
+#endif
+		if (!data) {
+			Unmap();
+			return false;
+		}
+		return true;
+	}
+
+	const char* Data() const { return data; }
+	size_t Size() const { return size; }
+
+	static bool WriteAtomically(const string& path, const vector<char>& bytes) {
+		string temporary = path + ".tmp";
+		{
+			ofstream out(temporary, ios::binary | ios::trunc);
+			out.write(bytes.data(), (streamsize)bytes.size());
+
+			if (!out) {
+				return false;
+			}
+		}
+#ifdef _WIN32
+		return MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		return rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+	}
+
+private:
+	const char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int descriptor = -1;
+#endif
+
+	void Unmap() {
+#ifdef _WIN32
+		if (data) {
+			UnmapViewOfFile(data);
+		}
+		if (mapping) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data) {
+			munmap((void*)data, size);
+		}
+		if (descriptor >= 0) {
+			close(descriptor);
+		}
+		descriptor = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+};
+
+// A recorded session: the seed and settings it started with, the save it resumed from if any,
+// and every frame and key in the order the game used them. Each event is stored as a varint of
+// (milliseconds since the previous event << 2 | kind), and key events are followed by the key.
+// A polled key was read by the frame after KeyAvailable reported it. Any other key was read
+// without asking first, as blocking prompts did before the shop and fight screens became part
+// of the frame. Keeping the two apart lets a replay answer KeyAvailable exactly as the recorded
+// run saw it. The header also holds the frame count
+// and the state digest taken at the start of the last frame, so a replay can check that it
+// ended up in the same place. A run played with a --content file carries the file's text.
+class InputRecording {
+public:
+	enum Kind : uint8_t { Frame, TickFrame, Key, PolledKey };
+
+	struct Event {
+		Kind kind;
+		uint32_t deltaMs;
+		int key;
+	};
+
+	static const uint32_t Version = 5;
+
+	uint32_t seed = 0;
+	int worldWidth = 0;
+	int worldHeight = 0;
+	bool everyEnemyPursues = false;
+	int pursuers = 1;
+	bool liveMenus = false;
+	vector<char> snapshot;
+	// Empty for the built-in content.
+	string content;
+	vector<char> events;
+	uint32_t frames = 0;
+	uint64_t lastFrameDigest = 0;
+
+	void Append(Kind kind, uint32_t deltaMs, int key = 0) {
+		for (uint64_t value = (uint64_t)deltaMs << 2 | kind; ; value >>= 7) {
+			if (value < 0x80) {
+				events.push_back((char)value);
+				break;
+			}
+			events.push_back((char)((value & 0x7F) | 0x80));
+		}
+		if (kind == Key || kind == PolledKey) {
+			events.push_back((char)key);
+		}
+	}
+
+	// Decodes the event at offset and moves offset past it; false at the end or on a truncated event.
+	bool Next(size_t& offset, Event& event) const {
+		uint64_t value = 0;
+
+		for (int shift = 0; ; shift += 7) {
+			if (offset >= events.size() || shift > 35) {
+				return false;
+			}
+			unsigned char byte = (unsigned char)events[offset++];
+			value |= (uint64_t)(byte & 0x7F) << shift;
+
+			if (byte < 0x80) {
+				break;
+			}
+		}
+		event.kind = (Kind)(value & 3);
+		event.deltaMs = (uint32_t)(value >> 2);
+		event.key = 0;
+
+		if (event.kind == Key || event.kind == PolledKey) {
+			if (offset >= events.size()) {
+				return false;
+			}
+			event.key = (unsigned char)events[offset++];
+		}
+		return true;
+	}
+
+	bool Save(const string& path) const {
+		vector<char> bytes(4);
+		memcpy(&bytes[0], "ADRC", 4);
+		Put<uint32_t>(bytes, Version);
+		Put<uint32_t>(bytes, seed);
+		Put<int32_t>(bytes, worldWidth);
+		Put<int32_t>(bytes, worldHeight);
+		Put<uint8_t>(bytes, everyEnemyPursues);
+		Put<int32_t>(bytes, pursuers);
+		Put<uint8_t>(bytes, liveMenus);
+		Put<uint32_t>(bytes, frames);
+		Put<uint64_t>(bytes, lastFrameDigest);
+		Put<uint32_t>(bytes, (uint32_t)snapshot.size());
+		bytes.insert(bytes.end(), snapshot.begin(), snapshot.end());
+		Put<uint32_t>(bytes, (uint32_t)content.size());
+		bytes.insert(bytes.end(), content.begin(), content.end());
+		bytes.insert(bytes.end(), events.begin(), events.end());
+		return BinaryFile::WriteAtomically(path, bytes);
+	}
+
+	bool Load(const string& path) {
+		BinaryFile file;
+		const size_t fixedSize = 4 + 4 + 4 + 4 + 4 + 1 + 4 + 1 + 4 + 8 + 4;
+		uint32_t version, snapshotSize, contentSize;
+
+		if (!file.Map(path) || file.Size() < fixedSize || memcmp(file.Data(), "ADRC", 4) != 0) {
+			return false;
+		}
+		const char* in = file.Data() + 4;
+		Get(in, version);
+		Get(in, seed);
+		Get(in, worldWidth);
+		Get(in, worldHeight);
+		everyEnemyPursues = *in++ != 0;
+		Get(in, pursuers);
+		liveMenus = *in++ != 0;
+		Get(in, frames);
+		Get(in, lastFrameDigest);
+		Get(in, snapshotSize);
+		const char* end = file.Data() + file.Size();
+
+		if (version != Version || snapshotSize + sizeof(contentSize) > (size_t)(end - in)) {
+			return false;
+		}
+		snapshot.assign(in, in + snapshotSize);
+		in += snapshotSize;
+		Get(in, contentSize);
+
+		if (contentSize > (size_t)(end - in)) {
+			return false;
+		}
+		content.assign(in, in + contentSize);
+		events.assign(in + contentSize, end);
+		return true;
+	}
+
+private:
+	template <typename T>
+	static void Put(vector<char>& bytes, T value) {
+		const char* raw = (const char*)&value;
+		bytes.insert(bytes.end(), raw, raw + sizeof(T));
+	}
+
+	template <typename T>
+	static void Get(const char*& in, T& value) {
+		memcpy(&value, in, sizeof(T));
+		in += sizeof(T);
+	}
+};
+
+// Passes everything through to another terminal and logs each key the game reads into an
+// InputRecording. The game marks frames itself with MarkFrame. Times come from the wall clock,
+// or from SetClock in headless runs that keep virtual time.
+class RecordingTerminal : public TerminalBackend {
+public:
+	InputRecording recording;
+
+	explicit RecordingTerminal(TerminalBackend& inner) : inner(inner), start(chrono::steady_clock::now()) {}
+
+	void Setup(int width, int height, int marginX) override { inner.Setup(width, height, marginX); }
+	void Clear() override { inner.Clear(); }
+	void SetCursor(int x, int y) override { inner.SetCursor(x, y); }
+	void SetColor(unsigned char color) override { inner.SetColor(color); }
+	void Write(const char* data, size_t size) override { inner.Write(data, size); }
+	void Wait(int milliseconds) override { inner.Wait(milliseconds); }
+	bool WaitForInput(int timeoutMs) override { return inner.WaitForInput(timeoutMs); }
+
+	bool KeyAvailable() override {
+		polled = inner.KeyAvailable();
+		return polled;
+	}
+
+	int ReadKey() override {
+		int key = inner.ReadKey();
+		recording.Append(polled ? InputRecording::PolledKey : InputRecording::Key, Elapsed(), key);
+		polled = false;
+		return key;
+	}
+
+	void MarkFrame(bool entityTickDue, uint64_t digest) {
+		recording.Append(entityTickDue ? InputRecording::TickFrame : InputRecording::Frame, Elapsed());
+		recording.frames++;
+		recording.lastFrameDigest = digest;
+		polled = false;
+	}
+
+	void SetClock(long long milliseconds) {
+		virtualMs = milliseconds;
+	}
+
+private:
+	TerminalBackend& inner;
+	chrono::steady_clock::time_point start;
+	long long virtualMs = -1;
+	long long lastMs = 0;
+	bool polled = false;
+
+	uint32_t Elapsed() {
+		long long now = virtualMs >= 0 ? virtualMs
+			: chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+		uint32_t delta = (uint32_t)max(0LL, now - lastMs);
+		lastMs = max(lastMs, now);
+		return delta;
+	}
+};
+
+// Feeds a recording back to the game through the same calls the live terminals answer, and
+// never sleeps. Output goes to another terminal, or nowhere when output is null. A paced
+// replay serves each event no earlier than its recorded time, so it plays at the original
+// speed. Otherwise it runs as fast as the game can step. A prompt that asks for a key the
+// recording does not have means the game has left the recorded path; the replay reports the
+// frame and stops.
+class ReplayTerminal : public TerminalBackend {
+public:
+	ReplayTerminal(const InputRecording& recording, TerminalBackend* output, bool paced)
+		: recording(recording), output(output), paced(paced), start(chrono::steady_clock::now()) {
+		Advance();
+	}
+
+	void Setup(int width, int height, int marginX) override { if (output) output->Setup(width, height, marginX); }
+	void Clear() override { if (output) output->Clear(); }
+	void SetCursor(int x, int y) override { if (output) output->SetCursor(x, y); }
+	void SetColor(unsigned char color) override { if (output) output->SetColor(color); }
+	void Write(const char* data, size_t size) override { if (output) output->Write(data, size); }
+	void Wait(int) override {}
+
+	bool KeyAvailable() override {
+		if (!hasPending || pending.kind != InputRecording::PolledKey) {
+			return false;
+		}
+		Pace();
+		return true;
+	}
+
+	int ReadKey() override {
+		if (!hasPending || (pending.kind != InputRecording::Key && pending.kind != InputRecording::PolledKey)) {
+			cerr << "replay left the recording at frame " << framesStarted << ": a prompt wanted a key it does not have\n";
+			exit(1);
+		}
+		Pace();
+		int key = pending.key;
+		Advance();
+		return key;
+	}
+
+	// Starts the next recorded frame and says whether its entity turn was due. Returns false at
+	// the end of the recording, or if keys are left over that the last frame should have read.
+	bool NextFrame(bool& entityTickDue) {
+		if (!hasPending) {
+			return false;
+		}
+		if (pending.kind != InputRecording::Frame && pending.kind != InputRecording::TickFrame) {
+			leftover = true;
+			return false;
+		}
+		Pace();
+		entityTickDue = pending.kind == InputRecording::TickFrame;
+		++framesStarted;
+		Advance();
+		return true;
+	}
+
+	uint32_t FramesStarted() const { return framesStarted; }
+	bool KeysLeftOver() const { return leftover; }
+
+	// Recorded time of the last event served, in milliseconds since the recording started.
+	long long RecordedMs() const { return servedMs; }
+
+private:
+	const InputRecording& recording;
+	TerminalBackend* output;
+	bool paced;
+	chrono::steady_clock::time_point start;
+	size_t offset = 0;
+	InputRecording::Event pending{};
+	bool hasPending = false;
+	long long pendingMs = 0;
+	long long servedMs = 0;
+	uint32_t framesStarted = 0;
+	bool leftover = false;
+
+	void Advance() {
+		hasPending = recording.Next(offset, pending);
+
+		if (hasPending) {
+			pendingMs += pending.deltaMs;
+		}
+	}
+
+	void Pace() {
+		servedMs = pendingMs;
+
+		if (paced) {
+			this_thread::sleep_until(start + chrono::milliseconds(pendingMs));
+		}
+	}
+};
+
+class Engine {
+public:
+	// The console the process runs in. Games are handed a terminal when they are made and never
+	// reach for this one themselves, so any number of them can run side by side.
+	static TerminalBackend& Console() {
+#ifdef _WIN32
+		static Win32Terminal terminal;
+#else
+		static AnsiTerminal terminal;
+#endif
+		return terminal;
+	}
+
+	class Profiler;
+
+	class LevelGenerator {
+	public:
+		static int RandomInt(mt19937& generator, int minValue, int maxValue) {
+			uniform_int_distribution<> dist(minValue, maxValue);
+			return dist(generator);
+		}
+
+		// Keeps the set of tiles reachable from the player start between cluster attempts.
+		// Walling a cluster can only cut that region where it borders the cluster, so the
+		// new reachable count is worked out from the cluster border instead of a flood fill
+		// over the whole level. Results match the full flood fill exactly.
+		class ConnectivityTracker {
+		public:
+			ConnectivityTracker(const vector<char>& level, int width, int startIndex)
+				: level(level), width(width), startIndex(startIndex),
+				reachable(level.size(), false), pendingReachable(level.size(), false),
+				visitStamp(level.size(), 0), borderStamp(level.size(), 0), owner(level.size(), 0),
+				open(width, (int)level.size() / width), region(width, (int)level.size() / width) {
+				reachableCount = FloodFill(reachable);
+			}
+
+			int ReachableAfterWalling(const vector<int>& cluster) {
+				pendingFullFill = !CountLocally(cluster, pendingCount);
+
+				if (pendingFullFill) {
+					pendingCount = FloodFill(pendingReachable);
+				}
+				return pendingCount;
+			}
+
+			void Commit(const vector<int>& cluster) {
+				if (pendingFullFill) {
+					reachable.swap(pendingReachable);
+				}
+				else {
+					for (int idx : cluster) {
+						if (idx != startIndex) {
+							reachable[idx] = false;
+						}
+					}
+					for (int idx : cutOff) {
+						reachable[idx] = false;
+					}
+				}
+				reachableCount = pendingCount;
+			}
+
+		private:
+			const vector<char>& level;
+			int width;
+			int startIndex;
+			vector<bool> reachable;
+			vector<bool> pendingReachable;
+			vector<int> visitStamp;
+			vector<int> borderStamp;
+			vector<int> owner;
+			Bitboard open;
+			Bitboard region;
+			vector<int> border;
+			vector<int> cutOff;
+			vector<vector<int>> searches;
+			vector<size_t> searchHead;
+			vector<int> searchParent;
+			vector<int> growingSearches;
+			int stamp = 0;
+			int reachableCount = 0;
+			int pendingCount = 0;
+			bool pendingFullFill = false;
+
+			// The start tile is always expanded, even once a cluster has walled it over.
+			bool IsOpen(int idx) const {
+				return level[idx] == TileGround || idx == startIndex;
+			}
+
+			// Whole-level fill from the start, done on bitboards and unpacked into visited.
+			int FloodFill(vector<bool>& visited) {
+				for (int y = 0; y < open.Height(); ++y) {
+					for (int x = 0; x < width; ++x) {
+						if (level[y * width + x] == TileGround) {
+							open.Set(x, y);
+						}
+						else {
+							open.Reset(x, y);
+						}
+					}
+				}
+				region.Clear();
+				region.Set(startIndex % width, startIndex / width);
+				int count = Bitboard::FloodFill(open, region);
+				fill(visited.begin(), visited.end(), false);
+				region.ForEach([&](int x, int y) { visited[y * width + x] = true; });
+				return count;
+			}
+
+			// Grows one search per border tile in lockstep. Searches that meet are merged, and a
+			// merged search whose searches all run dry has enumerated a pocket that the cluster
+			// cut off. Once at most one search is still growing the outcome is known, so the
+			// work done is bounded by the size of the pockets rather than the whole level.
+			bool CountLocally(const vector<int>& cluster, int& count) {
+				const int offsets[] = { 1, -1, width, -width };
+				int borderStampValue = ++stamp;
+				count = reachableCount;
+				border.clear();
+				cutOff.clear();
+
+				for (int idx : cluster) {
+					if (idx == startIndex || !reachable[idx]) {
+						continue;
+					}
+					--count;
+
+					for (int offset : offsets) {
+						int next = idx + offset;
+
+						if (reachable[next] && IsOpen(next) && borderStamp[next] != borderStampValue) {
+							borderStamp[next] = borderStampValue;
+							border.push_back(next);
+						}
+					}
+				}
+				if (border.size() <= 1) {
+					return true;
+				}
+				int searchCount = (int)border.size();
+
+				if ((int)searches.size() < searchCount) {
+					searches.resize(searchCount);
+				}
+				searchHead.assign(searchCount, 0);
+				searchParent.resize(searchCount);
+				growingSearches.assign(searchCount, 1);
+				++stamp;
+
+				for (int s = 0; s < searchCount; ++s) {
+					searches[s].clear();
+					searches[s].push_back(border[s]);
+					searchParent[s] = s;
+					visitStamp[border[s]] = stamp;
+					owner[border[s]] = s;
+				}
+				int openRegions = searchCount;
+
+				while (openRegions > 1) {
+					for (int s = 0; s < searchCount && openRegions > 1; ++s) {
+						if (searchHead[s] == searches[s].size()) {
+							continue;
+						}
+						int current = searches[s][searchHead[s]++];
+
+						for (int offset : offsets) {
+							int next = current + offset;
+
+							if (!IsOpen(next)) {
+								continue;
+							}
+							if (visitStamp[next] != stamp) {
+								visitStamp[next] = stamp;
+								owner[next] = s;
+								searches[s].push_back(next);
+								continue;
+							}
+							int root = FindSearch(s), other = FindSearch(owner[next]);
+
+							if (root != other) {
+								searchParent[other] = root;
+								growingSearches[root] += growingSearches[other];
+								--openRegions;
+							}
+						}
+						if (searchHead[s] == searches[s].size() && --growingSearches[FindSearch(s)] == 0) {
+							--openRegions;
+						}
+					}
+				}
+				if (openRegions == 0) {
+					return false;
+				}
+				for (int s = 0; s < searchCount; ++s) {
+					if (growingSearches[FindSearch(s)] == 0) {
+						cutOff.insert(cutOff.end(), searches[s].begin(), searches[s].end());
+					}
+				}
+				if (visitStamp[startIndex] == stamp && growingSearches[FindSearch(owner[startIndex])] == 0) {
+					return false;
+				}
+				count -= (int)cutOff.size();
+				return true;
+			}
+
+			int FindSearch(int s) {
+				while (searchParent[s] != s) {
+					s = searchParent[s] = searchParent[searchParent[s]];
+				}
+				return s;
+			}
+		};
+
+		// The generator for level index of a run. Every level gets its own stream, so a level can
+		// be generated on any thread and in any order and still come out the same.
+		static mt19937 LevelStream(uint32_t runSeed, uint32_t index) {
+			seed_seq levelSeed{ runSeed, index };
+			return mt19937(levelSeed);
+		}
+
+		static vector<char> GenerateLevel(int width, int height, mt19937& generator) {
+			vector<char> level(width * height, TileGround);
+
+			for (int x = 0; x < width; ++x) {
+				level[x] = TileWall;
+				level[(height - 1) * width + x] = TileWall;
+			}
+			for (int y = 0; y < height; ++y) {
+				level[y * width] = TileWall;
+				level[y * width + (width - 1)] = TileWall;
+			}
+			int playerStartX = 1, playerStartY = 1;
+			int walkableTiles = width * height - 2 * width - 2 * (height - 2) - 1;
+			int maxClusters = 150 * width * height / (int)(GameFieldWidth * GameFieldHeight);
+			ScatterClusters(level, width, height, 1, playerStartY * width + playerStartX, walkableTiles, maxClusters, generator);
+			return level;
+		}
+
+		// Fills level with a new layout: the whole level, or for a streamed world a fresh seed and
+		// the chunks around the start. Builds the level's open tile index too, so a level made on
+		// the LevelQueue thread arrives ready for entity placement.
+		static void GenerateLevel(LevelMap& level, GridPosition start, mt19937& generator) {
+			level.start = start;
+
+			if (!level.Streamed()) {
+				level.Load(GenerateLevel(level.Width(), level.Height(), generator));
+			}
+			else {
+				level.Clear();
+				level.seed = (uint32_t)generator();
+				ActivateAround(level, start);
+			}
+			level.OpenTiles();
+		}
+
+		// Moves the active area of a streamed world to pos and generates the chunks that enter it.
+		// Returns whether the area moved.
+		static bool ActivateAround(LevelMap& level, GridPosition pos) {
+			if (!level.CenterActiveArea(pos)) {
+				return false;
+			}
+			const GridRect& area = level.ActiveArea();
+
+			for (int cy = area.y / LevelMap::ChunkSize; cy * LevelMap::ChunkSize < area.y + area.height; ++cy) {
+				for (int cx = area.x / LevelMap::ChunkSize; cx * LevelMap::ChunkSize < area.x + area.width; ++cx) {
+					if (!level.ChunkGenerated(cx, cy)) {
+						GenerateChunk(level, cx, cy);
+					}
+				}
+			}
+			return true;
+		}
+
+		// Lays out one chunk of a streamed world with its own generator seeded from (level seed,
+		// chunk), so a chunk comes out the same whatever order chunks are visited in. Clusters
+		// keep off the chunk's edge tiles, which stay open except on the world border; every open
+		// tile stays connected to that edge and neighbouring edges touch, so the world is connected.
+		static void GenerateChunk(LevelMap& level, int cx, int cy) {
+			int originX = cx * LevelMap::ChunkSize, originY = cy * LevelMap::ChunkSize;
+			int chunkWidth = min(LevelMap::ChunkSize, level.Width() - originX);
+			int chunkHeight = min(LevelMap::ChunkSize, level.Height() - originY);
+			int width = chunkWidth + 2, height = chunkHeight + 2;
+			vector<char> tiles(width * height, TileWall);
+			int walkableTiles = 0, startIndex = -1;
+
+			for (int y = 0; y < chunkHeight; ++y) {
+				for (int x = 0; x < chunkWidth; ++x) {
+					GridPosition pos{ originX + x, originY + y };
+
+					if (pos.x == 0 || pos.y == 0 || pos.x == level.Width() - 1 || pos.y == level.Height() - 1) {
+						continue;
+					}
+					int index = (y + 1) * width + (x + 1);
+					tiles[index] = TileGround;
+					++walkableTiles;
+					bool edge = x == 0 || y == 0 || x == chunkWidth - 1 || y == chunkHeight - 1;
+
+					if (pos == level.start || (startIndex < 0 && edge)) {
+						startIndex = index;
+					}
+				}
+			}
+			if (startIndex >= 0 && chunkWidth >= 8 && chunkHeight >= 8) {
+				seed_seq chunkSeed{ level.seed, (uint32_t)cx, (uint32_t)cy };
+				mt19937 generator(chunkSeed);
+				int maxClusters = 150 * chunkWidth * chunkHeight / (int)(GameFieldWidth * GameFieldHeight);
+				ScatterClusters(tiles, width, height, 2, startIndex, walkableTiles, maxClusters, generator);
+				tiles[startIndex] = TileGround;
+			}
+			for (int y = 0; y < chunkHeight; ++y) {
+				for (int x = 0; x < chunkWidth; ++x) {
+					level.Set({ originX + x, originY + y }, tiles[(y + 1) * width + (x + 1)]);
+				}
+			}
+			level.MarkGenerated(cx, cy);
+		}
+
+	private:
+		// Drops random 2x2 to 4x4 wall clusters at least inset tiles inside a walled level, keeping
+		// each one only if every open tile is still reachable from startIndex.
+		static void ScatterClusters(vector<char>& level, int width, int height, int inset, int startIndex,
+			int walkableTiles, int maxClusters, mt19937& generator) {
+			ConnectivityTracker connectivity(level, width, startIndex);
+			vector<int> clusterIndices;
+
+			for (int attempt = 0; attempt < maxClusters; ++attempt) {
+				int clusterWidth = RandomInt(generator, 2, 4);
+				int clusterHeight = RandomInt(generator, 2, 4);
+				int clusterX = RandomInt(generator, inset, width - clusterWidth - 1 - inset);
+				int clusterY = RandomInt(generator, inset, height - clusterHeight - 1 - inset);
+				clusterIndices.clear();
+
+				for (int dy = 0; dy < clusterHeight; ++dy) {
+					for (int dx = 0; dx < clusterWidth; ++dx) {
+						int index = (clusterY + dy) * width + (clusterX + dx);
+
+						if (level[index] == TileGround) {
+							clusterIndices.push_back(index);
+							level[index] = TileWall;
+						}
+					}
+				}
+				int reachableCount = connectivity.ReachableAfterWalling(clusterIndices);
+
+				if (reachableCount < walkableTiles - (int)clusterIndices.size()) {
+					for (int idx : clusterIndices) {
+						level[idx] = TileGround;
+					}
+				}
+				else {
+					walkableTiles -= (int)clusterIndices.size();
+					connectivity.Commit(clusterIndices);
+				}
+			}
+		}
+	};
+
+	// Lays out the levels of a run ahead of time on a background thread, so a wave transition
+	// only takes one off the queue. Level i comes from LevelGenerator::LevelStream(run seed, i),
+	// so the levels a run sees do not depend on when the thread got round to them. Without
+	// the thread, Pop lays out each level itself; a host running thousands of games does that
+	// rather than keep a thread per game.
+	class LevelQueue {
+	public:
+		static const size_t Depth = 2;
+
+		LevelQueue(int width, int height, GridPosition start, uint32_t runSeed, bool background = true)
+			: width(width), height(height), start(start), runSeed(runSeed),
+			worker(background ? thread(&LevelQueue::Produce, this) : thread()) {
+		}
+
+		LevelQueue(const LevelQueue&) = delete;
+		LevelQueue& operator=(const LevelQueue&) = delete;
+
+		~LevelQueue() {
+			{
+				lock_guard<mutex> lock(guard);
+				stopping = true;
+			}
+			changed.notify_all();
+
+			if (worker.joinable()) {
+				worker.join();
+			}
+		}
+
+		// Drops the levels made so far and carries on from level firstIndex of another run, as
+		// when a saved game is loaded. Does not wait: a level the thread is still working on is
+		// thrown away when it is done.
+		void Restart(int newWidth, int newHeight, uint32_t newRunSeed, uint32_t firstIndex) {
+			{
+				lock_guard<mutex> lock(guard);
+
+				if (newWidth == width && newHeight == height && newRunSeed == runSeed && firstIndex == nextIndex) {
+					return;
+				}
+				ready.clear();
+				width = newWidth;
+				height = newHeight;
+				runSeed = newRunSeed;
+				nextIndex = producedIndex = firstIndex;
+				++epoch;
+			}
+			changed.notify_all();
+		}
+
+		// Takes the next level, waiting only if the thread has fallen behind.
+		LevelMap Pop() {
+			unique_lock<mutex> lock(guard);
+
+			if (!worker.joinable()) {
+				LevelMap level(width, height);
+				mt19937 generator = LevelGenerator::LevelStream(runSeed, nextIndex);
+				LevelGenerator::GenerateLevel(level, start, generator);
+				++popped;
+				++nextIndex;
+				return level;
+			}
+			if (ready.empty()) {
+				++stalls;
+				changed.wait(lock, [this]() { return !ready.empty(); });
+			}
+			LevelMap level = move(ready.front());
+			ready.pop_front();
+			++popped;
+			++nextIndex;
+			lock.unlock();
+			changed.notify_all();
+			return level;
+		}
+
+		size_t Popped() const { return popped; }
+		size_t Stalls() const { return stalls; }
+		uint32_t RunSeed() const { return runSeed; }
+		// Index of the level the next Pop returns.
+		uint32_t NextIndex() const { return nextIndex; }
+
+	private:
+		int width, height;
+		GridPosition start;
+		uint32_t runSeed;
+		mutex guard;
+		condition_variable changed;
+		deque<LevelMap> ready;
+		bool stopping = false;
+		size_t popped = 0;
+		size_t stalls = 0;
+		uint32_t nextIndex = 0;
+		uint32_t producedIndex = 0;
+		uint32_t epoch = 0;
+		thread worker;
+
+		void Produce() {
+			unique_lock<mutex> lock(guard);
+
+			while (!stopping) {
+				uint32_t levelEpoch = epoch, index = producedIndex++;
+				LevelMap level(width, height);
+				mt19937 generator = LevelGenerator::LevelStream(runSeed, index);
+				lock.unlock();
+				LevelGenerator::GenerateLevel(level, start, generator);
+				lock.lock();
+				changed.wait(lock, [&]() { return stopping || epoch != levelEpoch || ready.size() < Depth; });
+
+				if (!stopping && epoch == levelEpoch) {
+					ready.push_back(move(level));
+					changed.notify_all();
+				}
+			}
+		}
+	};
+
+	// Back buffer of (glyph, color) cells that is diffed against what is already on screen.
+	// Present() sends only the changed cells as one VT sequence stream in a single write to its
+	// terminal, or nowhere without one. Put marks a cell that differs from the screen in a dirty
+	// bitmap, so Present only visits those cells. Nearby cells are merged into horizontal spans,
+	// and it never scans the whole buffer.
+	class FrameCompositor {
+	public:
+		struct Cell {
+			char glyph;
+			unsigned char color;
+			bool operator==(const Cell& other) const { return glyph == other.glyph && color == other.color; }
+			bool operator!=(const Cell& other) const { return !(*this == other); }
+		};
+
+		struct FrameStats {
+			size_t bytes = 0;
+			size_t syscalls = 0;
+			size_t cellsWritten = 0;
+			size_t spans = 0;
+		};
+
+		FrameStats lastFrame;
+		FrameStats totals;
+		size_t framesPresented = 0;
+
+		explicit FrameCompositor(TerminalBackend* terminal = nullptr, Profiler* profiler = nullptr)
+			: terminal(terminal), profiler(profiler) {
+		}
+
+		void Resize(int width, int height) {
+			if (width == bufferWidth && height == bufferHeight) {
+				return;
+			}
+			bufferWidth = width;
+			bufferHeight = height;
+			backBuffer.assign(width * height, { ' ', 7 });
+			frontBuffer.assign(width * height, { ' ', 7 });
+			dirty = Bitboard(width, height);
+			Invalidate();
+		}
+
+		void Put(int x, int y, char glyph, unsigned char color) {
+			if (x < 0 || x >= bufferWidth || y < 0 || y >= bufferHeight) {
+				return;
+			}
+			int index = y * bufferWidth + x;
+			backBuffer[index] = { glyph, color };
+
+			if (backBuffer[index] != frontBuffer[index]) {
+				dirty.Set(x, y);
+			}
+		}
+
+		void Invalidate() {
+			fill(frontBuffer.begin(), frontBuffer.end(), Cell{ 0, 0 });
+
+			for (int y = 0; y < bufferHeight; ++y) {
+				for (int x = 0; x < bufferWidth; ++x) {
+					dirty.Set(x, y);
+				}
+			}
+		}
+
+		void Present();
+
+	private:
+		static const int MaxBridgedGap = 4;
+		TerminalBackend* terminal;
+		Profiler* profiler;
+		vector<Cell> backBuffer;
+		vector<Cell> frontBuffer;
+		Bitboard dirty;
+		int bufferWidth = 0, bufferHeight = 0;
+		string output;
+
+		void AppendSpan(int y, int begin, int end, int& cursorX, int& cursorY, int& currentColor);
+	};
+
+	// Draws the GameFieldWidth x GameFieldHeight view of the level whose top-left tile is the
+	// camera into a compositor. Rows are given in world coordinates; rows outside the view are
+	// skipped.
+	class LevelRenderer {
+	public:
+		GridPosition camera{ 0, 0 };
+
+		LevelRenderer(FrameCompositor& compositor, const ContentTable& content) : compositor(compositor), content(content) {}
+
+		bool FollowPlayer(const LevelMap& levelData, GridPosition playerPos);
+		void DrawInitialMap(const LevelMap& levelData, const EntityGrid& entityMap, int marginX = 2);
+		void DrawView(const LevelMap& levelData, const EntityGrid& entityMap, int marginX = 2);
+		void DrawRow(const LevelMap& levelData, const EntityGrid& entityMap, int row, int marginX = 2);
+		void ComposeCell(const LevelMap& levelData, const EntityGrid& entityMap, GridPosition pos, int marginX = 2);
+	private:
+		FrameCompositor& compositor;
+		const ContentTable& content;
+
+		void ComposeRow(const LevelMap& levelData, const EntityGrid& entityMap, int row, int marginX);
+	};
+
+	// Timed tasks ordered by deadline. Periodic tasks keep a fixed cadence from their first
+	// deadline; when the loop falls more than a period behind (a stalled terminal, say)
+	// they run once and restart from now instead of firing a burst of missed ticks. Slots of
+	// finished and cancelled tasks are reused, so a loop that keeps scheduling one-shot tasks
+	// does not grow the task list.
+	class Scheduler {
+	public:
+		typedef chrono::steady_clock Clock;
+
+		int At(Clock::time_point due, function<void()> task, Clock::duration period = Clock::duration::zero()) {
+			int id;
+
+			if (freeSlots.empty()) {
+				id = (int)tasks.size();
+				tasks.push_back({ move(task), period, true });
+			}
+			else {
+				id = freeSlots.back();
+				freeSlots.pop_back();
+				tasks[id] = { move(task), period, true };
+			}
+			Push(due, id);
+			return id;
+		}
+
+		int Every(Clock::duration period, function<void()> task) {
+			return At(Clock::now() + period, move(task), period);
+		}
+
+		void Cancel(int id) {
+			tasks[id].active = false;
+		}
+
+		bool Empty() const {
+			return queue.empty();
+		}
+
+		Clock::time_point NextDeadline() const {
+			return queue.empty() ? Clock::time_point::max() : queue.front().due;
+		}
+
+		// Milliseconds until the next deadline, rounded up so a wait never wakes early.
+		int MillisecondsUntilNext(Clock::time_point now, int cap) const {
+			if (queue.empty()) {
+				return cap;
+			}
+			auto remaining = chrono::duration_cast<chrono::microseconds>(queue.front().due - now).count();
+			return (int)max<long long>(0, min<long long>(cap, (remaining + 999) / 1000));
+		}
+
+		void RunDue(Clock::time_point now) {
+			while (!queue.empty() && queue.front().due <= now) {
+				Entry entry = queue.front();
+				pop_heap(queue.begin(), queue.end(), Later);
+				queue.pop_back();
+
+				Task& task = tasks[entry.id];
+				if (!task.active) {
+					task.run = nullptr;
+					freeSlots.push_back(entry.id);
+					continue;
+				}
+				// The task may schedule others, which can reuse its slot or reallocate tasks, so
+				// it runs from a local.
+				function<void()> run = move(task.run);
+
+				if (task.period > Clock::duration::zero()) {
+					Clock::time_point next = entry.due + task.period;
+					Push(next > now ? next : now + task.period, entry.id);
+					run();
+					tasks[entry.id].run = move(run);
+				}
+				else {
+					task.active = false;
+					freeSlots.push_back(entry.id);
+					run();
+				}
+			}
+		}
+
+	private:
+		struct Task {
+			function<void()> run;
+			Clock::duration period;
+			bool active;
+		};
+
+		struct Entry {
+			Clock::time_point due;
+			unsigned long long order;
+			int id;
+		};
+
+		static bool Later(const Entry& a, const Entry& b) {
+			return a.due != b.due ? a.due > b.due : a.order > b.order;
+		}
+
+		void Push(Clock::time_point due, int id) {
+			queue.push_back({ due, nextOrder++, id });
+			push_heap(queue.begin(), queue.end(), Later);
+		}
+
+		vector<Task> tasks;
+		vector<int> freeSlots;
+		vector<Entry> queue;
+		unsigned long long nextOrder = 0;
+	};
+
+	// Log-linear histogram of microsecond samples: four buckets per power of two, so any
+	// percentile it reports is within 25% of the true value.
+	class Histogram {
+	public:
+		void Record(long long micros) {
+			micros = max(0LL, micros);
+			buckets[BucketOf((unsigned long long)micros)]++;
+			count++;
+			total += micros;
+			minimum = count == 1 ? micros : min(minimum, micros);
+			maximum = max(maximum, micros);
+		}
+
+		// Adds every sample of other, as when per-thread histograms are combined.
+		void Add(const Histogram& other) {
+			if (other.count == 0) {
+				return;
+			}
+			for (int bucket = 0; bucket < BucketCount; ++bucket) {
+				buckets[bucket] += other.buckets[bucket];
+			}
+			minimum = count ? min(minimum, other.minimum) : other.minimum;
+			maximum = max(maximum, other.maximum);
+			count += other.count;
+			total += other.total;
+		}
+
+		long long Count() const { return count; }
+		long long Min() const { return minimum; }
+		long long Max() const { return maximum; }
+		double Mean() const { return count ? (double)total / count : 0.0; }
+
+		// Upper bound of the bucket holding the given fraction of the samples.
+		long long Percentile(double fraction) const {
+			long long rank = (long long)(fraction * count + 0.5), seen = 0;
+			for (int bucket = 0; bucket < BucketCount; ++bucket) {
+				seen += buckets[bucket];
+				if (seen >= max(1LL, rank)) {
+					return min(maximum, UpperBound(bucket));
+				}
+			}
+			return maximum;
+		}
+
+		void Print(ostream& out, const string& name) const {
+			out << name << ": " << count << " samples, min " << Min() << " us, mean " << (long long)Mean()
+				<< " us, p50 " << Percentile(0.5) << " us, p99 " << Percentile(0.99) << " us, max " << Max() << " us\n";
+		}
+
+		void PrintBuckets(ostream& out) const {
+			for (int bucket = 0; bucket < BucketCount; ++bucket) {
+				if (buckets[bucket]) {
+					out << "  <= " << UpperBound(bucket) << " us: " << buckets[bucket] << "\n";
+				}
+			}
+		}
+
+	private:
+		static const int BucketCount = 4 + 4 * 40;
+
+		static int BucketOf(unsigned long long value) {
+			if (value < 4) {
+				return (int)value;
+			}
+			int exponent = 0;
+			for (unsigned long long rest = value; rest > 1; rest >>= 1) {
+				++exponent;
+			}
+			int sub = (int)(value >> (exponent - 2)) & 3;
+			return min(BucketCount - 1, 4 + (exponent - 2) * 4 + sub);
+		}
+
+		static long long UpperBound(int bucket) {
+			if (bucket < 4) {
+				return bucket;
+			}
+			int exponent = (bucket - 4) / 4 + 2;
+			long long sub = (bucket - 4) % 4;
+			return ((4 + sub + 1) << (exponent - 2)) - 1;
+		}
+
+		long long buckets[BucketCount] = {};
+		long long count = 0, total = 0, minimum = 0, maximum = 0;
+	};
+
+	// Scoped steady_clock timers around the phases of a frame, one profiler per game. Nothing is
+	// timed unless the overlay is shown or a trace is recorded, so a disabled Scope costs a
+	// single branch. Each phase keeps its last WindowSize samples for the rolling min/avg/p99;
+	// a trace keeps every sample and is written as Chrome trace "complete" events for
+	// chrome://tracing or Perfetto.
+	class Profiler {
+	public:
+		typedef chrono::steady_clock Clock;
+		enum Phase { Input, Entities, AIMove, Present, HUD, PhaseCount };
+
+		// Microseconds for a phase, cells for CellsPerTick.
+		struct Summary {
+			int samples;
+			double minimum, average, p99;
+		};
+
+		class Scope {
+		public:
+			Scope(Profiler* profiler, Phase phase) : profiler(profiler), phase(phase), active(profiler && profiler->enabled) {
+				if (active) {
+					start = Clock::now();
+				}
+			}
+
+			~Scope() {
+				if (active) {
+					profiler->Record(phase, start, Clock::now());
+				}
+			}
+
+		private:
+			Profiler* profiler;
+			Phase phase;
+			bool active;
+			Clock::time_point start;
+		};
+
+		bool enabled = false;
+		bool overlayVisible = false;
+
+		void SetOverlay(bool visible) {
+			overlayVisible = visible;
+			enabled = overlayVisible || tracing;
+		}
+
+		void StartTrace() {
+			tracing = enabled = true;
+			traceStart = Clock::now();
+			trace.reserve(1 << 16);
+		}
+
+		void Record(Phase phase, Clock::time_point start, Clock::time_point end) {
+			long long durationNs = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+			Add(windows[phase], durationNs);
+
+			if (tracing && trace.size() < MaxTraceEvents) {
+				trace.push_back({ phase, chrono::duration_cast<chrono::nanoseconds>(start - traceStart).count(), durationNs });
+			}
+		}
+
+		static const char* Name(Phase phase) {
+			static const char* names[PhaseCount] = { "InputManager::Update", "UpdateEntities", "PlanPursuits", "FrameCompositor::Present", "DrawHUD" };
+			return names[phase];
+		}
+
+		// Terminal cells the compositor wrote during one game tick. Counted whether or not the
+		// profiler is enabled; it is a subtraction per tick.
+		void RecordCells(size_t cells) {
+			Add(cellsPerTick, (long long)cells);
+		}
+
+		Summary Summarize(Phase phase) const {
+			return Summarize(windows[phase], 1000.0);
+		}
+
+		Summary CellsPerTick() const {
+			return Summarize(cellsPerTick, 1.0);
+		}
+
+		void DrawOverlay(TerminalBackend& terminal, int marginX) const;
+		static void ClearOverlay(TerminalBackend& terminal, int marginX);
+		void Print(ostream& out) const;
+		bool WriteTrace(const string& path) const;
+
+	private:
+		static constexpr int WindowSize = 128;
+		static const size_t MaxTraceEvents = 1 << 22;
+
+		struct Window {
+			long long samples[WindowSize];
+			int next, count;
+		};
+
+		struct TraceEvent {
+			Phase phase;
+			long long startNs, durationNs;
+		};
+
+		Window windows[PhaseCount] = {};
+		Window cellsPerTick = {};
+		vector<TraceEvent> trace;
+		bool tracing = false;
+		Clock::time_point traceStart;
+
+		static void Add(Window& window, long long sample) {
+			window.samples[window.next] = sample;
+			window.next = (window.next + 1) % WindowSize;
+			window.count = min(window.count + 1, WindowSize);
+		}
+
+		static Summary Summarize(const Window& window, double unit);
+		static void AppendMicros(string& out, double micros);
+	};
+};
+
+Engine::Profiler::Summary Engine::Profiler::Summarize(const Window& window, double unit) {
+	Summary summary{ window.count, 0.0, 0.0, 0.0 };
+
+	if (window.count == 0) {
+		return summary;
+	}
+	long long sorted[WindowSize];
+	copy(window.samples, window.samples + window.count, sorted);
+	long long total = 0;
+
+	for (int i = 0; i < window.count; ++i) {
+		total += sorted[i];
+	}
+	long long* p99 = sorted + min(window.count - 1, window.count * 99 / 100);
+	nth_element(sorted, p99, sorted + window.count);
+	summary.minimum = *min_element(sorted, sorted + window.count) / unit;
+	summary.average = total / unit / window.count;
+	summary.p99 = *p99 / unit;
+	return summary;
+}
+
+// Whole microseconds, with one decimal below ten so sub-microsecond phases still read.
+void Engine::Profiler::AppendMicros(string& out, double micros) {
+	if (micros < 10.0) {
+		int tenths = (int)(micros * 10.0 + 0.5);
+		TerminalBackend::AppendNumber(out, tenths / 10);
+		out += '.';
+		out += (char)('0' + tenths % 10);
+		return;
+	}
+	TerminalBackend::AppendNumber(out, (int)(micros + 0.5));
+}
+
+// Two rows under the HUD bar: min/avg/p99 in microseconds for each phase, then min/avg/p99
+// terminal cells written per tick.
+void Engine::Profiler::DrawOverlay(TerminalBackend& terminal, int marginX) const {
+	static const char* labels[PhaseCount] = { "IN", "ENT", "AI", "DRAW", "HUD" };
+	string row(marginX, ' ');
+	row += "us";
+
+	for (int phase = 0; phase < PhaseCount; ++phase) {
+		Summary summary = Summarize((Phase)phase);
+		row += ' ';
+		row += labels[phase];
+		row += ' ';
+
+		if (summary.samples == 0) {
+			row += '-';
+			continue;
+		}
+		AppendMicros(row, summary.minimum);
+		row += '/';
+		AppendMicros(row, summary.average);
+		row += '/';
+		AppendMicros(row, summary.p99);
+	}
+	row.resize(marginX + GameFieldWidth, ' ');
+	Summary cells = CellsPerTick();
+	string cellRow(marginX, ' ');
+	cellRow += "cells/tick ";
+
+	if (cells.samples == 0) {
+		cellRow += '-';
+	}
+	else {
+		TerminalBackend::AppendNumber(cellRow, (int)cells.minimum);
+		cellRow += '/';
+		AppendMicros(cellRow, cells.average);
+		cellRow += '/';
+		TerminalBackend::AppendNumber(cellRow, (int)cells.p99);
+	}
+	cellRow.resize(marginX + GameFieldWidth, ' ');
+	terminal.SetCursor(0, GameFieldHeight + HudHeight);
+	terminal.SetColor(8);
+	terminal.Write(row.data(), row.size());
+	terminal.SetCursor(0, GameFieldHeight + HudHeight + 1);
+	terminal.Write(cellRow.data(), cellRow.size());
+	terminal.SetColor(7);
+}
+
+void Engine::Profiler::ClearOverlay(TerminalBackend& terminal, int marginX) {
+	string blank(marginX + GameFieldWidth, ' ');
+
+	for (int y = 0; y < 2; ++y) {
+		terminal.SetCursor(0, GameFieldHeight + HudHeight + y);
+		terminal.Write(blank.data(), blank.size());
+	}
+}
+
+void Engine::Profiler::Print(ostream& out) const {
+	for (int phase = 0; phase < PhaseCount; ++phase) {
+		Summary summary = Summarize((Phase)phase);
+		out << Name((Phase)phase) << ": last " << summary.samples << " samples, min " << summary.minimum
+			<< " us, avg " << summary.average << " us, p99 " << summary.p99 << " us\n";
+	}
+	Summary cells = CellsPerTick();
+	out << "cells written per tick: last " << cells.samples << " ticks, min " << cells.minimum << ", avg "
+		<< cells.average << ", p99 " << cells.p99 << "\n";
+}
+
+bool Engine::Profiler::WriteTrace(const string& path) const {
+	ofstream out(path);
+
+	if (!out) {
+		return false;
+	}
+	out << "{\"traceEvents\":[\n";
+
+	for (size_t i = 0; i < trace.size(); ++i) {
+		const TraceEvent& event = trace[i];
+		out << (i ? ",\n" : "") << "{\"name\":\"" << Name(event.phase) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":"
+			<< event.startNs / 1000 << '.' << setw(3) << setfill('0') << event.startNs % 1000
+			<< ",\"dur\":" << event.durationNs / 1000 << '.' << setw(3) << event.durationNs % 1000 << setfill(' ') << '}';
+	}
+	out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+	return (bool)out;
+}
+
+void Engine::FrameCompositor::Present() {
+	Profiler::Scope scope(profiler, Profiler::Present);
+	output.clear();
+	int cursorX = -1, cursorY = -1;
+	int currentColor = -1;
+	lastFrame = FrameStats();
+
+	for (int y = 0; y < bufferHeight; ++y) {
+		uint64_t* words = dirty.Row(y);
+		int spanBegin = -1, spanEnd = -1;
+
+		for (int w = 0; w < dirty.WordsPerRow(); ++w) {
+			for (uint64_t word = words[w]; word; word &= word - 1) {
+				int x = w * 64 + Bitboard::LowestBit(word);
+
+				if (backBuffer[y * bufferWidth + x] == frontBuffer[y * bufferWidth + x]) {
+					continue;
+				}
+				if (spanBegin >= 0 && x - spanEnd > MaxBridgedGap) {
+					AppendSpan(y, spanBegin, spanEnd, cursorX, cursorY, currentColor);
+					spanBegin = -1;
+				}
+				if (spanBegin < 0) {
+					spanBegin = x;
+				}
+				spanEnd = x + 1;
+			}
+			words[w] = 0;
+		}
+		if (spanBegin >= 0) {
+			AppendSpan(y, spanBegin, spanEnd, cursorX, cursorY, currentColor);
+		}
+	}
+	if (output.empty()) {
+		return;
+	}
+	if (currentColor != 7) {
+		TerminalBackend::AppendColor(output, 7);
+	}
+	lastFrame.bytes = output.size();
+	lastFrame.syscalls = 1;
+
+	if (terminal) {
+		terminal->Write(output.data(), output.size());
+	}
+	totals.bytes += lastFrame.bytes;
+	totals.syscalls += lastFrame.syscalls;
+	totals.cellsWritten += lastFrame.cellsWritten;
+	totals.spans += lastFrame.spans;
+	++framesPresented;
+}
+
+// Sends cells [begin, end) of row y. Unchanged cells inside the span are sent again, which is
+// shorter than the cursor move that would skip them.
+void Engine::FrameCompositor::AppendSpan(int y, int begin, int end, int& cursorX, int& cursorY, int& currentColor) {
+	const Cell* back = &backBuffer[y * bufferWidth];
+	Cell* front = &frontBuffer[y * bufferWidth];
+
+	if (cursorX != begin || cursorY != y) {
+		TerminalBackend::AppendCursor(output, begin, y);
+	}
+	for (int x = begin; x < end; ++x) {
+		if (back[x].color != currentColor) {
+			currentColor = back[x].color;
+			TerminalBackend::AppendColor(output, back[x].color);
+		}
+		output += back[x].glyph;
+		front[x] = back[x];
+		++lastFrame.cellsWritten;
+	}
+	cursorX = end;
+	cursorY = y;
+	++lastFrame.spans;
+}
+
+// Keeps the player a quarter of the view away from its edges; once they get closer the view
+// recenters on them, clamped to the world.
+bool Engine::LevelRenderer::FollowPlayer(const LevelMap& levelData, GridPosition playerPos) {
+	const int marginX = (int)GameFieldWidth / 4, marginY = (int)GameFieldHeight / 4;
+	GridPosition next = camera;
+
+	if (playerPos.x < camera.x + marginX || playerPos.x >= camera.x + (int)GameFieldWidth - marginX) {
+		next.x = playerPos.x - (int)GameFieldWidth / 2;
+	}
+	if (playerPos.y < camera.y + marginY || playerPos.y >= camera.y + (int)GameFieldHeight - marginY) {
+		next.y = playerPos.y - (int)GameFieldHeight / 2;
+	}
+	next.x = max(0, min(next.x, levelData.Width() - (int)GameFieldWidth));
+	next.y = max(0, min(next.y, levelData.Height() - (int)GameFieldHeight));
+
+	if (next == camera) {
+		return false;
+	}
+	camera = next;
+	return true;
+}
+
+void Engine::LevelRenderer::DrawInitialMap(const LevelMap& levelData, const EntityGrid& entityMap, int marginX) {
+	compositor.Resize(GameFieldWidth + marginX, GameFieldHeight + HudHeight);
+	compositor.Invalidate();
+	DrawView(levelData, entityMap, marginX);
+}
+
+// Composes every row of the view; after a camera move the compositor sends only what differs.
+void Engine::LevelRenderer::DrawView(const LevelMap& levelData, const EntityGrid& entityMap, int marginX) {
+	for (int y = 0; y < (int)GameFieldHeight; ++y) {
+		ComposeRow(levelData, entityMap, camera.y + y, marginX);
+	}
+	compositor.Present();
+}
+
+void Engine::LevelRenderer::DrawRow(const LevelMap& levelData, const EntityGrid& entityMap, int row, int marginX) {
+	ComposeRow(levelData, entityMap, row, marginX);
+	compositor.Present();
+}
+
+void Engine::LevelRenderer::ComposeCell(const LevelMap& levelData, const EntityGrid& entityMap, GridPosition pos, int marginX) {
+	int screenX = pos.x - camera.x, screenY = pos.y - camera.y;
+
+	if (screenX < 0 || screenX >= (int)GameFieldWidth || screenY < 0 || screenY >= (int)GameFieldHeight) {
+		return;
+	}
+	char entity = entityMap.At(pos);
+	char ch = entity ? entity : levelData.At(pos);
+	compositor.Put(marginX + screenX, screenY, ch, content.Color(ch));
+}
+
+void Engine::LevelRenderer::ComposeRow(const LevelMap& levelData, const EntityGrid& entityMap, int row, int marginX) {
+	int screenRow = row - camera.y;
+
+	if (screenRow < 0 || screenRow >= (int)GameFieldHeight) {
+		return;
+	}
+	char tiles[GameFieldWidth];
+	levelData.ReadRow(row, camera.x, (int)GameFieldWidth, tiles);
+
+	for (int i = 0; i < marginX; ++i) {
+		compositor.Put(i, screenRow, ' ', 7);
+	}
+	for (int x = 0; x < (int)GameFieldWidth; ++x) {
+		char entity = entityMap.At({ camera.x + x, row });
+		char ch = entity ? entity : tiles[x];
+		compositor.Put(marginX + x, screenRow, ch, content.Color(ch));
+	}
+}
+
+// One run of the game with everything it touches: the terminal it was given, its random
+// number generator, compositor, camera, profiler, and the input, HUD, AI and encounter state.
+// Games share nothing, so a process can run any number of them, each on whatever thread steps
+// it, and a run ends by raising quitRequested rather than leaving the process.
+class Game {
+public:
+	struct Options {
+		unsigned int seed = 1;
+		int worldWidth = (int)GameFieldWidth;
+		int worldHeight = (int)GameFieldHeight;
+		bool everyEnemyPursues = false;
+		// How many of the enemies nearest the player chase it at once.
+		int pursuers = 1;
+		// Lay levels out ahead on a thread of the game's own (see Engine::LevelQueue).
+		bool levelThread = true;
+		// Keep the entity tick running while the shop or a fight is on screen.
+		bool liveMenus = false;
+		// Show the profiler overlay from the start.
+		bool profile = false;
+		// Where WriteReports puts the frame time histograms and the profiler trace; empty for none.
+		string frameStatsPath;
+		string tracePath;
+		// Archetypes, colors and waves; nullptr for ContentTable::Default(). Must outlive the game.
+		const ContentTable* content = nullptr;
+	};
+
+	const Options options;
+	TerminalBackend& terminal;
+	// The text screens write here.
+	TerminalStream text;
+	const ContentTable& content;
+	mt19937 rng;
+	Engine::Profiler profiler;
+	Engine::FrameCompositor compositor;
+	Engine::LevelRenderer renderer;
+	LevelMap LevelData;
+	EntityGrid EntityMap;
+	Engine::LevelQueue levelQueue;
+	Player player;
+	GridPosition playerPos;
+	bool isPaused = false;
+	bool quitRequested = false;
+	enum class Direction { Up, Down, Left, Right, None };
+
+	Game(TerminalBackend& terminal, const Options& options)
+		: options(options), terminal(terminal), text(terminal), content(options.content ? *options.content : ContentTable::Default()),
+		rng(options.seed), compositor(&terminal, &profiler), renderer(compositor, content),
+		LevelData(options.worldWidth, options.worldHeight), EntityMap(options.worldWidth, options.worldHeight),
+		levelQueue(options.worldWidth, options.worldHeight, { 1, 1 }, (uint32_t)rng(), options.levelThread), hud(compositor), overlay(compositor) {
+		ai.everyEnemyPursues = options.everyEnemyPursues;
+		ai.pursuerCount = options.pursuers;
+		ai.profiler = &profiler;
+		ai.content = &content;
+		profiler.SetOverlay(options.profile);
+
+		if (!options.tracePath.empty()) {
+			profiler.StartTrace();
+		}
+		player = StartingPlayer();
+		playerPos = { 1, 1 };
+		GenerateNewLevel();
+	}
+
+	Game(const Game&) = delete;
+	Game& operator=(const Game&) = delete;
+
+	static Player StartingPlayer() {
+		return { 100, 100, 10, 5, 1, 100 };
+	}
+
+	// Shows the player's stats on the HUD.
+	void DrawHUD() {
+		Engine::Profiler::Scope scope(&profiler, Engine::Profiler::HUD);
+		hud.DrawStatus(2, player);
+	}
+
+	void DrawHUD(const string& message) {
+		Engine::Profiler::Scope scope(&profiler, Engine::Profiler::HUD);
+		hud.DrawHUDBar(2, message);
+	}
+
+	// Ends the run. The loop driving the game winds down and whoever started it reports.
+	void Quit() {
+		quitRequested = true;
+	}
+
+	void ClearConsole() {
+		terminal.Clear();
+		compositor.Invalidate();
+	}
+
+	static string PlayerStatusStatic(const Player& player) {
+		char line[HUDBar::StatusCapacity];
+		return string(line, HUDBar::FormatStatus(player, line));
+	}
+
+	class InputManager {
+	public:
+		bool up = false, down = false, left = false, right = false;
+
+		void Update(Game& game) {
+			Engine::Profiler::Scope scope(&game.profiler, Engine::Profiler::Input);
+
+			while (game.terminal.KeyAvailable()) {
+				char key = (char)game.terminal.ReadKey();
+				key = tolower(key);
+
+				if (game.encounters.ScreenOpen()) {
+					game.encounters.HandleKey(game, key);
+					continue;
+				}
+
+				switch (key) {
+				case 'w': {
+					up = true;
+					break;
+				}
+				case 's': {
+					down = true;
+					break;
+				}
+				case 'a': {
+					left = true;
+					break;
+				}
+				case 'd': {
+					right = true;
+					break;
+				}
+				case 'p': {
+					game.profiler.SetOverlay(!game.profiler.overlayVisible);
+					if (game.profiler.overlayVisible) {
+						game.profiler.DrawOverlay(game.terminal, 2);
+					}
+					else {
+						Engine::Profiler::ClearOverlay(game.terminal, 2);
+					}
+					break;
+				}
+				case 27: {
+					game.Quit();
+					break;
+				}
+				}
+			}
+		}
+		void Reset() {
+			up = down = left = right = false;
+		}
+	};
+	InputManager input;
+
+	// The bar under the view. It keeps the text it shows and, while that is the status line, the
+	// stat values it was made from, so the per-frame DrawStatus is a comparison of six numbers.
+	// When a stat changes the line is formatted into a stack buffer and only the columns from
+	// the first changed field on that differ are composed. Nothing allocates. The bar only
+	// composes; Frame presents it with the rest of the frame.
+	class HUDBar {
+	public:
+		static const int StatusCapacity = 96;
+
+		explicit HUDBar(Engine::FrameCompositor& compositor) : compositor(compositor) {}
+
+		// Writes "HP:hp/maxHp ATK:attack DEF:defense LVL:level GOLD:money" to out, which holds
+		// StatusCapacity characters, and returns its length. fieldStart, if given, receives the
+		// column each value starts at.
+		static int FormatStatus(const Player& player, char* out, int* fieldStart = nullptr) {
+			static const char* const labels[FieldCount] = { "HP:", "/", " ATK:", " DEF:", " LVL:", " GOLD:" };
+			int values[FieldCount];
+			StatValues(player, values);
+			char* end = out;
+
+			for (int field = 0; field < FieldCount; ++field) {
+				for (const char* label = labels[field]; *label; ++label) {
+					*end++ = *label;
+				}
+				if (fieldStart) {
+					fieldStart[field] = (int)(end - out);
+				}
+				end = to_chars(end, out + StatusCapacity, values[field]).ptr;
+			}
+			return (int)(end - out);
+		}
+
+		// Shows the player's stats, composing only what changed since the bar last showed them.
+		void DrawStatus(int marginX, const Player& player) {
+			int values[FieldCount];
+			StatValues(player, values);
+			int first = 0;
+
+			if (showingStatus && drawnMarginX == marginX) {
+				while (first < FieldCount && values[first] == shown[first]) {
+					++first;
+				}
+				if (first == FieldCount) {
+					return;
+				}
+			}
+			char line[StatusCapacity];
+			int fieldStart[FieldCount];
+			int length = FormatStatus(player, line, fieldStart);
+			int from = showingStatus && drawnMarginX == marginX ? fieldStart[first] : 0;
+			Compose(marginX, line, length, from);
+			copy(values, values + FieldCount, shown);
+			showingStatus = true;
+		}
+
+		// Shows message in place of the status line until the next DrawStatus.
+		void DrawHUDBar(int marginX, const string& message) {
+			int length = min((int)message.size(), (int)GameFieldWidth);
+
+			if (!showingStatus && drawnMarginX == marginX && length == textLength
+				&& equal(text, text + length, message.data())) {
+				return;
+			}
+			Compose(marginX, message.data(), length, 0);
+			showingStatus = false;
+		}
+
+		void ClearHUDBar(int marginX) {
+			for (int y = 1; y <= 3; ++y) {
+				for (int x = 0; x < marginX + (int)GameFieldWidth; ++x) {
+					compositor.Put(x, (int)GameFieldHeight + y, ' ', 7);
+				}
+			}
+			drawnMarginX = -1;
+			textLength = 0;
+			showingStatus = false;
+		}
+
+	private:
+		static const int FieldCount = 6;
+		Engine::FrameCompositor& compositor;
+		char text[GameFieldWidth];
+		int textLength = 0;
+		int drawnMarginX = -1;
+		bool showingStatus = false;
+		int shown[FieldCount] = {};
+
+		static void StatValues(const Player& player, int* values) {
+			values[0] = player.hp;
+			values[1] = player.maxHp;
+			values[2] = player.attack;
+			values[3] = player.defense;
+			values[4] = player.level;
+			values[5] = player.money;
+		}
+
+		// Composes the text row from column from on, and the rules above and below it when the
+		// bar is not on screen at this margin yet. Columns whose character is unchanged are
+		// skipped.
+		void Compose(int marginX, const char* line, int length, int from) {
+			const int top = (int)GameFieldHeight + 1;
+			length = min(length, (int)GameFieldWidth);
+
+			if (drawnMarginX != marginX) {
+				for (int x = 0; x < marginX + (int)GameFieldWidth; ++x) {
+					bool inBar = x >= marginX;
+					compositor.Put(x, top, inBar ? '=' : ' ', 7);
+					compositor.Put(x, top + 1, ' ', 7);
+					compositor.Put(x, top + 2, inBar ? '=' : ' ', 7);
+				}
+				drawnMarginX = marginX;
+				textLength = 0;
+			}
+			for (int column = from; column < max(length, textLength); ++column) {
+				char glyph = column < length ? line[column] : ' ';
+
+				if (column >= textLength || text[column] != glyph) {
+					compositor.Put(marginX + column, top + 1, glyph, 14);
+				}
+				text[column] = glyph;
+			}
+			textLength = length;
+		}
+	};
+	HUDBar hud;
+
+	// A boxed text panel over the middle of the map view, composed into the same frame buffer as
+	// the map and the HUD. The shop, fights and the victory banner show here while the map loop
+	// keeps running. The panel is composed again when its text changes and after every entity
+	// tick, so entities moving underneath never show through, and it always covers the same
+	// rectangle, so recomposing the map after it closes sends only the cells it covered.
+	class OverlayPanel {
+	public:
+		static const int Width = 56;
+		static const int Height = 20;
+		static const int MaxLines = Height - 2;
+
+		explicit OverlayPanel(Engine::FrameCompositor& compositor) : compositor(compositor) {}
+
+		// Starts new contents. Line strings keep their capacity from one screen to the next.
+		void Begin(const string& heading) {
+			title = heading;
+			count = 0;
+			stale = true;
+		}
+
+		// Whether the contents changed since the panel was last composed.
+		bool Stale() const {
+			return stale;
+		}
+
+		void Line(const string& text, unsigned char color = 7) {
+			if (count < MaxLines) {
+				lines[count] = text;
+				colors[count] = color;
+				++count;
+			}
+		}
+
+		void Compose(int marginX) {
+			stale = false;
+			int left = marginX + ((int)GameFieldWidth - Width) / 2;
+			int top = ((int)GameFieldHeight - Height) / 2;
+			int titleStart = (Width - (int)title.size() - 2) / 2;
+
+			for (int row = 0; row < Height; ++row) {
+				bool edge = row == 0 || row == Height - 1;
+				const string* line = row > 0 && row <= count ? &lines[row - 1] : nullptr;
+
+				for (int column = 0; column < Width; ++column) {
+					char glyph = ' ';
+					unsigned char color = 7;
+
+					if (column == 0 || column == Width - 1) {
+						glyph = edge ? '+' : '|';
+					}
+					else if (row == 0 && column >= titleStart && column < titleStart + (int)title.size() + 2) {
+						int index = column - titleStart - 1;
+						glyph = index >= 0 && index < (int)title.size() ? title[index] : ' ';
+						color = 15;
+					}
+					else if (edge) {
+						glyph = '-';
+					}
+					else if (line && column >= 2 && column < Width - 2 && column - 2 < (int)line->size()) {
+						glyph = (*line)[column - 2];
+						color = colors[row - 1];
+					}
+					compositor.Put(left + column, top + row, glyph, color);
+				}
+			}
+		}
+
+	private:
+		Engine::FrameCompositor& compositor;
+		string title;
+		string lines[MaxLines];
+		unsigned char colors[MaxLines] = {};
+		int count = 0;
+		bool stale = true;
+	};
+	OverlayPanel overlay;
+
+	class EntityManager {
+	public:
+
+		// Contact with an archetype, and the shop, fight or victory screen it opens. Screens are
+		// state machines: the keys the frame reads go to HandleKey instead of moving the player,
+		// and the screen shows on the overlay panel until it closes. Nothing here waits, so the
+		// loop, the entity tick (with Options::liveMenus) and other sessions keep going.
+		class Encounters {
+		public:
+			enum class Screen { None, Shop, Combat, Victory };
+			// What the open screen waits for: a menu choice, y or n for pendingChoice, or any key,
+			// after which afterKey says what comes next.
+			enum class Prompt { Choice, Confirm, AnyKey };
+			enum class AfterKey { Menu, NextRound, Close, Quit };
+
+			// The enemy being fought. It leaves the map when the fight starts, so its stats are
+			// kept here.
+			struct Fight {
+				char type = 0;
+				int hp = 0, attack = 0, defense = 0;
+			};
+
+			bool showingMessage = false;
+			chrono::steady_clock::time_point lastMessageTime;
+			string currentMessage;
+			char activeEncounter = 0;
+			int encounterCount = 0;
+			Screen screen = Screen::None;
+			Prompt prompt = Prompt::Choice;
+			AfterKey afterKey = AfterKey::Menu;
+			char pendingChoice = 0;
+			Fight fight;
+			// What happened since the last choice, shown above the prompt.
+			vector<string> log;
+
+			bool ScreenOpen() const {
+				return screen != Screen::None;
+			}
+
+			void HandleEncounter(Game& game, EntityGrid::EntityId id) {
+				char entityType = game.EntityMap.Type(id);
+				activeEncounter = entityType;
+				++encounterCount;
+
+				const ContentTable::Archetype& archetype = game.content[entityType];
+
+				if (archetype.role == ContentTable::Role::None) {
+					currentMessage = "";
+					activeEncounter = 0;
+					return;
+				}
+				currentMessage = archetype.encounter;
+
+				if (archetype.role == ContentTable::Role::Merchant) {
+					Shop::OpenShop(game);
+				}
+				else {
+					Combat::StartCombat(game, id);
+				}
+				Describe(game);
+			}
+
+			void OpenScreen(Screen opened) {
+				screen = opened;
+				prompt = Prompt::Choice;
+				log.clear();
+			}
+
+			void WaitForKey(AfterKey after) {
+				prompt = Prompt::AnyKey;
+				afterKey = after;
+			}
+
+			void Say(const string& line) {
+				log.push_back(line);
+			}
+
+			void HandleKey(Game& game, char key) {
+				if (prompt == Prompt::AnyKey) {
+					switch (afterKey) {
+					case AfterKey::Menu: {
+						log.clear();
+						prompt = Prompt::Choice;
+						break;
+					}
+					case AfterKey::NextRound: {
+						log.clear();
+						Combat::EnemyTurn(game);
+						break;
+					}
+					case AfterKey::Close: {
+						CloseScreen(game);
+						return;
+					}
+					case AfterKey::Quit: {
+						game.Quit();
+						return;
+					}
+					}
+				}
+				else if (screen == Screen::Shop) {
+					Shop::HandleKey(game, key);
+				}
+				else if (screen == Screen::Combat) {
+					Combat::HandleKey(game, key);
+				}
+				if (ScreenOpen()) {
+					Describe(game);
+				}
+			}
+
+			// Puts the open screen's text on the overlay panel; it changes only on a key.
+			void Describe(Game& game) const {
+				switch (screen) {
+				case Screen::Shop: {
+					Shop::Describe(game);
+					break;
+				}
+				case Screen::Combat: {
+					Combat::Describe(game);
+					break;
+				}
+				case Screen::Victory: {
+					GameWinManager::Describe(game);
+					break;
+				}
+				default: {
+					break;
+				}
+				}
+			}
+
+			// Takes the panel off by recomposing the map under it, then shows the encounter's
+			// message on the HUD.
+			void CloseScreen(Game& game) {
+				screen = Screen::None;
+				activeEncounter = 0;
+				game.renderer.DrawView(game.LevelData, game.EntityMap);
+				ShowMessage(game, currentMessage);
+			}
+
+			// Shows message on the HUD for HudMessageMs.
+			void ShowMessage(Game& game, const string& message) {
+				currentMessage = message;
+				showingMessage = true;
+				lastMessageTime = chrono::steady_clock::now();
+				game.hud.DrawHUDBar(2, currentMessage);
+			}
+
+			void UpdateHUD(Game& game) {
+				using namespace chrono;
+
+				if (showingMessage) {
+					auto now = steady_clock::now();
+
+					if (duration_cast<milliseconds>(now - lastMessageTime).count() >= HudMessageMs) {
+						showingMessage = false;
+						game.hud.DrawStatus(2, game.player);
+					}
+				}
+			}
+		};
+
+		class Shop {
+		public:
+			enum Item { HealFull, UpgradeMaxHp, UpgradeAttack, UpgradeDefense };
+
+			static int Price(Item item) {
+				switch (item) {
+				case HealFull: return 10;
+				case UpgradeMaxHp: return 20;
+				default: return 15;
+				}
+			}
+
+			static bool CanAfford(const Player& player, Item item) {
+				return player.money >= Price(item);
+			}
+
+			static void Buy(Player& player, Item item) {
+				player.money -= Price(item);
+				switch (item) {
+				case HealFull: player.hp = player.maxHp; break;
+				case UpgradeMaxHp: player.maxHp += 10; break;
+				case UpgradeAttack: player.attack += 2; break;
+				case UpgradeDefense: player.defense += 2; break;
+				}
+			}
+
+			static void OpenShop(Game& game) {
+				game.encounters.OpenScreen(Encounters::Screen::Shop);
+			}
+
+			// H, 1, 2 and 3 ask to buy, E leaves; anything else, or a purchase the player cannot
+			// afford or declines, waits for a key and shows the menu again.
+			static void HandleKey(Game& game, char key) {
+				Encounters& encounters = game.encounters;
+				Item item = HealFull;
+
+				if (encounters.prompt == Encounters::Prompt::Confirm) {
+					if (key == 'n') {
+						encounters.WaitForKey(Encounters::AfterKey::Menu);
+					}
+					else if (key == 'y' && ChoiceItem(encounters.pendingChoice, item)) {
+						Buy(game.player, item);
+						encounters.Say(BoughtMessage(game.player, item));
+						encounters.WaitForKey(Encounters::AfterKey::Menu);
+					}
+					return;
+				}
+				if (key == 'e') {
+					encounters.Say("Safe travels, adventurer!");
+					encounters.WaitForKey(Encounters::AfterKey::Close);
+					return;
+				}
+				if (!ChoiceItem(key, item)) {
+					encounters.Say("Invalid choice. Try again...");
+					encounters.WaitForKey(Encounters::AfterKey::Menu);
+					return;
+				}
+				if (!CanAfford(game.player, item)) {
+					encounters.WaitForKey(Encounters::AfterKey::Menu);
+					return;
+				}
+				encounters.pendingChoice = key;
+				encounters.prompt = Encounters::Prompt::Confirm;
+			}
+
+			static void Describe(Game& game) {
+				const Encounters& encounters = game.encounters;
+				const Player& player = game.player;
+				OverlayPanel& panel = game.overlay;
+				Item item = HealFull;
+
+				panel.Begin("MERCHANT'S SHOP");
+				panel.Line("Welcome, traveler!");
+				panel.Line("");
+				panel.Line("Your current stats:");
+				panel.Line("HP: " + to_string(player.hp) + "/" + to_string(player.maxHp) + "  ATK: " + to_string(player.attack)
+					+ "  DEF: " + to_string(player.defense) + "  LVL: " + to_string(player.level) + "  Gold: " + to_string(player.money));
+				panel.Line("");
+				panel.Line("Choose an option:");
+				panel.Line("[H] Heal to full HP (10 gold)");
+				panel.Line("[1] Upgrade Max HP (+10) (20 gold)");
+				panel.Line("[2] Upgrade Attack (+2) (15 gold)");
+				panel.Line("[3] Upgrade Defense (+2) (15 gold)");
+				panel.Line("[E] Exit Shop");
+				panel.Line("");
+
+				for (const string& line : encounters.log) {
+					panel.Line(line, 14);
+				}
+				switch (encounters.prompt) {
+				case Encounters::Prompt::Choice: {
+					panel.Line("Enter your choice.", 15);
+					break;
+				}
+				case Encounters::Prompt::Confirm: {
+					ChoiceItem(encounters.pendingChoice, item);
+					panel.Line(ConfirmQuestion(item) + " (y/n)", 15);
+					break;
+				}
+				case Encounters::Prompt::AnyKey: {
+					panel.Line("Press any key to continue...", 15);
+					break;
+				}
+				}
+			}
+
+		private:
+			static bool ChoiceItem(char key, Item& item) {
+				switch (key) {
+				case 'h': item = HealFull; return true;
+				case '1': item = UpgradeMaxHp; return true;
+				case '2': item = UpgradeAttack; return true;
+				case '3': item = UpgradeDefense; return true;
+				default: return false;
+				}
+			}
+
+			static string ConfirmQuestion(Item item) {
+				switch (item) {
+				case HealFull: return "Heal to full HP for 10 gold?";
+				case UpgradeMaxHp: return "Upgrade Max HP for 20 gold?";
+				case UpgradeAttack: return "Upgrade Attack for 15 gold?";
+				default: return "Upgrade Defense for 15 gold?";
+				}
+			}
+
+			static string BoughtMessage(const Player& player, Item item) {
+				switch (item) {
+				case HealFull: return "You have been fully healed!";
+				case UpgradeMaxHp: return "Your maximum HP increased to " + to_string(player.maxHp) + "!";
+				case UpgradeAttack: return "Your attack increased to " + to_string(player.attack) + "!";
+				default: return "Your defense increased to " + to_string(player.defense) + "!";
+				}
+			}
+		};
+
+		class Combat {
+		public:
+			// What a fight does to the numbers, without any input or output. StartCombat and the
+			// balance simulator both play by these rules.
+			struct Outcome {
+				bool won;
+				bool fled;
+				int rounds;
+				int reward;
+			};
+
+			static int DamageToPlayer(const Player& player, int enemyAttack) {
+				return max(0, enemyAttack - player.defense);
+			}
+
+			static int DamageToEnemy(const Player& player, int enemyDefense) {
+				return max(0, player.attack - enemyDefense);
+			}
+
+			static int HealAmount(const Player& player) {
+				return min(15, player.maxHp - player.hp);
+			}
+
+			// Fights to the end without a player at the keys: the enemy strikes first every round,
+			// then the player heals below a third of max HP and attacks otherwise. A fight that
+			// neither side can win within maxRounds counts as fled.
+			static Outcome AutoResolve(Player& player, const ContentTable::Archetype& enemy, int maxRounds = 1000) {
+				Outcome outcome{ false, false, 0, 0 };
+				int enemyHp = enemy.hp;
+
+				while (outcome.rounds < maxRounds) {
+					++outcome.rounds;
+					player.hp -= DamageToPlayer(player, enemy.attack);
+					if (player.hp <= 0) {
+						player.hp = 0;
+						return outcome;
+					}
+					int heal = HealAmount(player);
+					if (player.hp * 3 < player.maxHp && heal > 0) {
+						player.hp += heal;
+						continue;
+					}
+					enemyHp -= DamageToEnemy(player, enemy.defense);
+					if (enemyHp <= 0) {
+						outcome.won = true;
+						outcome.reward = enemy.reward;
+						player.money += enemy.reward;
+						return outcome;
+					}
+				}
+				outcome.fled = true;
+				return outcome;
+			}
+
+			// Fights the entity id with the stats it carries; the table only supplies its name and
+			// reward. The stats move to the fight, as the entity leaves the map when it is met.
+			static void StartCombat(Game& game, EntityGrid::EntityId id) {
+				char enemyType = game.EntityMap.Type(id);
+				if (!game.content.Hostile(enemyType))
+					return;
+
+				Encounters& encounters = game.encounters;
+				encounters.fight = { enemyType, game.EntityMap.Hp(id), game.EntityMap.Attack(id), game.EntityMap.Defense(id) };
+				encounters.OpenScreen(Encounters::Screen::Combat);
+				EnemyTurn(game);
+			}
+
+			// The enemy strikes at the start of every round, then the player chooses.
+			static void EnemyTurn(Game& game) {
+				Encounters& encounters = game.encounters;
+				const string& enemyName = game.content[encounters.fight.type].name;
+				int damageToPlayer = DamageToPlayer(game.player, encounters.fight.attack);
+				game.player.hp -= damageToPlayer;
+
+				encounters.Say(enemyName + " attacks! You take " + to_string(damageToPlayer) + " damage. (HP:"
+					+ to_string(max(0, game.player.hp)) + "/" + to_string(game.player.maxHp) + ")");
+				if (game.player.hp <= 0) {
+					encounters.Say("You were defeated...");
+					encounters.WaitForKey(Encounters::AfterKey::Close);
+					return;
+				}
+				encounters.prompt = Encounters::Prompt::Choice;
+			}
+
+			// A, H and Q ask to attack, heal or run. Any other key, or declining, costs the round.
+			static void HandleKey(Game& game, char key) {
+				Encounters& encounters = game.encounters;
+				Encounters::Fight& fight = encounters.fight;
+				const ContentTable::Archetype& enemy = game.content[fight.type];
+
+				if (encounters.prompt == Encounters::Prompt::Choice) {
+					if (key == 'a' || key == 'h' || key == 'q') {
+						encounters.pendingChoice = key;
+						encounters.prompt = Encounters::Prompt::Confirm;
+					}
+					else {
+						encounters.Say("Invalid input.");
+						encounters.WaitForKey(Encounters::AfterKey::NextRound);
+					}
+					return;
+				}
+				if (key == 'n') {
+					encounters.Say("Invalid input.");
+					encounters.WaitForKey(Encounters::AfterKey::NextRound);
+					return;
+				}
+				if (key != 'y') {
+					return;
+				}
+				encounters.log.clear();
+
+				switch (encounters.pendingChoice) {
+				case 'a': {
+					int damageToEnemy = DamageToEnemy(game.player, fight.defense);
+					fight.hp -= damageToEnemy;
+					encounters.Say("You hit " + enemy.name + " for " + to_string(damageToEnemy)
+						+ " damage! (Enemy HP: " + to_string(max(0, fight.hp)) + ")");
+					if (fight.hp <= 0) {
+						Win(game);
+						return;
+					}
+					break;
+				}
+				case 'h': {
+					int heal = HealAmount(game.player);
+					game.player.hp += heal;
+					encounters.Say("You heal " + to_string(heal) + " HP. (HP:" + to_string(game.player.hp)
+						+ "/" + to_string(game.player.maxHp) + ")");
+					break;
+				}
+				default: {
+					encounters.CloseScreen(game);
+					encounters.ShowMessage(game, "You fled the battle!");
+					return;
+				}
+				}
+				EnemyTurn(game);
+			}
+
+			static void Describe(Game& game) {
+				const Encounters& encounters = game.encounters;
+				const Encounters::Fight& fight = encounters.fight;
+				const string& enemyName = game.content[fight.type].name;
+				OverlayPanel& panel = game.overlay;
+
+				panel.Begin("FIGHT: " + enemyName);
+				panel.Line(enemyName + " HP: " + to_string(max(0, fight.hp)));
+				panel.Line("Your HP: " + to_string(max(0, game.player.hp)) + "/" + to_string(game.player.maxHp));
+				panel.Line("");
+
+				for (const string& line : encounters.log) {
+					panel.Line(line, 14);
+				}
+				panel.Line("");
+
+				switch (encounters.prompt) {
+				case Encounters::Prompt::Choice: {
+					panel.Line("[A] Attack  [H] Heal  [Q] Run", 15);
+					break;
+				}
+				case Encounters::Prompt::Confirm: {
+					string question = encounters.pendingChoice == 'a' ? "Attack " + enemyName + "?"
+						: encounters.pendingChoice == 'h' ? "Heal " + to_string(HealAmount(game.player)) + " HP?" : "Flee the battle?";
+					panel.Line(question + " (y/n)", 15);
+					break;
+				}
+				case Encounters::Prompt::AnyKey: {
+					panel.Line("Press any key to continue...", 15);
+					break;
+				}
+				}
+			}
+
+		private:
+			// Pays the reward; the boss also wins the run.
+			static void Win(Game& game) {
+				Encounters& encounters = game.encounters;
+				const ContentTable::Archetype& enemy = game.content[encounters.fight.type];
+				game.player.money += enemy.reward;
+
+				// The victory screen opens with an empty log, so the lines go on it afterwards.
+				if (enemy.role == ContentTable::Role::Boss) {
+					GameWinManager::ShowGameWin(game);
+				}
+				else {
+					encounters.WaitForKey(Encounters::AfterKey::Close);
+				}
+				encounters.Say("You defeated " + enemy.name + "!");
+				encounters.Say("You earned " + to_string(enemy.reward) + " gold! (Total gold: " + to_string(game.player.money) + ")");
+			}
+		};
+
+		class AIController {
+		public:
+			// Breadth-first walking distance from every tile to the player. It only depends on the
+			// walls and the player position, so it is rebuilt when the player moves and any number
+			// of enemies can chase by stepping to a neighbour that is one tile closer.
+			class DistanceField {
+			public:
+				static const uint16_t Unreachable = 0xFFFF;
+
+				void Update(const LevelMap& levelData, GridPosition root) {
+					if (valid && root == fieldRoot && area == levelData.ActiveArea()) {
+						return;
+					}
+					Rebuild(levelData, root);
+				}
+
+				void Invalidate() {
+					valid = false;
+				}
+
+				// Tiles outside the active area the field was built over count as unreachable.
+				uint16_t Distance(GridPosition pos) const {
+					return area.Contains(pos) ? distances[(pos.y - area.y + 1) * stride + (pos.x - area.x + 1)] : Unreachable;
+				}
+
+				// Steps downhill to a free neighbour, or onto the player. Returns pos itself when the
+				// player is unreachable or every closer tile is taken.
+				GridPosition NextStep(GridPosition pos, const EntityGrid& entityMap) const {
+					uint16_t current = Distance(pos);
+
+					if (current == Unreachable || current == 0) {
+						return pos;
+					}
+					const GridPosition steps[] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+
+					for (const GridPosition& step : steps) {
+						GridPosition next{ pos.x + step.x, pos.y + step.y };
+
+						if (Distance(next) == current - 1 && (next == fieldRoot || !entityMap.Has(next))) {
+							return next;
+						}
+					}
+					return pos;
+				}
+
+			private:
+				vector<uint16_t> distances;
+				vector<char> tiles;
+				vector<int> frontier;
+				GridRect area{ 0, 0, 0, 0 };
+				int stride = 0;
+				GridPosition fieldRoot{ -1, -1 };
+				bool valid = false;
+
+				// Copies the active area into a flat buffer framed by walls, so the search itself
+				// needs no bounds checks or chunk lookups.
+				void Rebuild(const LevelMap& levelData, GridPosition root) {
+					area = levelData.ActiveArea();
+					stride = area.width + 2;
+					const int offsets[] = { 1, -1, stride, -stride };
+					tiles.assign(stride * (area.height + 2), TileWall);
+					distances.assign(tiles.size(), (uint16_t)Unreachable);
+					frontier.clear();
+					fieldRoot = root;
+					valid = true;
+
+					for (int y = 0; y < area.height; ++y) {
+						levelData.ReadRow(area.y + y, area.x, area.width, &tiles[(y + 1) * stride + 1]);
+					}
+					if (!area.Contains(root)) {
+						return;
+					}
+					int rootIndex = (root.y - area.y + 1) * stride + (root.x - area.x + 1);
+					distances[rootIndex] = 0;
+					frontier.push_back(rootIndex);
+
+					for (size_t head = 0; head < frontier.size(); ++head) {
+						int current = frontier[head];
+
+						for (int offset : offsets) {
+							int next = current + offset;
+
+							if (distances[next] == Unreachable && tiles[next] == TileGround) {
+								distances[next] = distances[current] + 1;
+								frontier.push_back(next);
+							}
+						}
+					}
+				}
+			};
+
+			// Tiles of the active area in view of the player, by symmetric shadowcasting from the
+			// player's tile. Visibility is symmetric, so it also answers which enemies can see the
+			// player. Like the distance field it is only rebuilt when the player moves.
+			class FieldOfView {
+			public:
+				void Update(const LevelMap& levelData, GridPosition root) {
+					if (valid && root == fieldRoot && area == levelData.ActiveArea()) {
+						return;
+					}
+					Rebuild(levelData, root);
+				}
+
+				void Invalidate() {
+					valid = false;
+				}
+
+				bool Visible(GridPosition pos) const {
+					return area.Contains(pos) && visible.Get(pos.x - area.x, pos.y - area.y);
+				}
+
+			private:
+				// A row of a quadrant depth tiles out from the root, between two slopes kept as
+				// fractions so the scan is exact.
+				struct Row {
+					int depth;
+					int startNum, startDen;
+					int endNum, endDen;
+				};
+
+				Bitboard visible;
+				GridRect area{ 0, 0, 0, 0 };
+				GridPosition fieldRoot{ -1, -1 };
+				bool valid = false;
+				vector<Row> rows;
+
+				void Rebuild(const LevelMap& levelData, GridPosition root) {
+					area = levelData.ActiveArea();
+					fieldRoot = root;
+					valid = true;
+
+					if (visible.Width() != area.width || visible.Height() != area.height) {
+						visible = Bitboard(area.width, area.height);
+					}
+					visible.Clear();
+
+					if (!area.Contains(root)) {
+						return;
+					}
+					visible.Set(root.x - area.x, root.y - area.y);
+
+					for (int quadrant = 0; quadrant < 4; ++quadrant) {
+						ScanQuadrant(levelData, root, quadrant);
+					}
+				}
+
+				// Walks the rows of one quadrant outward. A wall is always seen; a floor tile is seen
+				// when its centre lies between the row's slopes. Each wall that follows floor closes a
+				// gap and starts the next row through that gap.
+				void ScanQuadrant(const LevelMap& levelData, GridPosition root, int quadrant) {
+					rows.assign(1, Row{ 1, -1, 1, 1, 1 });
+
+					while (!rows.empty()) {
+						Row row = rows.back();
+						rows.pop_back();
+						int minCol = FloorDiv(2 * row.depth * row.startNum + row.startDen, 2 * row.startDen);
+						int maxCol = -FloorDiv(row.endDen - 2 * row.depth * row.endNum, 2 * row.endDen);
+						int previous = -1;
+
+						for (int col = minCol; col <= maxCol; ++col) {
+							GridPosition pos = Transform(root, quadrant, row.depth, col);
+							int wall = !area.Contains(pos) || !levelData.IsGround(pos);
+							bool centred = col * row.startDen >= row.depth * row.startNum && col * row.endDen <= row.depth * row.endNum;
+
+							if ((wall || centred) && area.Contains(pos)) {
+								visible.Set(pos.x - area.x, pos.y - area.y);
+							}
+							if (previous == 1 && !wall) {
+								row.startNum = 2 * col - 1;
+								row.startDen = 2 * row.depth;
+							}
+							if (previous == 0 && wall) {
+								rows.push_back({ row.depth + 1, row.startNum, row.startDen, 2 * col - 1, 2 * row.depth });
+							}
+							previous = wall;
+						}
+						if (previous == 0) {
+							rows.push_back({ row.depth + 1, row.startNum, row.startDen, row.endNum, row.endDen });
+						}
+					}
+				}
+
+				static GridPosition Transform(GridPosition root, int quadrant, int depth, int col) {
+					switch (quadrant) {
+					case 0: return { root.x + col, root.y - depth };
+					case 1: return { root.x + col, root.y + depth };
+					case 2: return { root.x + depth, root.y + col };
+					default: return { root.x - depth, root.y + col };
+					}
+				}
+
+				static int FloorDiv(int num, int den) {
+					return num >= 0 ? num / den : -((-num + den - 1) / den);
+				}
+			};
+
+			// An enemy chasing the player: the tiles it still has to walk and a cursor at the next one.
+			struct Pursuit {
+				EntityGrid::EntityId id = EntityGrid::NoEntity;
+				vector<GridPosition> path;
+				size_t next = 0;
+
+				bool HasStep() const { return next < path.size(); }
+				GridPosition Step() const { return path[next]; }
+			};
+
+			// How many tiles ahead a group member plans, and reserves, at a time: one bit per step of
+			// a tile's reservation byte.
+			static const int ReservationWindow = 8;
+
+			int stepCounter = 0;
+			int reevalInterval = 2;
+			// How many of the nearest enemies chase at once. One plans with A* around the others;
+			// a group shares the distance field (see PlanPursuits).
+			int pursuerCount = 1;
+			bool everyEnemyPursues = false;
+			// Nearest first, which is also the order they move in.
+			vector<Pursuit> pursuits;
+			DistanceField playerField;
+			FieldOfView playerView;
+			Engine::Profiler* profiler = nullptr;
+			const ContentTable* content = &ContentTable::Default();
+
+			// Forgets the pursuers and the fields, as when a new level starts.
+			void Reset() {
+				stepCounter = 0;
+				pursuits.clear();
+				playerField.Invalidate();
+				playerView.Invalidate();
+			}
+
+			bool Group() const {
+				return pursuerCount > 1;
+			}
+
+			bool IsHostile(char type) const {
+				return content->Hostile(type);
+			}
+
+			struct Node {
+				GridPosition pos;
+				int g, f;
+				bool operator>(const Node& other) const { return f > other.f; }
+			};
+
+			static int ManhattanDistance(const GridPosition& a, const GridPosition& b) {
+				return abs(a.x - b.x) + abs(a.y - b.y);
+			}
+
+			static bool IsWalkable(GridPosition pos, const LevelMap& levelData,
+				const EntityGrid& entityMap, GridPosition playerPos) {
+
+				if (!levelData.IsGround(pos)) {
+					return false;
+				}
+				if (entityMap.Has(pos) && pos != playerPos) {
+					return false;
+				}
+				return true;
+			}
+
+			static bool HasLineOfSight(GridPosition from, GridPosition to,
+				const LevelMap& levelData) {
+				int x0 = from.x, y0 = from.y;
+				int x1 = to.x, y1 = to.y;
+				int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+				int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+				int err = dx + dy;
+
+				while (true) {
+					if (!levelData.IsGround({ x0, y0 }) && !(x0 == from.x && y0 == from.y)) {
+						return false;
+					}
+					if (x0 == x1 && y0 == y1) {
+						break;
+					}
+					int e2 = 2 * err;
+
+					if (e2 >= dy) {
+						err += dy;
+						x0 += sx;
+					}
+					if (e2 <= dx) {
+						err += dx;
+						y0 += sy;
+					}
+				}
+				return true;
+			}
+
+			// Reusable A* state indexed by tile of the active area. A generation counter marks which
+			// g-scores belong to the current query, so nothing is cleared or allocated between
+			// queries. The open list uses push_heap/pop_heap exactly like std::priority_queue does,
+			// which keeps the order of equal-cost nodes, and therefore the returned paths, unchanged.
+			class PathfindingContext {
+			public:
+				// Writes the steps after start up to and including goal into path, or leaves it empty
+				// when the goal cannot be reached inside the active area.
+				bool FindPath(GridPosition start, GridPosition goal, const LevelMap& levelData,
+					const EntityGrid& entityMap, vector<GridPosition>& path) {
+					const GridPosition dirs[] = { {0,1}, {0,-1}, {1,0}, {-1,0} };
+					path.clear();
+					open.clear();
+					area = levelData.ActiveArea();
+
+					if (!area.Contains(start) || !area.Contains(goal)) {
+						return false;
+					}
+					Reserve(area.Area());
+					NextGeneration();
+					int startKey = Key(start);
+					open.push_back({ start, 0, ManhattanDistance(start, goal) });
+					SetScore(startKey, 0);
+
+					while (!open.empty()) {
+						pop_heap(open.begin(), open.end(), greater<Node>());
+						Node current = open.back();
+						open.pop_back();
+
+						if (current.pos == goal) {
+							for (int k = Key(goal); k != startKey; k = cameFrom[k]) {
+								path.push_back(area.At(k));
+							}
+							reverse(path.begin(), path.end());
+							return true;
+						}
+						int currentKey = Key(current.pos);
+						int tentative = gScore[currentKey] + 1;
+
+						for (const GridPosition& d : dirs) {
+							GridPosition next = { current.pos.x + d.x, current.pos.y + d.y };
+
+							if (!area.Contains(next) || (!IsWalkable(next, levelData, entityMap, goal) && next != goal)) {
+								continue;
+							}
+							int nextKey = Key(next);
+
+							if (scoreGeneration[nextKey] != generation || tentative < gScore[nextKey]) {
+								cameFrom[nextKey] = currentKey;
+								SetScore(nextKey, tentative);
+								open.push_back({ next, tentative, tentative + ManhattanDistance(next, goal) });
+								push_heap(open.begin(), open.end(), greater<Node>());
+							}
+						}
+					}
+					return false;
+				}
+
+			private:
+				vector<int> gScore;
+				vector<int> cameFrom;
+				vector<uint32_t> scoreGeneration;
+				vector<Node> open;
+				GridRect area{ 0, 0, 0, 0 };
+				uint32_t generation = 0;
+
+				int Key(GridPosition p) const {
+					return area.Index(p);
+				}
+
+				void Reserve(int tiles) {
+					if ((int)gScore.size() < tiles) {
+						gScore.resize(tiles, 0);
+						cameFrom.resize(tiles, 0);
+						scoreGeneration.resize(tiles, 0);
+						open.reserve(4 * tiles);
+					}
+				}
+
+				void SetScore(int key, int score) {
+					gScore[key] = score;
+					scoreGeneration[key] = generation;
+				}
+
+				void NextGeneration() {
+					if (++generation == 0) {
+						fill(scoreGeneration.begin(), scoreGeneration.end(), 0);
+						generation = 1;
+					}
+				}
+			};
+
+			PathfindingContext pathfinder;
+
+			vector<GridPosition> AStarPath(GridPosition start, GridPosition goal,
+				const LevelMap& levelData,
+				const EntityGrid& entityMap) {
+				vector<GridPosition> path;
+				pathfinder.FindPath(start, goal, levelData, entityMap, path);
+				return path;
+			}
+
+			// Every reevalInterval ticks, or as soon as a pursuer is gone, picks the pursuers again and
+			// plans their paths. A lone pursuer gets an A* path around the entities standing still. A
+			// group walks down the distance field instead, which costs one search for all of them:
+			// nearest first, each reserving the tiles it will enter at each time step, and preferring
+			// a downhill tile nobody ahead of it enters at the same step. Equally short routes share
+			// the group out rather than queueing it in one corridor.
+			void PlanPursuits(const LevelMap& levelData, EntityGrid& entityMap, GridPosition playerPos) {
+				Engine::Profiler::Scope scope(profiler, Engine::Profiler::AIMove);
+				stepCounter++;
+
+				if (Group()) {
+					playerField.Update(levelData, playerPos);
+				}
+				bool lost = any_of(pursuits.begin(), pursuits.end(),
+					[&](const Pursuit& pursuit) { return !entityMap.Alive(pursuit.id); });
+
+				if (!pursuits.empty() && stepCounter < reevalInterval && !lost) {
+					return;
+				}
+				stepCounter = 0;
+				SelectPursuers(levelData, entityMap, playerPos);
+
+				if (!Group()) {
+					for (Pursuit& pursuit : pursuits) {
+						pursuit.next = 0;
+						pathfinder.FindPath(entityMap.Position(pursuit.id), playerPos, levelData, entityMap, pursuit.path);
+					}
+					return;
+				}
+				ClearReservations(levelData.ActiveArea());
+
+				for (Pursuit& pursuit : pursuits) {
+					pursuit.path.clear();
+					pursuit.next = 0;
+					WalkDownField(entityMap.Position(pursuit.id), pursuit.path, true);
+				}
+			}
+
+			// The tile the pursuer at pos heads for this tick: the next one on its path, or in a group,
+			// when that one is taken, another free tile one step closer on the distance field, with
+			// the path walked again from there. A group member whose path ran out or no longer starts
+			// next to it walks it again from pos. Returns { -1, -1 } when there is no path to follow.
+			GridPosition NextPursuitStep(Pursuit& pursuit, GridPosition pos, const EntityGrid& entityMap, GridPosition playerPos) {
+				if (Group() && (!pursuit.HasStep() || ManhattanDistance(pos, pursuit.Step()) != 1)) {
+					pursuit.path.clear();
+					pursuit.next = 0;
+					WalkDownField(pos, pursuit.path, false);
+				}
+				if (!pursuit.HasStep() || ManhattanDistance(pos, pursuit.Step()) != 1) {
+					return { -1, -1 };
+				}
+				GridPosition next = pursuit.Step();
+
+				if (!Group() || next == playerPos || !entityMap.Has(next)) {
+					return next;
+				}
+				GridPosition around = playerField.NextStep(pos, entityMap);
+
+				if (around != pos) {
+					pursuit.path.clear();
+					pursuit.next = 0;
+					pursuit.path.push_back(around);
+					WalkDownField(around, pursuit.path, false);
+					return around;
+				}
+				return next;
+			}
+
+			// The nearest enemy that can see the player, or failing that the nearest enemy at all.
+			GridPosition SelectTarget(const LevelMap& levelData, const EntityGrid& entityMap, GridPosition playerPos) {
+				const GridRect& area = levelData.ActiveArea();
+				playerView.Update(levelData, playerPos);
+				GridPosition chosen = entityMap.Nearest(playerPos, area,
+					[this](GridPosition pos, char type) { return IsHostile(type) && playerView.Visible(pos); });
+
+				if (chosen.x == -1) {
+					chosen = entityMap.Nearest(playerPos, area, [this](GridPosition, char type) { return IsHostile(type); });
+				}
+				return chosen;
+			}
+
+			// The pursuerCount hostile entities of the active area nearest the player, those that can
+			// see it first, ties going to the lower row and then the lower column as in SelectTarget.
+			// They are marked Pursue and every other entity Wander. A group needs the distance field
+			// up to date.
+			void SelectPursuers(const LevelMap& levelData, EntityGrid& entityMap, GridPosition playerPos) {
+				entityMap.ForEach([&](EntityGrid::EntityId id) { entityMap.State(id) = EntityGrid::AIState::Wander; });
+				candidates.clear();
+
+				if (pursuerCount == 1) {
+					GridPosition chosen = SelectTarget(levelData, entityMap, playerPos);
+
+					if (chosen.x != -1) {
+						candidates.push_back({ 0, entityMap.IdAt(chosen) });
+					}
+				}
+				else {
+					const GridRect& area = levelData.ActiveArea();
+					playerView.Update(levelData, playerPos);
+					entityMap.ForEach([&](EntityGrid::EntityId id) {
+						GridPosition pos = entityMap.Position(id);
+
+						if (area.Contains(pos) && IsHostile(entityMap.Type(id))) {
+							uint64_t key = (uint64_t)!playerView.Visible(pos) << 62 | (uint64_t)ManhattanDistance(pos, playerPos) << 32
+								| (uint64_t)pos.y << 16 | (uint64_t)pos.x;
+							candidates.push_back({ key, id });
+						}
+					});
+					size_t count = min(candidates.size(), (size_t)max(0, pursuerCount));
+					partial_sort(candidates.begin(), candidates.begin() + count, candidates.end());
+					candidates.resize(count);
+
+					// The group plans and moves nearest first by walking distance.
+					for (size_t i = 0; i < count; ++i) {
+						candidates[i].first = (uint64_t)playerField.Distance(entityMap.Position(candidates[i].second)) << 32 | i;
+					}
+					sort(candidates.begin(), candidates.end());
+				}
+				pursuits.resize(candidates.size());
+
+				for (size_t i = 0; i < candidates.size(); ++i) {
+					pursuits[i].id = candidates[i].second;
+					entityMap.State(pursuits[i].id) = EntityGrid::AIState::Pursue;
+				}
+			}
+
+		private:
+			vector<pair<uint64_t, EntityGrid::EntityId>> candidates;
+			// Bit t of a tile's byte is set once a pursuer of the group plans to enter the tile t + 1
+			// ticks from now. reservedTiles lists the bytes to clear for the next plan.
+			vector<uint8_t> reservations;
+			vector<int> reservedTiles;
+			GridRect reservationArea{ 0, 0, 0, 0 };
+
+			// Appends the next ReservationWindow tiles (fewer near the player) of the way from from
+			// down the distance field; a pursuer walks on from the end of them when it gets there.
+			// With reserve, each tile is reserved for the step it is entered at, and a downhill tile
+			// someone else reserved for that step is only taken when every other one is reserved too.
+			void WalkDownField(GridPosition from, vector<GridPosition>& path, bool reserve) {
+				const GridPosition steps[] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+				uint16_t distance = playerField.Distance(from);
+
+				if (distance == DistanceField::Unreachable) {
+					return;
+				}
+				for (int time = 0; time < ReservationWindow && distance > 0; ++time, --distance) {
+					GridPosition chosen{ -1, -1 };
+
+					for (const GridPosition& step : steps) {
+						GridPosition next{ from.x + step.x, from.y + step.y };
+
+						if (playerField.Distance(next) != distance - 1) {
+							continue;
+						}
+						if (chosen.x == -1) {
+							chosen = next;
+						}
+						if (!reserve || !(reservations[reservationArea.Index(next)] >> time & 1)) {
+							chosen = next;
+							break;
+						}
+					}
+					if (reserve) {
+						uint8_t& reserved = reservations[reservationArea.Index(chosen)];
+
+						if (!reserved) {
+							reservedTiles.push_back(reservationArea.Index(chosen));
+						}
+						reserved |= (uint8_t)(1 << time);
+					}
+					path.push_back(chosen);
+					from = chosen;
+				}
+			}
+
+			void ClearReservations(const GridRect& area) {
+				if (area != reservationArea) {
+					reservations.assign(area.Area(), 0);
+					reservationArea = area;
+				}
+				else {
+					for (int tile : reservedTiles) {
+						reservations[tile] = 0;
+					}
+				}
+				reservedTiles.clear();
+			}
+		};
+
+		// Open tiles of the active area in row order, so a streamed world spawns around the player.
+		static vector<GridPosition> GetWalkableTiles(const LevelMap& levelData) {
+			vector<GridPosition> walkable;
+			levelData.ForEachOpenTile([&](GridPosition pos) { walkable.push_back(pos); });
+			return walkable;
+		}
+
+		// Where PlaceEntitiesRandomly may put entities: at least minDistance tiles (Manhattan)
+		// from avoid, and with spread, dealt out to the level's regions in turn from a random
+		// first region, so a wave does not bunch up in one part of the level.
+		struct PlacementRules {
+			GridPosition avoid{ -1, -1 };
+			int minDistance = 0;
+			bool spread = false;
+		};
+
+		static void PlaceEntitiesRandomly(LevelMap& levelData, EntityGrid& entityMap, const ContentTable& content,
+			char entityChar, int count, mt19937& generator) {
+			PlaceEntitiesRandomly(levelData, entityMap, content, entityChar, count, generator, PlacementRules());
+		}
+
+		// Draws count free open tiles from the level's open tile index with a partial
+		// Fisher-Yates shuffle: each draw swaps a random tile of the region's untried slice to its
+		// front, and a tile that breaks the rules or is taken is swapped to its back instead. The
+		// cost follows count and the rejected tiles, not the level size. Places fewer when the
+		// level runs out of tiles that fit. Entities start with their archetype's stats.
+		static void PlaceEntitiesRandomly(LevelMap& levelData, EntityGrid& entityMap, const ContentTable& content,
+			char entityChar, int count, mt19937& generator, const PlacementRules& rules) {
+			LevelMap::OpenTileIndex& index = levelData.OpenTiles();
+			vector<GridPosition>& tiles = index.tiles;
+			const int regions = rules.spread ? LevelMap::RegionCount : 1;
+			int front[LevelMap::RegionCount], back[LevelMap::RegionCount];
+
+			for (int region = 0; region < regions; ++region) {
+				front[region] = rules.spread ? index.regionBegin[region] : 0;
+				back[region] = rules.spread ? index.regionBegin[region + 1] : (int)tiles.size();
+			}
+			EntityGrid::Stats stats = content[entityChar].Stats();
+			int region = regions > 1 ? Engine::LevelGenerator::RandomInt(generator, 0, regions - 1) : 0;
+			int placed = 0, emptyRegions = 0;
+
+			while (placed < count && emptyRegions < regions) {
+				if (front[region] == back[region]) {
+					++emptyRegions;
+					region = (region + 1) % regions;
+					continue;
+				}
+				int pick = Engine::LevelGenerator::RandomInt(generator, front[region], back[region] - 1);
+				GridPosition pos = tiles[pick];
+
+				if (entityMap.Has(pos) || (rules.minDistance > 0
+					&& abs(pos.x - rules.avoid.x) + abs(pos.y - rules.avoid.y) < rules.minDistance)) {
+					swap(tiles[pick], tiles[--back[region]]);
+					continue;
+				}
+				swap(tiles[pick], tiles[front[region]++]);
+				entityMap.Set(pos, entityChar, stats);
+				++placed;
+				emptyRegions = 0;
+				region = (region + 1) % regions;
+			}
+		}
+
+		static void UpdateEntities(Game& game, LevelMap& levelData, EntityGrid& entityMap,
+			GridPosition playerPos) {
+			Engine::Profiler::Scope scope(&game.profiler, Engine::Profiler::Entities);
+
+			if (game.ai.everyEnemyPursues) {
+				game.ai.playerField.Update(levelData, playerPos);
+			}
+			else {
+				game.ai.PlanPursuits(levelData, entityMap, playerPos);
+			}
+			MoveEntities(game, levelData, entityMap, playerPos);
+		}
+
+		// Moves the pursuers first, nearest first, so in a corridor the one in front clears the tile
+		// the next one wants in the same tick. Then walks the entity store in id order. Ids are
+		// stable and nothing spawns during a tick, so an entity removed by an encounter only leaves
+		// a free slot behind. Entities outside the active area of a streamed world wait until the
+		// player comes back into range.
+		static void MoveEntities(Game& game, const LevelMap& levelData, EntityGrid& entityMap, GridPosition playerPos) {
+			const GridRect& area = levelData.ActiveArea();
+			AIController& ai = game.ai;
+
+			for (AIController::Pursuit& pursuit : ai.pursuits) {
+				if (!entityMap.Alive(pursuit.id) || !area.Contains(entityMap.Position(pursuit.id))) {
+					continue;
+				}
+				GridPosition pos = entityMap.Position(pursuit.id);
+				GridPosition newPos = ai.NextPursuitStep(pursuit, pos, entityMap, playerPos);
+
+				if (newPos.x == -1) {
+					StepEntity(game, levelData, entityMap, pos, RandomStep(game, levelData, entityMap, pos, playerPos), playerPos);
+					continue;
+				}
+				EntityGrid::EntityId blocker = newPos == playerPos ? EntityGrid::NoEntity : entityMap.IdAt(newPos);
+
+				// A wandering entity in the way of a group trades places with the pursuer instead of
+				// holding up everyone behind it in a corridor.
+				if (ai.Group() && blocker != EntityGrid::NoEntity && entityMap.State(blocker) == EntityGrid::AIState::Wander) {
+					entityMap.Swap(pos, newPos);
+					game.renderer.ComposeCell(levelData, entityMap, pos);
+					game.renderer.ComposeCell(levelData, entityMap, newPos);
+					++pursuit.next;
+				}
+				else if (StepEntity(game, levelData, entityMap, pos, newPos, playerPos)) {
+					++pursuit.next;
+				}
+			}
+			for (EntityGrid::EntityId id = 0; id < entityMap.Slots(); ++id) {
+				char type = entityMap.Type(id);
+
+				// Pursuers have moved already. With every enemy chasing there are none, whatever
+				// state a loaded save gave its entities.
+				if (!type || type == TilePlayer || !area.Contains(entityMap.Position(id))
+					|| (entityMap.State(id) == EntityGrid::AIState::Pursue && !ai.everyEnemyPursues)) {
+					continue;
+				}
+				GridPosition pos = entityMap.Position(id);
+				GridPosition newPos;
+
+				if (ai.everyEnemyPursues && ai.IsHostile(type)
+					&& ai.playerField.Distance(pos) != AIController::DistanceField::Unreachable) {
+					newPos = ai.playerField.NextStep(pos, entityMap);
+				}
+				else {
+					newPos = RandomStep(game, levelData, entityMap, pos, playerPos);
+				}
+				StepEntity(game, levelData, entityMap, pos, newPos, playerPos);
+			}
+		}
+
+		// A random free neighbour of pos, or the player's tile, or pos when every way is blocked.
+		static GridPosition RandomStep(Game& game, const LevelMap& levelData, const EntityGrid& entityMap,
+			GridPosition pos, GridPosition playerPos) {
+			GridPosition newPos = pos;
+			Direction dirs[] = { Direction::Up, Direction::Down, Direction::Left, Direction::Right };
+			shuffle(begin(dirs), end(dirs), game.rng);
+			bool foundStep = false;
+
+			for (auto dir : dirs) {
+				newPos = pos;
+
+				switch (dir) {
+				case Direction::Up: {
+					newPos.y--; break;
+				}
+				case Direction::Down: {
+					newPos.y++; break;
+				}
+				case Direction::Left: {
+					newPos.x--; break;
+				}
+				case Direction::Right: {
+					newPos.x++; break;
+				}
+				default: {
+					break;
+				}
+				}
+
+				if (!levelData.IsGround(newPos)) {
+					continue;
+				}
+				char occupant = entityMap.At(newPos);
+
+				if (occupant && occupant != TilePlayer) {
+					continue;
+				}
+				if (newPos == playerPos || !occupant) {
+					foundStep = true;
+					break;
+				}
+			}
+			return foundStep ? newPos : pos;
+		}
+
+		// Moves the entity at pos onto newPos when it is free, or has it fight the player standing
+		// there. While a screen is open the player is busy; nobody else gets to start a fight.
+		// Returns whether the entity moved.
+		static bool StepEntity(Game& game, const LevelMap& levelData, EntityGrid& entityMap,
+			GridPosition pos, GridPosition newPos, GridPosition playerPos) {
+			if (newPos == playerPos) {
+				if (game.ai.IsHostile(entityMap.At(pos)) && !game.encounters.ScreenOpen()) {
+					game.encounters.HandleEncounter(game, entityMap.IdAt(pos));
+					entityMap.Erase(pos);
+					game.renderer.ComposeCell(levelData, entityMap, pos);
+					game.renderer.ComposeCell(levelData, entityMap, newPos);
+				}
+				return false;
+			}
+			if (newPos == pos || entityMap.Has(newPos)) {
+				return false;
+			}
+			entityMap.Move(pos, newPos);
+			game.renderer.ComposeCell(levelData, entityMap, pos);
+			game.renderer.ComposeCell(levelData, entityMap, newPos);
+			return true;
+		}
+	};
+	EntityManager::Encounters encounters;
+	EntityManager::AIController ai;
+
+	static bool CanMove(const GridPosition& pos, const LevelMap& levelData) {
+		return levelData.IsGround(pos);
+	}
+
+	Direction GetMoveDirection() const {
+		if (input.up) {
+			return Direction::Up;
+		}
+		else if (input.down) {
+			return Direction::Down;
+		}
+		else if (input.left) {
+			return Direction::Left;
+		}
+		else if (input.right) {
+			return Direction::Right;
+		}
+		else {
+			return Direction::None;
+		}
+	}
+
+	void MovePlayer(Direction dir) {
+		GridPosition newPos = playerPos;
+
+		switch (dir) {
+		case Direction::Up: {
+			newPos.y--;
+			break;
+		}
+		case Direction::Down: {
+			newPos.y++;
+			break;
+		}
+		case Direction::Left: {
+			newPos.x--;
+			break;
+		}
+		case Direction::Right: {
+			newPos.x++;
+			break;
+		}
+		default: {
+			return;
+		}
+		}
+
+		if (!CanMove(newPos, LevelData)) {
+			return;
+		}
+		EntityGrid::EntityId occupant = EntityMap.IdAt(newPos);
+
+		if (occupant != EntityGrid::NoEntity) {
+			encounters.HandleEncounter(*this, occupant);
+			EntityMap.Erase(newPos);
+		}
+		EntityMap.Move(playerPos, newPos);
+		GridPosition prevPos = playerPos;
+		playerPos = newPos;
+		Engine::LevelGenerator::ActivateAround(LevelData, playerPos);
+
+		if (renderer.FollowPlayer(LevelData, playerPos)) {
+			renderer.DrawView(LevelData, EntityMap);
+		}
+		else {
+			renderer.ComposeCell(LevelData, EntityMap, prevPos);
+			renderer.ComposeCell(LevelData, EntityMap, playerPos);
+		}
+	}
+
+	// Hostile entities of a new wave start at least this many tiles from the player.
+	static const int SpawnDistance = 8;
+
+	void GenerateNewLevel() {
+		EntityMap.Clear();
+		playerPos = { 1, 1 };
+		LevelData = levelQueue.Pop();
+		ai.Reset();
+		renderer.FollowPlayer(LevelData, playerPos);
+		EntityMap.Set(playerPos, TilePlayer);
+
+		WaveManager::WaveInfo wave = waveManager.GetNextWave();
+		EntityManager::PlacementRules hostile;
+		hostile.avoid = playerPos;
+		hostile.minDistance = SpawnDistance;
+		hostile.spread = true;
+
+		for (const ContentTable::Spawn& spawn : wave.spawns) {
+			EntityManager::PlaceEntitiesRandomly(LevelData, EntityMap, content, spawn.type, spawn.count, rng,
+				content.Hostile(spawn.type) ? hostile : EntityManager::PlacementRules());
+		}
+
+		renderer.DrawInitialMap(LevelData, EntityMap);
+		DrawHUD();
+		compositor.Present();
+
+		if (!savePath.empty()) {
+			Autosave();
+		}
+	}
+
+	void Pause() {
+		isPaused = true;
+		ClearConsole();
+	}
+
+	bool EntityMapFinishedWave() const {
+		for (EntityGrid::EntityId id = 0; id < EntityMap.Slots(); ++id) {
+			char type = EntityMap.Type(id);
+			if (content.RoleOf(type) != ContentTable::Role::None) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Sleeps until a key arrives or the scheduler's next deadline, whichever is first. Keys are
+	// handled the moment they arrive; entity turns and HUD message expiry are timed tasks.
+	void Run(Game& game) {
+		using namespace std::chrono;
+		typedef Engine::Scheduler::Clock Clock;
+		Engine::Scheduler scheduler;
+		bool entityTickDue = false, hudExpired = false;
+		int hudExpiryTask = -1;
+
+		scheduler.Every(milliseconds(EntityTickMs), [&]() { entityTickDue = true; });
+
+		while (!quitRequested) {
+			int timeoutMs = scheduler.MillisecondsUntilNext(Clock::now(), 1000);
+			bool keyReady = terminal.WaitForInput(timeoutMs);
+			auto wake = Clock::now();
+			scheduler.RunDue(wake);
+
+			if (isPaused || !(keyReady || entityTickDue || hudExpired)) {
+				continue;
+			}
+			Frame(game, entityTickDue);
+			entityTickDue = hudExpired = false;
+
+			if (keyReady) {
+				inputLatency.Record(duration_cast<microseconds>(Clock::now() - wake).count());
+			}
+			if (encounters.showingMessage && hudExpiryTask < 0) {
+				hudExpiryTask = scheduler.At(encounters.lastMessageTime + milliseconds(HudMessageMs),
+					[&]() { hudExpired = true; hudExpiryTask = -1; });
+			}
+			if (!quitRequested && !encounters.ScreenOpen() && EntityMapFinishedWave()) {
+				GenerateNewLevel();
+			}
+		}
+	}
+
+	static constexpr int EntityTickMs = 300;
+	static constexpr int HudMessageMs = 2000;
+	Engine::Histogram frameTime;
+	Engine::Histogram inputLatency;
+
+	void Frame(Game& game, bool entityTickDue) {
+		auto frameStart = chrono::steady_clock::now();
+		size_t cellsBefore = compositor.totals.cellsWritten;
+
+		if (recorder) {
+			recorder->MarkFrame(entityTickDue, StateDigest());
+		}
+		input.Update(*this);
+		Direction dir = GetMoveDirection();
+
+		if (player.hp <= 0 && !encounters.ScreenOpen()) {
+			Pause();
+			GameOverManager::HandleGameOver(*this);
+		}
+		// Esc or the game over screen ends the run here, before anything else moves.
+		if (quitRequested) {
+			input.Reset();
+			return;
+		}
+		if (dir != Direction::None) {
+			MovePlayer(dir);
+		}
+		if (entityTickDue && (options.liveMenus || !encounters.ScreenOpen())) {
+			EntityManager::UpdateEntities(game, LevelData, EntityMap, playerPos);
+		}
+		if (encounters.ScreenOpen() && (overlay.Stale() || entityTickDue)) {
+			overlay.Compose(2);
+		}
+		encounters.UpdateHUD(*this);
+
+		if (encounters.showingMessage) {
+			DrawHUD(encounters.currentMessage);
+		}
+		else {
+			DrawHUD();
+		}
+		compositor.Present();
+		profiler.RecordCells(compositor.totals.cellsWritten - cellsBefore);
+
+		if (profiler.overlayVisible && entityTickDue) {
+			profiler.DrawOverlay(terminal, 2);
+		}
+
+		input.Reset();
+		frameTime.Record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - frameStart).count());
+	}
+
+	class GameOverManager {
+	public:
+		static void ShowGameOver(Game& game) {
+			TerminalBackend& terminal = game.terminal;
+			std::vector<std::string> logo = {
+				"  _____                        ",
+				" / ____|                       ",
+				"| |  __  __ _ _ __ ___   ___   ",
+				"| | |_ |/ _` | '_ ` _ \\ / _ \\  ",
+				"| |__| | (_| | | | | | |  __/  ",
+				" \\_____|\\__,_|_| |_| |_|\\___|  ",
+				"   / __ \\                       ",
+				"  | |  | |_   _____ _ __         ",
+				"  | |  | \\ \\ / / _ \\ '__|       ",
+				"  | |__| |\\ V /  __/ |           ",
+				"   \\____/  \\_/ \\___|_|           "
+
+			};
+
+			int logoHeight = (int)logo.size();
+			int startY = (GameFieldHeight - logoHeight) / 2;
+
+			for (int i = 0; i < logoHeight; i++) {
+				int startX = (GameFieldWidth - (int)logo[i].size()) / 2;
+				terminal.SetCursor(startX, startY + i);
+				terminal.SetColor(12);
+				game.text << logo[i];
+			}
+
+			terminal.SetColor(7);
+			terminal.Wait(1000);
+			terminal.SetCursor(0, 0);
+		}
+
+		static void HandleGameOver(Game& game) {
+			ShowGameOver(game);
+			game.Quit();
+		}
+	};
+
+	class WaveManager {
+	public:
+		int currentWave = 0;
+
+		// What a wave spawns, in the order the content's schedule lists it.
+		struct WaveInfo {
+			vector<ContentTable::Spawn> spawns;
+
+			int Count(char type) const {
+				for (const ContentTable::Spawn& spawn : spawns) {
+					if (spawn.type == type)
+						return spawn.count;
+				}
+				return 0;
+			}
+		};
+
+		explicit WaveManager(const ContentTable& content) : content(&content) {}
+
+		WaveInfo GetNextWave() {
+			currentWave++;
+			WaveInfo wave;
+			content->WaveSpawns(currentWave, wave.spawns);
+			return wave;
+		}
+	private:
+		const ContentTable* content;
+	};
+	WaveManager waveManager{ content };
+
+	// Beating the boss puts the victory banner on the overlay panel; the next key ends the run.
+	class GameWinManager {
+	public:
+		static void ShowGameWin(Game& game) {
+			game.bossDefeated = true;
+			game.encounters.OpenScreen(EntityManager::Encounters::Screen::Victory);
+			game.encounters.WaitForKey(EntityManager::Encounters::AfterKey::Quit);
+		}
+
+		static void Describe(Game& game) {
+			static const char* const logo[] = {
+				"__      ___      _                   _",
+				"\\ \\    / (_)    | |                 | |",
+				" \\ \\  / / _  ___| |_ ___  _ __ _   _| |",
+				"  \\ \\/ / | |/ __| __/ _ \\| '__| | | | |",
+				"   \\  /  | | (__| || (_) | |  | |_| |_|",
+				"    \\/   |_|\\___|\\__\\___/|_|   \\__, (_)",
+				"                                 __/ |",
+				"                                |___/"
+			};
+			OverlayPanel& panel = game.overlay;
+			panel.Begin("VICTORY");
+			panel.Line("");
+
+			for (const char* line : logo) {
+				panel.Line(string(6, ' ') + line, 2);
+			}
+			panel.Line("");
+
+			for (const string& line : game.encounters.log) {
+				panel.Line(line, 14);
+			}
+			panel.Line("Congratulations! You defeated the boss!");
+			panel.Line("");
+			panel.Line("Press any key to exit...", 15);
+		}
+	};
+	bool bossDefeated = false;
+
+	// A saved run in a versioned binary format. A 24-byte header (magic, version, payload size and
+	// an FNV-1a checksum of the payload) is followed by the payload, in host byte order:
+	//   wave, player stats and position
+	//   level queue: run seed and index of the next level
+	//   level: size, seed, start and active area, then the tiles of the active area as (tile, run
+	//     length) pairs; other chunks of a streamed world regenerate from the seed when revisited
+	//   entities: count, then one packed record each
+	//   the random number generator's state
+	// Loading maps the file and decodes straight from the mapping.
+	class Snapshot {
+	public:
+		static const uint32_t Version = 1;
+		static const size_t HeaderSize = 24;
+		// x, y, type, AI state, HP, attack, defense.
+		static const size_t EntityRecordSize = 2 + 2 + 1 + 1 + 4 + 4 + 4;
+
+		static bool Save(const Game& game, const string& path) {
+			return BinaryFile::WriteAtomically(path, Encode(game));
+		}
+
+		static bool Load(Game& game, const string& path) {
+			BinaryFile file;
+			return file.Map(path) && Restore(game, file.Data(), file.Size());
+		}
+
+		static vector<char> Encode(const Game& game) {
+			vector<char> bytes(HeaderSize);
+			bytes.reserve(4096);
+			const LevelMap& level = game.LevelData;
+			const EntityGrid& entities = game.EntityMap;
+			const Player& player = game.player;
+
+			Put<int32_t>(bytes, game.waveManager.currentWave);
+			for (int stat : { player.hp, player.maxHp, player.attack, player.defense, player.level, player.money }) {
+				Put<int32_t>(bytes, stat);
+			}
+			Put<int32_t>(bytes, game.playerPos.x);
+			Put<int32_t>(bytes, game.playerPos.y);
+			Put<uint32_t>(bytes, game.levelQueue.RunSeed());
+			Put<uint32_t>(bytes, game.levelQueue.NextIndex());
+			Put<int32_t>(bytes, level.Width());
+			Put<int32_t>(bytes, level.Height());
+			Put<uint32_t>(bytes, level.seed);
+			Put<int32_t>(bytes, level.start.x);
+			Put<int32_t>(bytes, level.start.y);
+			const GridRect& area = level.ActiveArea();
+			for (int value : { area.x, area.y, area.width, area.height }) {
+				Put<int32_t>(bytes, value);
+			}
+			size_t runCountAt = bytes.size();
+			uint32_t runs = 0, length = 0;
+			char tile = 0;
+			vector<char> row(area.width);
+			Put<uint32_t>(bytes, 0);
+
+			for (int y = area.y; y < area.y + area.height; ++y) {
+				level.ReadRow(y, area.x, area.width, row.data());
+
+				for (char next : row) {
+					if (length > 0 && (next != tile || length == 0xFFFF)) {
+						PutRun(bytes, tile, length);
+						++runs;
+						length = 0;
+					}
+					tile = next;
+					++length;
+				}
+			}
+			if (length > 0) {
+				PutRun(bytes, tile, length);
+				++runs;
+			}
+			memcpy(&bytes[runCountAt], &runs, sizeof(runs));
+			Put<uint32_t>(bytes, (uint32_t)entities.Size());
+			entities.ForEach([&](EntityGrid::EntityId id) {
+				Put<uint16_t>(bytes, (uint16_t)entities.Position(id).x);
+				Put<uint16_t>(bytes, (uint16_t)entities.Position(id).y);
+				Put<char>(bytes, entities.Type(id));
+				Put<uint8_t>(bytes, (uint8_t)entities.State(id));
+				Put<int32_t>(bytes, entities.Hp(id));
+				Put<int32_t>(bytes, entities.Attack(id));
+				Put<int32_t>(bytes, entities.Defense(id));
+				});
+			ostringstream generator;
+			generator << game.rng;
+			string state = generator.str();
+			Put<uint32_t>(bytes, (uint32_t)state.size());
+			bytes.insert(bytes.end(), state.begin(), state.end());
+
+			uint64_t payloadSize = bytes.size() - HeaderSize;
+			uint64_t checksum = Checksum(bytes.data() + HeaderSize, (size_t)payloadSize);
+			memcpy(&bytes[0], "ADSV", 4);
+			memcpy(&bytes[4], &Version, sizeof(Version));
+			memcpy(&bytes[8], &payloadSize, sizeof(payloadSize));
+			memcpy(&bytes[16], &checksum, sizeof(checksum));
+			return bytes;
+		}
+
+		// Replaces the run in game with the one in data. The snapshot is read and checked in full
+		// before anything in game changes; the level and entity containers are reused when the
+		// world size matches.
+		static bool Restore(Game& game, const char* data, size_t size) {
+			uint32_t version;
+			uint64_t payloadSize, checksum;
+
+			if (size < HeaderSize || memcmp(data, "ADSV", 4) != 0) {
+				return false;
+			}
+			memcpy(&version, data + 4, sizeof(version));
+			memcpy(&payloadSize, data + 8, sizeof(payloadSize));
+			memcpy(&checksum, data + 16, sizeof(checksum));
+
+			if (version != Version || payloadSize != size - HeaderSize || checksum != Checksum(data + HeaderSize, size - HeaderSize)) {
+				return false;
+			}
+			Reader in{ data + HeaderSize, data + size };
+			int wave = in.Get<int32_t>();
+			Player player;
+			for (int* stat : { &player.hp, &player.maxHp, &player.attack, &player.defense, &player.level, &player.money }) {
+				*stat = in.Get<int32_t>();
+			}
+			GridPosition playerPos{ in.Get<int32_t>(), in.Get<int32_t>() };
+			uint32_t runSeed = in.Get<uint32_t>(), nextLevel = in.Get<uint32_t>();
+			int width = in.Get<int32_t>(), height = in.Get<int32_t>();
+			uint32_t levelSeed = in.Get<uint32_t>();
+			GridPosition start{ in.Get<int32_t>(), in.Get<int32_t>() };
+			GridRect area{ in.Get<int32_t>(), in.Get<int32_t>(), in.Get<int32_t>(), in.Get<int32_t>() };
+			GridRect world{ 0, 0, width, height };
+
+			if (!in.ok || width < (int)GameFieldWidth || height < (int)GameFieldHeight || width > MaxWorldSize || height > MaxWorldSize
+				|| !world.Contains(playerPos) || !world.Contains(start) || area != LevelMap::AreaAround(width, height, playerPos)) {
+				return false;
+			}
+			vector<char> tiles;
+			tiles.reserve(area.Area());
+
+			for (uint32_t runs = in.Get<uint32_t>(); in.ok && runs > 0; --runs) {
+				char tile = in.Get<char>();
+				uint16_t length = in.Get<uint16_t>();
+
+				if (tiles.size() + length > tiles.capacity()) {
+					return false;
+				}
+				tiles.insert(tiles.end(), length, tile);
+			}
+			uint32_t entityCount = in.Get<uint32_t>();
+			const char* records = in.Take((size_t)entityCount * EntityRecordSize);
+			bool playerFound = false;
+
+			if (!in.ok || tiles.size() != tiles.capacity()) {
+				return false;
+			}
+			vector<GridPosition> occupied(entityCount);
+
+			for (uint32_t i = 0; i < entityCount; ++i) {
+				Reader record{ records + i * EntityRecordSize, records + (i + 1) * EntityRecordSize };
+				GridPosition pos{ record.Get<uint16_t>(), record.Get<uint16_t>() };
+				char type = record.Get<char>();
+				uint8_t state = record.Get<uint8_t>();
+
+				if (!world.Contains(pos) || !type || state > (uint8_t)EntityGrid::AIState::Pursue) {
+					return false;
+				}
+				playerFound |= pos == playerPos && type == TilePlayer;
+				occupied[i] = pos;
+			}
+			sort(occupied.begin(), occupied.end());
+
+			if (!playerFound || adjacent_find(occupied.begin(), occupied.end()) != occupied.end()) {
+				return false;
+			}
+			uint32_t stateSize = in.Get<uint32_t>();
+			const char* state = in.Take(stateSize);
+			mt19937 generator;
+
+			if (!in.ok || in.cursor != in.end || !(istringstream(string(state, stateSize)) >> generator)) {
+				return false;
+			}
+
+			if (game.LevelData.Width() == width && game.LevelData.Height() == height) {
+				game.LevelData.Clear();
+				game.EntityMap.Clear();
+			}
+			else {
+				game.LevelData = LevelMap(width, height);
+				game.EntityMap = EntityGrid(width, height);
+			}
+			LevelMap& level = game.LevelData;
+			level.seed = levelSeed;
+			level.start = start;
+			level.LoadArea(area, tiles);
+
+			for (uint32_t i = 0; i < entityCount; ++i) {
+				Reader record{ records + i * EntityRecordSize, records + (i + 1) * EntityRecordSize };
+				GridPosition pos{ record.Get<uint16_t>(), record.Get<uint16_t>() };
+				char type = record.Get<char>();
+				EntityGrid::AIState aiState = (EntityGrid::AIState)record.Get<uint8_t>();
+				EntityGrid::Stats stats;
+				stats.hp = record.Get<int32_t>();
+				stats.attack = record.Get<int32_t>();
+				stats.defense = record.Get<int32_t>();
+				game.EntityMap.State(game.EntityMap.Set(pos, type, stats)) = aiState;
+			}
+			game.player = player;
+			game.playerPos = playerPos;
+			game.waveManager.currentWave = wave;
+			game.levelQueue.Restart(width, height, runSeed, nextLevel);
+			game.rng = generator;
+			game.ai.Reset();
+			game.renderer.FollowPlayer(level, playerPos);
+			game.renderer.DrawInitialMap(level, game.EntityMap);
+			game.DrawHUD();
+			game.compositor.Present();
+			return true;
+		}
+
+		static uint64_t Checksum(const char* data, size_t size) {
+			uint64_t hash = 14695981039346656037ull;
+
+			for (size_t i = 0; i < size; ++i) {
+				hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+			}
+			return hash;
+		}
+
+	private:
+		struct Reader {
+			const char* cursor;
+			const char* end;
+			bool ok = true;
+
+			template <typename T>
+			T Get() {
+				T value{};
+				const char* bytes = Take(sizeof(T));
+
+				if (bytes) {
+					memcpy(&value, bytes, sizeof(T));
+				}
+				return value;
+			}
+
+			const char* Take(size_t count) {
+				if (!ok || (size_t)(end - cursor) < count) {
+					ok = false;
+					return nullptr;
+				}
+				const char* taken = cursor;
+				cursor += count;
+				return taken;
+			}
+		};
+
+		template <typename T>
+		static void Put(vector<char>& bytes, T value) {
+			const char* raw = (const char*)&value;
+			bytes.insert(bytes.end(), raw, raw + sizeof(T));
+		}
+
+		static void PutRun(vector<char>& bytes, char tile, uint32_t length) {
+			Put<char>(bytes, tile);
+			Put<uint16_t>(bytes, (uint16_t)length);
+		}
+	};
+
+	// Where Autosave writes the run; empty for none.
+	string savePath;
+	Engine::Histogram saveTime;
+	// Logs the frames of the run when it is being recorded.
+	RecordingTerminal* recorder = nullptr;
+
+	// Cheap fingerprint of the run: wave, player, position, entity count and the next random
+	// number. A replay compares it with the recording's to tell whether it stayed in step.
+	uint64_t StateDigest() const {
+		mt19937 generator = rng;
+		int32_t values[] = { waveManager.currentWave, player.hp, player.maxHp, player.attack, player.defense,
+			player.level, player.money, playerPos.x, playerPos.y, (int32_t)EntityMap.Size(), (int32_t)generator() };
+		return Snapshot::Checksum((const char*)values, sizeof(values));
+	}
+
+	// Writes the files options asked for once the run is over.
+	void WriteReports() const {
+		if (!options.frameStatsPath.empty()) {
+			ofstream out(options.frameStatsPath);
+			frameTime.Print(out, "frame time");
+			frameTime.PrintBuckets(out);
+			inputLatency.Print(out, "input latency");
+			inputLatency.PrintBuckets(out);
+		}
+		if (!options.tracePath.empty() && !profiler.WriteTrace(options.tracePath)) {
+			cerr << "could not write trace to " << options.tracePath << "\n";
+		}
+	}
+
+	// Saves the run to savePath; says so on the HUD if that fails.
+	void Autosave() {
+		auto start = chrono::steady_clock::now();
+
+		if (!Snapshot::Save(*this, savePath)) {
+			encounters.ShowMessage(*this, "Could not save to " + savePath);
+			return;
+		}
+		saveTime.Record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
+	}
+
+	static void ShowLogo(TerminalBackend& terminal, int marginX = 2) {
+		vector<string> logo = {
+			"            _____  _____ _____ _____            ",
+			"     /\\    / ____|/ ____|_   _|_   _|           ",
+			"    /  \\  | (___ | |      | |   | |             ",
+			"   / /\\ \\  \\___ \\| |      | |   | |             ",
+			"  / ____ \\ ____) | |____ _| |_ _| |_            ",
+			" /_/___ \\_\\_____/ \\_____|_____|_____|___  _   _ ",
+			" |  __ \\| |  | | \\ | |/ ____|  ____/ __ \\| \\ | |",
+			" | |  | | |  | |  \\| | |  __| |__ | |  | |  \\| |",
+			" | |  | | |  | | . ` | | |_ |  __|| |  | | . ` |",
+			" | |__| | |__| | |\\  | |__| | |___| |__| | |\\  |",
+			" |_____/ \\____/|_| \\_|\\_____|______\\____/|_| \\_|"
+		};
+		int logoHeight = (int)logo.size();
+		int startY = (GameFieldHeight - logoHeight) / 2;
+
+		for (int i = 0; i < logoHeight; i++) {
+			int startX = (GameFieldWidth - (int)logo[i].size()) / 2 + marginX;
+			terminal.SetCursor(startX, startY + i);
+
+			if (i <= 4) {
+				terminal.SetColor(11);
+			}
+			else if (i == 5) {
+				terminal.SetColor(7);
+			}
+			else {
+				terminal.SetColor(14);
+			}
+
+			terminal.Write(logo[i].data(), logo[i].size());
+			terminal.SetColor(7);
+		}
+		terminal.Wait(1000);
+		terminal.SetCursor(0, 0);
+		terminal.SetColor(7);
+
+	}
+
+};
+
+// Terminal that never waits and renders nowhere, or into output when capture is on. Keys come
+// from a script if one is given, then from a bot that walks to the nearest entity, fights with
+// attack/heal and spends its gold in the shop. The map loop gets at most one key per frame, like
+// a player pressing keys. Once Feed has handed it keys from outside, the map loop only gets
+// those, and the bot only answers prompts that have no key waiting.
+class HeadlessTerminal : public TerminalBackend {
+public:
+	Game* game = nullptr;
+	string script;
+	// The bot's own dice, so its moves leave the game's generator exactly as a player's keys
+	// would and a recorded run replays without the bot.
+	mt19937 botRandom;
+	bool capture = false;
+	// VT output written since the owner last cleared it.
+	string output;
+
+	void Setup(int, int, int) override {}
+	void Wait(int) override {}
+
+	void Clear() override {
+		if (capture) {
+			output += "\x1b[0m\x1b[2J\x1b[H";
+		}
+	}
+
+	void SetCursor(int x, int y) override {
+		if (capture) {
+			AppendCursor(output, x, y);
+		}
+	}
+
+	void SetColor(unsigned char color) override {
+		if (capture) {
+			AppendColor(output, color);
+		}
+	}
+
+	void Write(const char* data, size_t size) override {
+		if (capture) {
+			output.append(data, size);
+		}
+	}
+
+	bool KeyAvailable() override {
+		return !frameKeyTaken && (botMoves || scriptPos < script.size());
+	}
+
+	void Feed(const string& keys) {
+		script.erase(0, scriptPos);
+		scriptPos = 0;
+		script += keys;
+		botMoves = false;
+	}
+
+	int ReadKey() override {
+		frameKeyTaken = true;
+
+		if (scriptPos < script.size()) {
+			return (unsigned char)script[scriptPos++];
+		}
+		return BotKey();
+	}
+
+	void NextFrame() {
+		frameKeyTaken = false;
+	}
+
+private:
+	size_t scriptPos = 0;
+	bool frameKeyTaken = false;
+	bool botMoves = true;
+	string planned;
+	size_t plannedPos = 0;
+	int plannedEncounter = -1;
+	Game::EntityManager::AIController::DistanceField field;
+
+	int BotKey() {
+		const Game::EntityManager::Encounters& encounters = game->encounters;
+
+		if (plannedEncounter != encounters.encounterCount || (encounters.activeEncounter == 0 && plannedPos < planned.size())) {
+			planned.clear();
+			plannedPos = 0;
+			plannedEncounter = encounters.encounterCount;
+		}
+		if (plannedPos >= planned.size()) {
+			planned = Plan();
+			plannedPos = 0;
+		}
+		return (unsigned char)planned[plannedPos++];
+	}
+
+	string Plan() {
+		const Player& player = game->player;
+
+		switch (game->content.RoleOf(game->encounters.activeEncounter)) {
+		case ContentTable::Role::Merchant: {
+			if (player.hp < player.maxHp && player.money >= 10) {
+				return "hyc";
+			}
+			if (player.money >= 15) {
+				return player.attack <= player.defense * 2 ? "2yc" : "3yc";
+			}
+			return "ec";
+		}
+		case ContentTable::Role::Enemy:
+		case ContentTable::Role::Boss: {
+			return player.hp * 3 < player.maxHp ? "hy" : "ay";
+		}
+		default: {
+			return string(1, MoveTowardNearestEntity());
+		}
+		}
+	}
+
+	char MoveTowardNearestEntity() {
+		field.Invalidate();
+		field.Update(game->LevelData, game->playerPos);
+		GridPosition target{ -1, -1 };
+		uint16_t best = Game::EntityManager::AIController::DistanceField::Unreachable;
+
+		const EntityGrid& entities = game->EntityMap;
+		entities.ForEach([&](EntityGrid::EntityId id) {
+			if (entities.Type(id) != TilePlayer && field.Distance(entities.Position(id)) < best) {
+				best = field.Distance(entities.Position(id));
+				target = entities.Position(id);
+			}
+			});
+		const GridPosition steps[] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+		const char keys[] = { 'w', 's', 'a', 'd' };
+
+		if (target.x == -1) {
+			return keys[Engine::LevelGenerator::RandomInt(botRandom, 0, 3)];
+		}
+		while (field.Distance(target) > 1) {
+			for (const GridPosition& step : steps) {
+				GridPosition next{ target.x + step.x, target.y + step.y };
+
+				if (field.Distance(next) == field.Distance(target) - 1) {
+					target = next;
+					break;
+				}
+			}
+		}
+		for (int d = 0; d < 4; ++d) {
+			if (game->playerPos.x + steps[d].x == target.x && game->playerPos.y + steps[d].y == target.y) {
+				return keys[d];
+			}
+		}
+		return keys[0];
+	}
+};
+
+// Runs task(index, worker) for every index below count on a fixed set of worker threads. Indices
+// are handed out one at a time from a shared counter, so long and short tasks still balance out.
+class ThreadPool {
+public:
+	static unsigned DefaultThreads() {
+		unsigned threads = thread::hardware_concurrency();
+		return threads ? threads : 1;
+	}
 
-					if (!validInput) {
-						std::cout << "Invalid input.\n";
-						_getch();
-					}
-				}
+	template <typename Task>
+	static void ParallelFor(size_t count, unsigned threads, Task task) {
+		atomic<size_t> next(0);
+		auto work = [&](unsigned worker) {
+			for (size_t index = next++; index < count; index = next++)
+				task(index, worker);
+			};
 
-				if (playerAlive && enemyHp <= 0) {
-					Engine::ClearConsole();
-					std::cout << "\nYou defeated " << enemyName << "!\n";
-					game.player.money += reward;
-					std::cout << "You earned " << reward << " gold! (Total gold: "
-						<< game.player.money << ")\n";
-				}
+		vector<thread> workers;
+		for (unsigned worker = 1; worker < threads; ++worker)
+			workers.emplace_back(work, worker);
+		work(0);
+		for (thread& worker : workers)
+			worker.join();
+	}
+};
 
-				if (enemyType == TileBoss && enemyHp <= 0) {
-					GameWinManager::ShowGameWin();
-				}
+// Persistent worker threads that run batches of tasks. A batch is split into one contiguous block
+// of indices per worker; workers take their own tasks from the back of their deque and, when it
+// runs dry, steal from the front of another worker's, so a worker whose tasks turned out cheap
+// takes over from one whose tasks did not. The thread calling Run works as worker 0.
+class WorkStealingPool {
+public:
+	explicit WorkStealingPool(unsigned threads) : queues(max(1u, threads)) {
+		for (unsigned worker = 1; worker < queues.size(); ++worker)
+			workers.emplace_back(&WorkStealingPool::Work, this, worker);
+	}
 
-				std::cout << "\nPress any key to continue...";
-				_getch();
-				game.Resume();
-			}
-		};
+	WorkStealingPool(const WorkStealingPool&) = delete;
+	WorkStealingPool& operator=(const WorkStealingPool&) = delete;
 
-		class AIController {
-		public:
-			static int stepCounter;
-			static GridPosition currentTarget;
-			static bool hasTarget;
-			static vector<GridPosition> currentPath;
-			static int reevalInterval;
+	~WorkStealingPool() {
+		{
+			lock_guard<mutex> lock(guard);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (thread& worker : workers)
+			worker.join();
+	}
 
-			struct Node {
-				GridPosition pos;
-				int g, f;
-				bool operator>(const Node& other) const { return f > other.f; }
-			};
+	unsigned Threads() const { return (unsigned)queues.size(); }
+	size_t Steals() const { return steals; }
 
-			static int ManhattanDistance(const GridPosition& a, const GridPosition& b) {
-				return abs(a.x - b.x) + abs(a.y - b.y);
-			}
+	// Runs task(index, worker) for every index below count and returns when all have finished.
+	void Run(size_t count, const function<void(size_t, unsigned)>& task) {
+		unique_lock<mutex> lock(guard);
+		size_t workerCount = queues.size();
+		current = &task;
 
-			static bool IsWalkable(GridPosition pos, const vector<char>& levelData,
-				const map<GridPosition, char>& entityMap, GridPosition playerPos) {
+		for (size_t worker = 0; worker < workerCount; ++worker) {
+			lock_guard<mutex> queueLock(queues[worker].lock);
+			for (size_t index = count * worker / workerCount; index < count * (worker + 1) / workerCount; ++index)
+				queues[worker].tasks.push_back(index);
+		}
+		busy = workerCount - 1;
+		++generation;
+		lock.unlock();
+		wake.notify_all();
+		Drain(0);
+		lock.lock();
+		done.wait(lock, [&]() { return busy == 0; });
+		current = nullptr;
+	}
 
-				if (pos.x < 0 || pos.x >= GameFieldWidth || pos.y < 0 || pos.y >= GameFieldHeight) {
-					return false;
-				}
-				if (levelData[pos.y * GameFieldWidth + pos.x] != TileGround) {
-					return false;
-				}
-				if (entityMap.count(pos) && pos != playerPos) {
-					return false;
-				}
-				return true;
-			}
+private:
+	struct Queue {
+		mutex lock;
+		deque<size_t> tasks;
+	};
 
-			static bool HasLineOfSight(GridPosition from, GridPosition to,
-				const vector<char>& levelData) {
-				int x0 = from.x, y0 = from.y;
-				int x1 = to.x, y1 = to.y;
-				int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-				int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
-				int err = dx + dy;
+	deque<Queue> queues;
+	vector<thread> workers;
+	mutex guard;
+	condition_variable wake, done;
+	const function<void(size_t, unsigned)>* current = nullptr;
+	size_t busy = 0, generation = 0;
+	bool stopping = false;
+	atomic<size_t> steals{ 0 };
 
-				while (true) {
-					if (levelData[y0 * GameFieldWidth + x0] != TileGround && !(x0 == from.x && y0 == from.y)) {
-						return false;
-					}
-					if (x0 == x1 && y0 == y1) {
-						break;
-					}
-					int e2 = 2 * err;
+	void Work(unsigned worker) {
+		size_t seen = 0;
+		unique_lock<mutex> lock(guard);
 
-					if (e2 >= dy) {
-						err += dy;
-						x0 += sx;
-					}
-					if (e2 <= dx) {
-						err += dx;
-						y0 += sy;
-					}
-				}
-				return true;
+		while (true) {
+			wake.wait(lock, [&]() { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+			lock.unlock();
+			Drain(worker);
+			lock.lock();
+			if (--busy == 0)
+				done.notify_all();
+		}
+	}
+
+	void Drain(unsigned worker) {
+		size_t index;
+
+		while (true) {
+			if (Take(queues[worker], false, index)) {
+				(*current)(index, worker);
+				continue;
 			}
+			bool stolen = false;
+			for (size_t offset = 1; offset < queues.size() && !stolen; ++offset) {
+				stolen = Take(queues[(worker + offset) % queues.size()], true, index);
+			}
+			if (!stolen)
+				return;
+			++steals;
+			(*current)(index, worker);
+		}
+	}
 
-			static vector<GridPosition> AStarPath(GridPosition start, GridPosition goal,
-				const vector<char>& levelData,
-				const map<GridPosition, char>& entityMap) {
-				priority_queue<Node, vector<Node>, greater<Node>> open;
-				unordered_map<int, GridPosition> cameFrom;
-				unordered_map<int, int> gScore;
-				auto key = [](GridPosition p) { return p.y * GameFieldWidth + p.x; };
-				open.push({ start, 0, ManhattanDistance(start, goal) });
-				gScore[key(start)] = 0;
-				vector<GridPosition> dirs = { {0,1}, {0,-1}, {1,0}, {-1,0} };
+	static bool Take(Queue& queue, bool front, size_t& index) {
+		lock_guard<mutex> lock(queue.lock);
+		if (queue.tasks.empty())
+			return false;
+		index = front ? queue.tasks.front() : queue.tasks.back();
+		if (front)
+			queue.tasks.pop_front();
+		else
+			queue.tasks.pop_back();
+		return true;
+	}
+};
 
-				while (!open.empty()) {
-					Node current = open.top(); open.pop();
+// Runs the game loop on virtual time with a fixed seed, as fast as the CPU allows, and reports
+// how many frames and entity turns were simulated per second.
+class Simulation {
+public:
+	static void RunHeadless(const Game::Options& options, long maxFrames, const string& script, const string& loadPath,
+		const string& savePath, const string& recordPath) {
+		using namespace std::chrono;
+		HeadlessTerminal terminal;
+		RecordingTerminal recorder(terminal);
+		terminal.script = script;
+		terminal.botRandom.seed(options.seed);
+		auto start = steady_clock::now();
+
+		Game game(recordPath.empty() ? (TerminalBackend&)terminal : recorder, options);
+		terminal.game = &game;
+		bool loaded = loadPath.empty() || Game::Snapshot::Load(game, loadPath);
+		game.savePath = savePath;
+		const long framesPerTurn = Game::EntityTickMs / 20;
+		long frames = 0, turns = 0;
+
+		if (!recordPath.empty()) {
+			StartRecording(recorder.recording, options, loaded && !loadPath.empty() ? &game : nullptr);
+			game.recorder = &recorder;
+		}
+		while (!game.quitRequested && frames < maxFrames) {
+			terminal.NextFrame();
+			recorder.SetClock(frames * Game::EntityTickMs / framesPerTurn);
+			bool entityTickDue = frames % framesPerTurn == framesPerTurn - 1;
+			game.Frame(game, entityTickDue);
+			++frames;
+
+			if (entityTickDue) {
+				++turns;
+			}
+			if (!game.quitRequested && !game.encounters.ScreenOpen() && game.EntityMapFinishedWave()) {
+				game.GenerateNewLevel();
+			}
+		}
+		double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+		game.recorder = nullptr;
 
-					if (current.pos == goal) {
-						vector<GridPosition> path;
+		if (!recordPath.empty() && !recorder.recording.Save(recordPath)) {
+			cout << "could not write " << recordPath << "\n";
+		}
+		const char* outcome = game.bossDefeated ? "won" : game.player.hp <= 0 ? "defeated"
+			: game.quitRequested ? "quit" : "frame limit";
+		if (!loaded) {
+			cout << "could not load " << loadPath << "\n";
+		}
+		cout << "seed: " << options.seed << "\n";
+		cout << "outcome: " << outcome << " at wave " << game.waveManager.currentWave << "\n";
+		cout << "player: " << Game::PlayerStatusStatic(game.player) << "\n";
+		cout << "world: " << game.LevelData.Width() << "x" << game.LevelData.Height() << "  chunks: "
+			<< game.LevelData.AllocatedChunks() << "/" << game.LevelData.ChunksX() * game.LevelData.ChunksY()
+			<< "  memory: " << (game.LevelData.MemoryBytes() + game.EntityMap.MemoryBytes()) / 1024 << " KiB\n";
+		cout << "levels: " << game.levelQueue.Popped() << " taken from the queue, " << game.levelQueue.Stalls()
+			<< " had to be waited for\n";
+		cout << "frames: " << frames << "  turns: " << turns << "  encounters: "
+			<< game.encounters.encounterCount << "\n";
+		cout << "wall time: " << seconds * 1000.0 << " ms\n";
+		cout << "turns/s: " << turns / seconds << "  frames/s: " << frames / seconds << "\n";
+		game.frameTime.Print(cout, "frame time");
+		if (game.saveTime.Count() > 0) {
+			game.saveTime.Print(cout, "autosave");
+		}
+		if (game.profiler.enabled) {
+			game.profiler.Print(cout);
+		}
+		game.WriteReports();
+	}
 
-						for (GridPosition p = goal; p != start; p = cameFrom[key(p)]) {
-							path.push_back(p);
-						}
-						reverse(path.begin(), path.end());
-						return path;
-					}
-					for (auto d : dirs) {
-						GridPosition next = { current.pos.x + d.x, current.pos.y + d.y };
+	// Fills in what a replay needs to start where the recorded run started: the seed, the world
+	// and AI settings, and the run it was resumed from if game has just been loaded.
+	static void StartRecording(InputRecording& recording, const Game::Options& options, const Game* loadedGame) {
+		recording.seed = options.seed;
+		recording.worldWidth = options.worldWidth;
+		recording.worldHeight = options.worldHeight;
+		recording.everyEnemyPursues = options.everyEnemyPursues;
+		recording.pursuers = options.pursuers;
+		recording.liveMenus = options.liveMenus;
+		recording.content = options.content ? options.content->Source() : string();
+
+		if (loadedGame) {
+			recording.snapshot = Game::Snapshot::Encode(*loadedGame);
+		}
+	}
 
-						if (!IsWalkable(next, levelData, entityMap, goal) && next != goal) {
-							continue;
-						}
-						int tentative = gScore[key(current.pos)] + 1;
+	// Re-runs a recorded session through Game::Frame with the recorded keys. Fast-forward skips
+	// drawing and waiting and reports how much faster than the original the session replayed.
+	// Otherwise it plays on the terminal at the recorded pace.
+	static bool Replay(const string& path, bool fastForward, Game::Options options) {
+		using namespace std::chrono;
+		InputRecording recording;
 
-						if (!gScore.count(key(next)) || tentative < gScore[key(next)]) {
-							cameFrom[key(next)] = current.pos;
-							gScore[key(next)] = tentative;
-							open.push({ next, tentative, tentative + ManhattanDistance(next, goal) });
-						}
-					}
-				}
-				return {};
+		if (!recording.Load(path)) {
+			cerr << "could not read recording " << path << "\n";
+			return false;
+		}
+		options.seed = recording.seed;
+		options.worldWidth = recording.worldWidth;
+		options.worldHeight = recording.worldHeight;
+		options.everyEnemyPursues = recording.everyEnemyPursues;
+		options.pursuers = recording.pursuers;
+		options.liveMenus = recording.liveMenus;
+		ContentTable content;
+		string error;
+
+		if (!recording.content.empty()) {
+			if (!ContentTable::Compile(recording.content, content, error)) {
+				cerr << "recording " << path << " content: " << error << "\n";
+				return false;
 			}
+			options.content = &content;
+		}
+		else {
+			options.content = nullptr;
+		}
 
-			static GridPosition GetNextAIMove(vector<char>& levelData, map<GridPosition, char>& entityMap,
-				GridPosition playerPos) {
-				stepCounter++;
+		if (!fastForward) {
+			Engine::Console().Setup(GameFieldWidth, GameFieldHeight, 2);
+		}
+		ReplayTerminal terminal(recording, fastForward ? nullptr : &Engine::Console(), !fastForward);
+		auto start = steady_clock::now();
+		Game game(terminal, options);
+		bool restored = recording.snapshot.empty()
+			|| Game::Snapshot::Restore(game, recording.snapshot.data(), recording.snapshot.size());
+		bool entityTickDue = false, checked = false, inStep = false;
+
+		while (restored && !game.quitRequested && terminal.NextFrame(entityTickDue)) {
+			if (terminal.FramesStarted() == recording.frames) {
+				checked = true;
+				inStep = game.StateDigest() == recording.lastFrameDigest;
+			}
+			game.Frame(game, entityTickDue);
 
-				if (!hasTarget || stepCounter >= reevalInterval || !entityMap.count(currentTarget)) {
-					hasTarget = false;
-					stepCounter = 0;
-					vector<pair<int, GridPosition>> visibleEnemies;
-					vector<pair<int, GridPosition>> hiddenEnemies;
+			if (!game.quitRequested && !game.encounters.ScreenOpen() && game.EntityMapFinishedWave()) {
+				game.GenerateNewLevel();
+			}
+		}
+		double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+		double recordedSeconds = terminal.RecordedMs() / 1000.0;
 
-					for (auto& kv : entityMap) {
-						char t = kv.second;
+		if (!fastForward) {
+			Engine::Console().Clear();
+		}
+		if (!restored) {
+			cout << "the recording's saved run could not be restored\n";
+			return false;
+		}
+		cout << "seed: " << recording.seed << "  world: " << recording.worldWidth << "x" << recording.worldHeight << "\n";
+		cout << "replayed: " << terminal.FramesStarted() << "/" << recording.frames << " frames, wave "
+			<< game.waveManager.currentWave << "\n";
+		cout << "player: " << Game::PlayerStatusStatic(game.player) << "\n";
+		cout << "state: " << (terminal.KeysLeftOver() ? "DIVERGED: the recording has keys the game did not read"
+			: !checked ? "the recording ended early" : inStep ? "matches the recording" : "DIVERGED from the recording") << "\n";
+		game.WriteReports();
+		cout << "recorded time: " << recordedSeconds << " s  replay time: " << seconds << " s  speed: "
+			<< (seconds > 0 ? recordedSeconds / seconds : 0) << "x real time\n";
+		cout << "frames/s: " << terminal.FramesStarted() / max(seconds, 1e-9) << "\n";
+		return checked && inStep && !terminal.KeysLeftOver();
+	}
 
-						if (t != TileEnemy && t != TileMiniBoss && t != TileBoss) {
-							continue;
-						}
-						int dist = ManhattanDistance(kv.first, playerPos);
+	enum class UpgradePolicy { Balanced, Attack, Defense, Health, Hoard };
 
-						if (HasLineOfSight(kv.first, playerPos, levelData)) {
-							visibleEnemies.push_back({ dist, kv.first });
-						}
-						else {
-							hiddenEnemies.push_back({ dist, kv.first });
-						}
-					}
-					GridPosition chosen{ -1, -1 };
+	static bool ParsePolicy(const string& name, UpgradePolicy& policy) {
+		static const map<string, UpgradePolicy> names = {
+			{ "balanced", UpgradePolicy::Balanced }, { "attack", UpgradePolicy::Attack },
+			{ "defense", UpgradePolicy::Defense }, { "health", UpgradePolicy::Health },
+			{ "none", UpgradePolicy::Hoard },
+		};
+		auto found = names.find(name);
+		if (found == names.end())
+			return false;
+		policy = found->second;
+		return true;
+	}
 
-					if (!visibleEnemies.empty()) {
-						sort(visibleEnemies.begin(), visibleEnemies.end(), [](auto& a, auto& b) { return a.first < b.first; });
-						chosen = visibleEnemies.front().second;
+	// Plays whole runs of 100 waves with nothing but the combat and shop rules: every wave's
+	// enemies and merchant are met in random order, the player fights with Combat::AutoResolve and
+	// spends gold at the merchant according to the policy. Run i draws from its own generator
+	// seeded with (seed, i), so the totals do not depend on how many threads share the work.
+	static void RunBalance(const ContentTable& content, unsigned int seed, int runs, unsigned threads, UpgradePolicy policy) {
+		using namespace std::chrono;
+		typedef Game::EntityManager::Combat Combat;
+		vector<char> enemies;
+		size_t kinds[256] = {};
+
+		for (char type : content.Types()) {
+			if (content.Hostile(type)) {
+				kinds[(unsigned char)type] = enemies.size();
+				enemies.push_back(type);
+			}
+		}
+		const int waves = 100, checkpointEvery = 10, checkpoints = waves / checkpointEvery;
+
+		vector<BalanceTally> tallies(threads, BalanceTally(enemies.size(), checkpoints));
+		auto start = steady_clock::now();
+
+		ThreadPool::ParallelFor((size_t)runs, threads, [&](size_t run, unsigned worker) {
+			BalanceTally& tally = tallies[worker];
+			seed_seq runSeed{ seed, (unsigned int)run };
+			mt19937 runRng(runSeed);
+			Player player = Game::StartingPlayer();
+			Game::WaveManager waveManager(content);
+			vector<char> encounters;
+			long goldEarned = 0;
+			bool alive = true, bossDefeated = false;
+
+			while (alive && waveManager.currentWave < waves) {
+				Game::WaveManager::WaveInfo wave = waveManager.GetNextWave();
+				encounters.clear();
+				for (const ContentTable::Spawn& spawn : wave.spawns)
+					encounters.insert(encounters.end(), spawn.count, spawn.type);
+				shuffle(encounters.begin(), encounters.end(), runRng);
+
+				for (char type : encounters) {
+					if (content.RoleOf(type) == ContentTable::Role::Merchant) {
+						SpendGold(player, policy);
+						continue;
 					}
-					else if (!hiddenEnemies.empty()) {
-						sort(hiddenEnemies.begin(), hiddenEnemies.end(), [](auto& a, auto& b) { return a.first < b.first; });
-						chosen = hiddenEnemies.front().second;
+					if (!content.Hostile(type))
+						continue;
+					const ContentTable::Archetype& enemy = content[type];
+					size_t kind = kinds[(unsigned char)type];
+					Combat::Outcome outcome = Combat::AutoResolve(player, enemy);
+					tally.fights[kind]++;
+					tally.rounds[kind] += outcome.rounds;
+					if (outcome.won) {
+						tally.victories[kind]++;
+						goldEarned += outcome.reward;
+						bossDefeated |= enemy.role == ContentTable::Role::Boss;
 					}
-					if (chosen.x != -1) {
-						currentTarget = chosen;
-						hasTarget = true;
-						currentPath = AStarPath(currentTarget, playerPos, levelData, entityMap);
+					else if (!outcome.fled) {
+						alive = false;
+						break;
 					}
 				}
-				if (hasTarget && !currentPath.empty()) {
-					GridPosition nextStep = currentPath.front();
-					currentPath.erase(currentPath.begin());
-					return nextStep;
+				if (alive && waveManager.currentWave % checkpointEvery == 0) {
+					BalanceTally::Checkpoint& point = tally.curve[waveManager.currentWave / checkpointEvery - 1];
+					point.alive++;
+					point.goldEarned += goldEarned;
+					point.gold += player.money;
+					point.attack += player.attack;
+					point.defense += player.defense;
+					point.maxHp += player.maxHp;
 				}
-				return { -1, -1 };
 			}
-		};
-
-		static vector<GridPosition> GetWalkableTiles(const vector<char>& levelData) {
-			vector<GridPosition> walkable;
-
-			for (int y = 0; y < GameFieldHeight; ++y) {
-				for (int x = 0; x < GameFieldWidth; ++x) {
-					if (levelData[y * GameFieldWidth + x] == TileGround) {
-						walkable.push_back({ x, y });
-					}
-				}
+			tally.wins += bossDefeated;
+			if (!alive) {
+				tally.deaths++;
+				tally.deathWaveSum += waveManager.currentWave;
 			}
-			return walkable;
+			});
+
+		double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+		BalanceTally total(enemies.size(), checkpoints);
+		for (const BalanceTally& tally : tallies)
+			total.Add(tally);
+
+		long fights = 0;
+		for (long count : total.fights)
+			fights += count;
+		cout << fixed << setprecision(1);
+		cout << "runs: " << runs << "  threads: " << threads << "  seed: " << seed << "\n";
+		cout << "wall time: " << seconds * 1000.0 << " ms  fights/s: " << fights / seconds << "\n";
+		cout << "win rate: " << 100.0 * total.wins / runs << "%  deaths: " << total.deaths;
+		if (total.deaths > 0)
+			cout << "  mean death wave: " << (double)total.deathWaveSum / total.deaths;
+		cout << "\n\n";
+
+		cout << "enemy         fights     won%  rounds/fight\n";
+		for (size_t kind = 0; kind < enemies.size(); ++kind) {
+			long count = total.fights[kind];
+			cout << left << setw(10) << content[enemies[kind]].name << right << setw(10) << count
+				<< setw(9) << (count ? 100.0 * total.victories[kind] / count : 0.0)
+				<< setw(14) << (count ? (double)total.rounds[kind] / count : 0.0) << "\n";
+		}
+
+		cout << "\nwave   alive%    earned      gold     atk     def    maxHp\n";
+		for (int i = 0; i < checkpoints; ++i) {
+			const BalanceTally::Checkpoint& point = total.curve[i];
+			double alive = (double)max(1L, point.alive);
+			cout << setw(4) << (i + 1) * checkpointEvery << setw(9) << 100.0 * point.alive / runs
+				<< setw(10) << point.goldEarned / alive << setw(10) << point.gold / alive
+				<< setw(8) << point.attack / alive << setw(8) << point.defense / alive
+				<< setw(9) << point.maxHp / alive << "\n";
 		}
+	}
 
-		static void PlaceEntitiesRandomly(vector<char>& levelData, map<GridPosition, char>& entityMap,
-			char entityChar, int count) {
-			auto walkable = GetWalkableTiles(levelData);
-			shuffle(walkable.begin(), walkable.end(), rng);
-			int placed = 0;
+private:
+	struct BalanceTally {
+		struct Checkpoint {
+			long alive = 0, goldEarned = 0, gold = 0, attack = 0, defense = 0, maxHp = 0;
+		};
+		long wins = 0, deaths = 0, deathWaveSum = 0;
+		vector<long> fights, victories, rounds;
+		vector<Checkpoint> curve;
 
-			for (auto& pos : walkable) {
-				if (entityMap.count(pos)) {
-					continue;
-				}
-				entityMap[pos] = entityChar;
+		BalanceTally(size_t kinds, int checkpoints)
+			: fights(kinds), victories(kinds), rounds(kinds), curve(checkpoints) {
+		}
 
-				if (++placed >= count) {
-					break;
-				}
+		void Add(const BalanceTally& other) {
+			wins += other.wins;
+			deaths += other.deaths;
+			deathWaveSum += other.deathWaveSum;
+			for (size_t kind = 0; kind < fights.size(); ++kind) {
+				fights[kind] += other.fights[kind];
+				victories[kind] += other.victories[kind];
+				rounds[kind] += other.rounds[kind];
+			}
+			for (size_t i = 0; i < curve.size(); ++i) {
+				curve[i].alive += other.curve[i].alive;
+				curve[i].goldEarned += other.curve[i].goldEarned;
+				curve[i].gold += other.curve[i].gold;
+				curve[i].attack += other.curve[i].attack;
+				curve[i].defense += other.curve[i].defense;
+				curve[i].maxHp += other.curve[i].maxHp;
 			}
 		}
+	};
 
-		static void UpdateEntities(Game& game, vector<char>& levelData, map<GridPosition, char>& entityMap,
-			GridPosition playerPos) {
-			vector<GridPosition> positions;
+	// Heals first unless the policy hoards, then buys upgrades until the gold runs out. The
+	// balanced policy keeps the three upgrades level by buying the one taken least so far.
+	static void SpendGold(Player& player, UpgradePolicy policy) {
+		typedef Game::EntityManager::Shop Shop;
+		if (policy == UpgradePolicy::Hoard)
+			return;
+		if (player.hp < player.maxHp && Shop::CanAfford(player, Shop::HealFull))
+			Shop::Buy(player, Shop::HealFull);
 
-			for (auto& kv : entityMap) {
-				if (kv.second != TilePlayer) {
-					positions.push_back(kv.first);
-				}
+		const Player start = Game::StartingPlayer();
+		while (true) {
+			Shop::Item item;
+			switch (policy) {
+			case UpgradePolicy::Attack: item = Shop::UpgradeAttack; break;
+			case UpgradePolicy::Defense: item = Shop::UpgradeDefense; break;
+			case UpgradePolicy::Health: item = Shop::UpgradeMaxHp; break;
+			default: {
+				int attackBought = (player.attack - start.attack) / 2;
+				int defenseBought = (player.defense - start.defense) / 2;
+				int maxHpBought = (player.maxHp - start.maxHp) / 10;
+				item = attackBought <= defenseBought && attackBought <= maxHpBought ? Shop::UpgradeAttack
+					: defenseBought <= maxHpBought ? Shop::UpgradeDefense : Shop::UpgradeMaxHp;
+				break;
 			}
-			GridPosition aiMove = AIController::GetNextAIMove(levelData, entityMap, playerPos);
+			}
+			if (!Shop::CanAfford(player, item))
+				return;
+			Shop::Buy(player, item);
+		}
+	}
+};
 
-			for (auto& pos : positions) {
-				if (!entityMap.count(pos)) {
-					continue;
-				}
-				char type = entityMap[pos];
-				GridPosition newPos = pos;
+// Many independent runs of the game stepped in lockstep, as a server hosting them would: each
+// tick advances every session by one 20 ms frame on a WorkStealingPool. Sessions play with the
+// HeadlessTerminal bot until a client feeds them keys, and a run that ends starts over with the
+// next seed. Session i starts from seed + i, so the state of every session after a number of
+// ticks does not depend on the thread count.
+class SessionHost {
+public:
+	static const long FramesPerTurn = Game::EntityTickMs / 20;
+
+	struct Session {
+		HeadlessTerminal terminal;
+		unique_ptr<Game> game;
+		long frames = 0;
+		int runs = 0;
+		bool watched = false;
+		bool clientDriven = false;
+	};
 
-				if (AIController::hasTarget && pos == AIController::currentTarget && aiMove.x != -1) {
-					newPos = aiMove;
-				}
-				else {
-					vector<Direction> dirs = { Direction::Up, Direction::Down, Direction::Left, Direction::Right };
-					shuffle(dirs.begin(), dirs.end(), rng);
+	SessionHost(const Game::Options& options, size_t count, unsigned threads)
+		: options(options), seed(options.seed), pool(threads), sessions(count), workerStats(pool.Threads()) {
+		pool.Run(count, [&](size_t index, unsigned) { Start(index, 0); });
+	}
 
-					for (auto dir : dirs) {
-						newPos = pos;
+	size_t Size() const { return sessions.size(); }
+	long Ticks() const { return ticks; }
+	const Engine::Histogram& TickLatency() const { return tickLatency; }
+	Session& At(size_t index) { return *sessions[index]; }
 
-						switch (dir) {
-						case Direction::Up: {
-							newPos.y--; break;
-						}
-						case Direction::Down: {
-							newPos.y++; break;
-						}
-						case Direction::Left: {
-							newPos.x--; break;
-						}
-						case Direction::Right: {
-							newPos.x++; break;
-						}
-						default: {
-							break;
-						}
-						}
+	// Steps the sessions as fast as they go and reports the cost of a tick.
+	static void RunBenchmark(const Game::Options& options, size_t count, long ticks, unsigned threads) {
+		using namespace std::chrono;
+		auto start = steady_clock::now();
+		SessionHost host(options, count, threads);
+		double startSeconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
 
-						if (newPos.x < 0 || newPos.x >= GameFieldWidth || newPos.y < 0 || newPos.y >= GameFieldHeight) {
-							continue;
-						}
-						if (levelData[newPos.y * GameFieldWidth + newPos.x] != TileGround) {
-							continue;
-						}
-						if (entityMap.count(newPos) && entityMap[newPos] != TilePlayer) {
-							continue;
-						}
-						if (newPos == playerPos) {
-							break;
-						}
-						if (!entityMap.count(newPos)) {
-							break;
-						}
-					}
-				}
+		start = steady_clock::now();
+		for (long tick = 0; tick < ticks; ++tick) {
+			host.Tick();
+		}
+		double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+		cout << "started " << count << " sessions in " << startSeconds * 1000.0 << " ms\n";
+		host.Report(cout, seconds);
+	}
 
-				if (newPos == playerPos) {
-					if (type == TileEnemy || type == TileMiniBoss || type == TileBoss) {
-						entityMap.erase(pos);
-						EntityManager::Encounters::HandleEncounter(game, type);
-						Engine::LevelRenderer::DrawChangedRows(levelData, entityMap, pos.y, newPos.y);
+	// Serves the sessions over a line protocol on stdin and stdout, one tick every 20 ms, for a
+	// front end that owns the client connections. Commands, one per line:
+	//   keys <id> <keys>   queue keys for a session; it stops playing by itself
+	//   watch <id>         send the session's frames; unwatch <id> stops them
+	//   stats              answer with one "stats ..." line
+	//   quit               stop, as does the end of the input
+	// A watched session's frame is sent as "frame <id> <tick> <size>" and a newline, followed by
+	// size bytes of VT output. The report goes to stderr at the end.
+	static void Serve(const Game::Options& options, size_t count, unsigned threads) {
+		using namespace std::chrono;
+		struct Inbox {
+			mutex lock;
+			deque<string> lines;
+			bool closed = false;
+		};
+		// Shared with the reader, which may still be blocked on stdin when Serve returns.
+		shared_ptr<Inbox> inbox = make_shared<Inbox>();
+		thread([inbox]() {
+			string line;
+			while (getline(cin, line)) {
+				lock_guard<mutex> lock(inbox->lock);
+				inbox->lines.push_back(line);
+			}
+			lock_guard<mutex> lock(inbox->lock);
+			inbox->closed = true;
+			}).detach();
+
+		SessionHost host(options, count, threads);
+		vector<size_t> watched;
+		deque<string> lines;
+		bool running = true;
+		auto start = steady_clock::now(), next = start;
+
+		while (running) {
+			{
+				lock_guard<mutex> lock(inbox->lock);
+				lines.swap(inbox->lines);
+				running = !inbox->closed;
+			}
+			for (const string& line : lines) {
+				istringstream in(line);
+				string command, keys;
+				size_t id = 0;
+				in >> command;
+
+				if (command == "quit") {
+					running = false;
+				}
+				else if (command == "stats") {
+					const Engine::Histogram& latency = host.TickLatency();
+					cout << "stats ticks " << host.Ticks() << " sessions " << host.Size() << " tick_p50_us "
+						<< latency.Percentile(0.5) << " tick_p99_us " << latency.Percentile(0.99) << "\n";
+				}
+				else if ((command == "keys" || command == "watch" || command == "unwatch") && in >> id && id < host.Size()) {
+					if (command == "keys") {
+						in.get();
+						getline(in, keys);
+						host.Feed(id, keys);
 						continue;
 					}
-					else {
-						continue;
+					auto found = find(watched.begin(), watched.end(), id);
+					if (found != watched.end()) {
+						watched.erase(found);
 					}
+					if (command == "watch") {
+						watched.push_back(id);
+					}
+					host.Watch(id, command == "watch");
+				}
+				else {
+					cout << "error " << line << "\n";
 				}
+			}
+			lines.clear();
+			host.Tick();
 
-				if (newPos != pos) {
-					if (entityMap.count(newPos) && entityMap[newPos] != TilePlayer) {
-						continue;
-					}
-					entityMap.erase(pos);
-					entityMap[newPos] = type;
-					Engine::LevelRenderer::DrawChangedRows(levelData, entityMap, pos.y, newPos.y);
+			for (size_t id : watched) {
+				string& output = host.At(id).terminal.output;
+
+				if (!output.empty()) {
+					cout << "frame " << id << " " << host.Ticks() << " " << output.size() << "\n";
+					cout.write(output.data(), output.size());
+					output.clear();
 				}
 			}
-		}
-	};
+			cout.flush();
+			next += milliseconds(20);
+			auto now = steady_clock::now();
 
-	static bool CanMove(const GridPosition& pos, const vector<char>& levelData) {
-		if (pos.x < 0 || pos.x >= GameFieldWidth || pos.y < 0 || pos.y >= GameFieldHeight) {
-			return false;
+			if (next < now) {
+				next = now;
+			}
+			this_thread::sleep_until(next);
 		}
-		return levelData[pos.y * GameFieldWidth + pos.x] == TileGround;
+		host.Report(cerr, duration_cast<duration<double>>(steady_clock::now() - start).count());
 	}
 
-	static Direction GetMoveDirection() {
-		if (InputManager::up) {
-			return Direction::Up;
-		}
-		else if (InputManager::down) {
-			return Direction::Down;
+	void Tick() {
+		using namespace std::chrono;
+		auto start = steady_clock::now();
+
+		pool.Run(sessions.size(), [&](size_t index, unsigned worker) {
+			auto stepStart = steady_clock::now();
+			Step(index);
+			long long ns = duration_cast<nanoseconds>(steady_clock::now() - stepStart).count();
+			workerStats[worker].step.Record(ns / 1000);
+			workerStats[worker].busyNs += ns;
+			});
+		tickLatency.Record(duration_cast<microseconds>(steady_clock::now() - start).count());
+		++ticks;
+	}
+
+	// Starts sending a session's frames as VT output: the next frame redraws the whole screen.
+	void Watch(size_t index, bool watch) {
+		Session& session = *sessions[index];
+		session.watched = session.terminal.capture = watch;
+		session.terminal.output.clear();
+
+		if (watch) {
+			session.game->ClearConsole();
 		}
-		else if (InputManager::left) {
-			return Direction::Left;
+	}
+
+	// Queues keys for a session; from now on its map moves come only from the client.
+	void Feed(size_t index, const string& keys) {
+		Session& session = *sessions[index];
+		session.clientDriven = true;
+		session.terminal.Feed(keys);
+	}
+
+	uint64_t Digest() const {
+		uint64_t digest = 14695981039346656037ull;
+		for (const unique_ptr<Session>& session : sessions) {
+			digest = (digest ^ session->game->StateDigest()) * 1099511628211ull;
 		}
-		else if (InputManager::right) {
-			return Direction::Right;
+		return digest;
+	}
+
+	void Report(ostream& out, double seconds) const {
+		Engine::Histogram step;
+		long long busyNs = 0;
+		long restarts = 0;
+
+		for (const WorkerStats& stats : workerStats) {
+			step.Add(stats.step);
+			busyNs += stats.busyNs;
 		}
-		else {
-			return Direction::None;
+		for (const unique_ptr<Session>& session : sessions) {
+			restarts += session->runs;
 		}
+		double steps = (double)step.Count();
+		out << "sessions: " << sessions.size() << "  threads: " << pool.Threads() << "  ticks: " << ticks
+			<< "  seed: " << seed << "\n";
+		out << "wall time: " << seconds * 1000.0 << " ms  session frames/s: " << steps / max(seconds, 1e-9) << "\n";
+		tickLatency.Print(out, "tick latency");
+		step.Print(out, "session frame");
+		out << "sessions per core at 50 frames/s: " << (busyNs ? steps / (busyNs / 1e9) / 50.0 : 0.0)
+			<< "  steals: " << pool.Steals() << "  restarts: " << restarts << "\n";
+		out << "state digest: " << Digest() << "\n";
 	}
 
-	void MovePlayer(Direction dir) {
-		GridPosition newPos = playerPos;
+private:
+	struct alignas(64) WorkerStats {
+		Engine::Histogram step;
+		long long busyNs = 0;
+	};
 
-		switch (dir) {
-		case Direction::Up: {
-			newPos.y--;
-			break;
+	// What every session starts from; each gets its own seed.
+	const Game::Options options;
+	const unsigned int seed;
+	WorkStealingPool pool;
+	vector<unique_ptr<Session>> sessions;
+	vector<WorkerStats> workerStats;
+	Engine::Histogram tickLatency;
+	long ticks = 0;
+
+	// Run runs of session index plays seed + index + runs * sessions.
+	void Start(size_t index, int runs) {
+		unique_ptr<Session> session(new Session());
+		Game::Options options = this->options;
+		options.seed = seed + (unsigned int)(index + (size_t)runs * sessions.size());
+		options.levelThread = false;
+		options.frameStatsPath.clear();
+		options.tracePath.clear();
+		session->runs = runs;
+
+		if (sessions[index]) {
+			session->watched = session->terminal.capture = sessions[index]->watched;
+			session->clientDriven = sessions[index]->clientDriven;
+			session->terminal.output = move(sessions[index]->terminal.output);
+			if (session->clientDriven) {
+				session->terminal.Feed("");
+			}
 		}
-		case Direction::Down: {
-			newPos.y++;
-			break;
+		session->terminal.botRandom.seed(options.seed);
+		session->game.reset(new Game(session->terminal, options));
+		session->terminal.game = session->game.get();
+		sessions[index] = move(session);
+	}
+
+	void Step(size_t index) {
+		Session& session = *sessions[index];
+		Game& game = *session.game;
+		session.terminal.NextFrame();
+		game.Frame(game, session.frames % FramesPerTurn == FramesPerTurn - 1);
+		++session.frames;
+
+		if (game.quitRequested) {
+			Start(index, session.runs + 1);
 		}
-		case Direction::Left: {
-			newPos.x--;
-			break;
+		else if (!game.encounters.ScreenOpen() && game.EntityMapFinishedWave()) {
+			game.GenerateNewLevel();
 		}
-		case Direction::Right: {
-			newPos.x++;
-			break;
+	}
+};
+
+class Benchmark {
+public:
+	typedef Game::EntityManager::AIController AI;
+
+	static Game::Options SeededOptions(unsigned int seed) {
+		Game::Options options;
+		options.seed = seed;
+		return options;
+	}
+
+	// Per-tick cost of moving every entity once, comparing the std::map bookkeeping the game
+	// used before the occupancy grid with Game::EntityManager::MoveEntities. The old path
+	// composes the rows it changes and MoveEntities the cells; the player is walled in so no
+	// encounter starts.
+	static void EntityTick(unsigned int seed) {
+		using namespace std::chrono;
+		HeadlessTerminal terminal;
+		Game game(terminal, SeededOptions(seed));
+		const int entityCounts[] = { 10, 100, 1000 };
+
+		for (int entityCount : entityCounts) {
+			LevelMap level;
+			level.Load(Engine::LevelGenerator::GenerateLevel(GameFieldWidth, GameFieldHeight, game.rng));
+			level.Set({ 2, 1 }, TileWall);
+			level.Set({ 1, 2 }, TileWall);
+			GridPosition playerPos{ 1, 1 };
+			EntityGrid grid;
+			grid.Set(playerPos, TilePlayer);
+			Game::EntityManager::PlaceEntitiesRandomly(level, grid, game.content, TileEnemy, entityCount, game.rng);
+			map<GridPosition, char> legacyMap;
+
+			grid.ForEach([&](EntityGrid::EntityId id) { legacyMap[grid.Position(id)] = grid.Type(id); });
+			int ticks = max(20, 20000 / entityCount);
+			game.ai.Reset();
+			game.renderer.DrawInitialMap(level, grid);
+
+			auto start = steady_clock::now();
+			for (int tick = 0; tick < ticks; ++tick) {
+				LegacyUpdateEntities(game, level, legacyMap, playerPos);
+			}
+			double legacyUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0 / ticks;
+
+			start = steady_clock::now();
+			for (int tick = 0; tick < ticks; ++tick) {
+				Game::EntityManager::MoveEntities(game, level, grid, playerPos);
+				game.compositor.Present();
+			}
+			double gridUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0 / ticks;
+
+			cout << "entities: " << grid.Size() - 1 << "  map: " << legacyUs << " us/tick  grid: "
+				<< gridUs << " us/tick  speedup: " << legacyUs / gridUs << "x\n";
 		}
-		default: {
-			return;
+	}
+
+	// Per-tick cost of 10, 100 and 1000 enemies chasing the player across a 200x100 level, and
+	// how far they got: every enemy stepping down the distance field in id order (--all-pursue)
+	// against as many coordinated pursuers (--pursuers). Half as many merchants wander in their
+	// way. The player stands in the corner the level starts from, so the enemies funnel into the
+	// same few corridors, and a shop screen stays open so nobody starts a fight.
+	static void Pursuit(unsigned int seed) {
+		using namespace std::chrono;
+		typedef Game::EntityManager::AIController AI;
+		HeadlessTerminal terminal;
+		Game game(terminal, SeededOptions(seed));
+		const int width = 200, height = 100, ticks = 300;
+		game.encounters.OpenScreen(Game::EntityManager::Encounters::Screen::Shop);
+
+		for (int count : { 10, 100, 1000 }) {
+			cout << "pursuers: " << count;
+
+			for (bool group : { false, true }) {
+				game.rng.seed(seed);
+				LevelMap level(width, height);
+				EntityGrid grid(width, height);
+				GridPosition playerPos{ 1, 1 };
+				Engine::LevelGenerator::GenerateLevel(level, playerPos, game.rng);
+				grid.Set(playerPos, TilePlayer);
+				Game::EntityManager::PlaceEntitiesRandomly(level, grid, game.content, TileEnemy, count, game.rng);
+				Game::EntityManager::PlaceEntitiesRandomly(level, grid, game.content, TileMerchant, count / 2, game.rng);
+				game.ai.Reset();
+				game.ai.everyEnemyPursues = !group;
+				game.ai.pursuerCount = count;
+				game.renderer.camera = { 0, 0 };
+				game.renderer.DrawInitialMap(level, grid);
+				AI::DistanceField field;
+				field.Update(level, playerPos);
+				auto meanDistance = [&]() {
+					long total = 0;
+					grid.ForEach([&](EntityGrid::EntityId id) { total += grid.Type(id) == TileEnemy ? field.Distance(grid.Position(id)) : 0; });
+					return (double)total / count;
+				};
+				double before = meanDistance();
+
+				auto start = steady_clock::now();
+				for (int tick = 0; tick < ticks; ++tick) {
+					Game::EntityManager::UpdateEntities(game, level, grid, playerPos);
+					game.compositor.Present();
+				}
+				double tickUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0 / ticks;
+
+				cout << (group ? "  coordinated: " : "  all-pursue: ") << tickUs << " us/tick, mean distance "
+					<< before << " -> " << meanDistance();
+			}
+			cout << "\n";
 		}
+	}
+
+	// Queries per second of the std::priority_queue/unordered_map A* the AI used before
+	// PathfindingContext, against the context, on the same random start/goal pairs.
+	static void Pathfinding(int queries, unsigned int seed) {
+		using namespace std::chrono;
+		mt19937 generator(seed);
+		LevelMap level;
+		level.Load(Engine::LevelGenerator::GenerateLevel(GameFieldWidth, GameFieldHeight, generator));
+		EntityGrid entities;
+		Game::EntityManager::PlaceEntitiesRandomly(level, entities, ContentTable::Default(), TileEnemy, 10, generator);
+		vector<GridPosition> walkable = Game::EntityManager::GetWalkableTiles(level);
+		vector<pair<GridPosition, GridPosition>> pairs(queries);
+
+		for (auto& query : pairs) {
+			query.first = walkable[Engine::LevelGenerator::RandomInt(generator, 0, (int)walkable.size() - 1)];
+			query.second = walkable[Engine::LevelGenerator::RandomInt(generator, 0, (int)walkable.size() - 1)];
 		}
+		size_t legacySteps = 0;
+		auto start = steady_clock::now();
 
-		if (!CanMove(newPos, LevelData)) {
-			return;
+		for (auto& query : pairs) {
+			legacySteps += LegacyAStarPath(query.first, query.second, level, entities).size();
 		}
-		auto it = EntityMap.find(newPos);
+		double legacySeconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+		AI::PathfindingContext context;
+		vector<GridPosition> path;
+		size_t steps = 0;
+		start = steady_clock::now();
+
+		for (auto& query : pairs) {
+			context.FindPath(query.first, query.second, level, entities, path);
+			steps += path.size();
+		}
+		double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+		int mismatches = 0;
 
-		if (it != EntityMap.end()) {
+		for (auto& query : pairs) {
+			context.FindPath(query.first, query.second, level, entities, path);
 
-			EntityManager::Encounters::HandleEncounter(*this, it->second);
-			EntityMap.erase(newPos);
+			if (path != LegacyAStarPath(query.first, query.second, level, entities)) {
+				++mismatches;
+			}
 		}
-		EntityMap.erase(playerPos);
-		EntityMap[newPos] = TilePlayer;
-		Engine::LevelRenderer::DrawChangedRows(LevelData, EntityMap, playerPos.y, newPos.y);
-		playerPos = newPos;
+		cout << "queries: " << queries << " seed: " << seed << "\n";
+		cout << "legacy A*: " << queries / legacySeconds << " queries/s (" << legacySteps << " steps)\n";
+		cout << "pathfinding context: " << queries / seconds << " queries/s (" << steps << " steps)\n";
+		cout << "mismatched paths: " << mismatches << "\n";
 	}
 
-	void GenerateNewLevel() {
-		LevelData = Engine::LevelGenerator::GenerateLevel();
-		EntityMap.clear();
-		playerPos = { 1, 1 };
-		EntityMap[playerPos] = TilePlayer;
-
-		WaveManager::WaveInfo wave = waveManager.GetNextWave();
-
-		if (wave.enemies > 0)
-			EntityManager::PlaceEntitiesRandomly(LevelData, EntityMap, TileEnemy, wave.enemies);
+	// Cost of picking the AI's target, at 10, 100 and 1000 enemies with the player on a random
+	// open tile each query: the scan that ran Bresenham line of sight per enemy and sorted both
+	// lists, against rebuilding the field of view and querying the entity index. The index is
+	// checked against a full scan over the same field of view.
+	static void TargetSelection(int queries, unsigned int seed) {
+		using namespace std::chrono;
+		const int enemyCounts[] = { 10, 100, 1000 };
+		AI ai;
+
+		for (int enemyCount : enemyCounts) {
+			mt19937 generator(seed);
+			LevelMap level;
+			level.Load(Engine::LevelGenerator::GenerateLevel(GameFieldWidth, GameFieldHeight, generator));
+			EntityGrid entities;
+			Game::EntityManager::PlaceEntitiesRandomly(level, entities, ContentTable::Default(), TileEnemy, enemyCount, generator);
+			vector<GridPosition> walkable = Game::EntityManager::GetWalkableTiles(level);
+			vector<GridPosition> players(queries);
+
+			for (GridPosition& pos : players) {
+				pos = walkable[Engine::LevelGenerator::RandomInt(generator, 0, (int)walkable.size() - 1)];
+			}
+			auto start = steady_clock::now();
 
-		if (wave.minibosses > 0)
-			EntityManager::PlaceEntitiesRandomly(LevelData, EntityMap, TileMiniBoss, wave.minibosses);
+			for (GridPosition pos : players) {
+				LegacySelectTarget(level, entities, pos);
+			}
+			double legacyUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0 / queries;
 
-		if (wave.bosses > 0)
-			EntityManager::PlaceEntitiesRandomly(LevelData, EntityMap, TileBoss, wave.bosses);
+			start = steady_clock::now();
+			for (GridPosition pos : players) {
+				ai.SelectTarget(level, entities, pos);
+			}
+			double indexUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0 / queries;
 
-		if (wave.merchants > 0)
-			EntityManager::PlaceEntitiesRandomly(LevelData, EntityMap, TileMerchant, wave.merchants);
+			start = steady_clock::now();
+			for (GridPosition pos : players) {
+				ai.playerView.Invalidate();
+				ai.playerView.Update(level, pos);
+			}
+			double viewUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0 / queries;
+			int mismatches = 0;
 
-		Engine::LevelRenderer::DrawInitialMap(LevelData, EntityMap);
-		DrawHUD(PlayerStatus());
+			for (GridPosition pos : players) {
+				if (ai.SelectTarget(level, entities, pos) != ScanSelectTarget(ai, level, entities, pos)) {
+					++mismatches;
+				}
+			}
+			cout << "enemies: " << entities.Size() << "  scan+sort: " << legacyUs << " us/query  index: " << indexUs
+				<< " us/query (field of view " << viewUs << " us)  speedup: " << legacyUs / indexUs << "x  mismatched targets: " << mismatches << "\n";
+		}
 	}
 
-	void Resume() {
-		Engine::LevelRenderer::DrawInitialMap(LevelData, EntityMap);
-		DrawHUD(PlayerStatus());
-		Sleep(200);
-		isPaused = false;
-	}
+	static GridPosition LegacySelectTarget(const LevelMap& levelData, const EntityGrid& entityMap, GridPosition playerPos) {
+		vector<pair<int, GridPosition>> visibleEnemies;
+		vector<pair<int, GridPosition>> hiddenEnemies;
 
-	void Pause() {
-		isPaused = true;
-		Engine::ClearConsole();
-	}
+		entityMap.ForEach([&](EntityGrid::EntityId id) {
+			GridPosition pos = entityMap.Position(id);
 
-	bool EntityMapFinishedWave() const {
-		for (const auto& kv : EntityMap) {
-			char type = kv.second;
-			if (type == TileEnemy || type == TileMiniBoss || type == TileBoss || type == TileMerchant) {
-				return false;
+			if (!ContentTable::Default().Hostile(entityMap.Type(id))) {
+				return;
+			}
+			int dist = AI::ManhattanDistance(pos, playerPos);
+
+			if (AI::HasLineOfSight(pos, playerPos, levelData)) {
+				visibleEnemies.push_back({ dist, pos });
+			}
+			else {
+				hiddenEnemies.push_back({ dist, pos });
 			}
+			});
+		if (!visibleEnemies.empty()) {
+			sort(visibleEnemies.begin(), visibleEnemies.end(), [](auto& a, auto& b) { return a.first < b.first; });
+			return visibleEnemies.front().second;
 		}
-		return true;
+		if (!hiddenEnemies.empty()) {
+			sort(hiddenEnemies.begin(), hiddenEnemies.end(), [](auto& a, auto& b) { return a.first < b.first; });
+			return hiddenEnemies.front().second;
+		}
+		return { -1, -1 };
 	}
 
-	void Run(Game& game) {
-		using namespace std::chrono;
-		auto lastEntityUpdate = steady_clock::now();
-		const int frameTimeMs = 20;
+	// Every enemy against the field of view SelectTarget uses, with the same tie-break.
+	static GridPosition ScanSelectTarget(AI& ai, const LevelMap& levelData, const EntityGrid& entityMap, GridPosition playerPos) {
+		ai.playerView.Update(levelData, playerPos);
+		tuple<bool, int, int, int> best{ true, INT_MAX, 0, 0 };
 
-		while (true) {
-			if (!isPaused) {
-				auto frameStart = steady_clock::now();
-				InputManager::Update();
-				Direction dir = GetMoveDirection();
+		entityMap.ForEach([&](EntityGrid::EntityId id) {
+			GridPosition pos = entityMap.Position(id);
+
+			if (ContentTable::Default().Hostile(entityMap.Type(id))) {
+				best = min(best, make_tuple(!ai.playerView.Visible(pos), AI::ManhattanDistance(pos, playerPos), pos.y, pos.x));
+			}
+			});
+		return get<1>(best) == INT_MAX ? GridPosition{ -1, -1 } : GridPosition{ get<3>(best), get<2>(best) };
+	}
 
-				if (player.hp <= 0) {
-					Pause();
-					GameOverManager::HandleGameOver();
+	static vector<GridPosition> LegacyAStarPath(GridPosition start, GridPosition goal,
+		const LevelMap& levelData,
+		const EntityGrid& entityMap) {
+		priority_queue<AI::Node, vector<AI::Node>, greater<AI::Node>> open;
+		unordered_map<int, GridPosition> cameFrom;
+		unordered_map<int, int> gScore;
+		auto key = [](GridPosition p) { return p.y * GameFieldWidth + p.x; };
+		open.push({ start, 0, AI::ManhattanDistance(start, goal) });
+		gScore[key(start)] = 0;
+		vector<GridPosition> dirs = { {0,1}, {0,-1}, {1,0}, {-1,0} };
+
+		while (!open.empty()) {
+			AI::Node current = open.top(); open.pop();
+
+			if (current.pos == goal) {
+				vector<GridPosition> path;
+
+				for (GridPosition p = goal; p != start; p = cameFrom[key(p)]) {
+					path.push_back(p);
 				}
-				if (dir != Direction::None) {
-					MovePlayer(dir);
+				reverse(path.begin(), path.end());
+				return path;
+			}
+			for (auto d : dirs) {
+				GridPosition next = { current.pos.x + d.x, current.pos.y + d.y };
+
+				if (!AI::IsWalkable(next, levelData, entityMap, goal) && next != goal) {
+					continue;
 				}
+				int tentative = gScore[key(current.pos)] + 1;
 
-				auto now = steady_clock::now();
-				if (duration_cast<milliseconds>(now - lastEntityUpdate).count() >= 300) {
-					EntityManager::UpdateEntities(game, LevelData, EntityMap, playerPos);
-					lastEntityUpdate = now;
+				if (!gScore.count(key(next)) || tentative < gScore[key(next)]) {
+					cameFrom[key(next)] = current.pos;
+					gScore[key(next)] = tentative;
+					open.push({ next, tentative, tentative + AI::ManhattanDistance(next, goal) });
 				}
+			}
+		}
+		return {};
+	}
 
-				EntityManager::Encounters::UpdateHUD(player);
+	static void LegacyUpdateEntities(Game& game, const LevelMap& levelData, map<GridPosition, char>& entityMap, GridPosition playerPos) {
+		vector<GridPosition> positions;
 
-				if (EntityManager::Encounters::showingMessage) {
-					DrawHUD(EntityManager::Encounters::currentMessage);
-				}
-				else {
-					DrawHUD(PlayerStatus());
-				}
+		for (auto& kv : entityMap) {
+			if (kv.second != TilePlayer) {
+				positions.push_back(kv.first);
+			}
+		}
+		for (auto& pos : positions) {
+			if (!entityMap.count(pos)) {
+				continue;
+			}
+			char type = entityMap[pos];
+			GridPosition newPos = pos;
+			vector<GridPosition> steps = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+			shuffle(steps.begin(), steps.end(), game.rng);
+			bool moved = false;
 
-				InputManager::Reset();
-				auto frameEnd = steady_clock::now();
-				int sleepTime = frameTimeMs - duration_cast<milliseconds>(frameEnd - frameStart).count();
-				if (sleepTime > 0) Sleep(sleepTime);
+			for (auto step : steps) {
+				newPos = { pos.x + step.x, pos.y + step.y };
 
-				if (EntityMapFinishedWave()) {
-					GenerateNewLevel();
+				if (!Game::CanMove(newPos, levelData)) {
+					continue;
+				}
+				if (entityMap.count(newPos) && entityMap[newPos] != TilePlayer) {
+					continue;
+				}
+				if (newPos == playerPos || !entityMap.count(newPos)) {
+					moved = true;
+					break;
 				}
 			}
-			else {
-				Sleep(50);
+			if (!moved || newPos == playerPos) {
+				continue;
 			}
+			entityMap.erase(pos);
+			entityMap[newPos] = type;
+			LegacyComposeRow(game.compositor, levelData, entityMap, pos.y);
+			LegacyComposeRow(game.compositor, levelData, entityMap, newPos.y);
 		}
+		game.compositor.Present();
 	}
 
-	class GameOverManager {
-	public:
-		static void ShowGameOver() {
-			HANDLE consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-			std::vector<std::string> logo = {
-				"  _____                        ",
-				" / ____|                       ",
-				"| |  __  __ _ _ __ ___   ___   ",
-				"| | |_ |/ _` | '_ ` _ \\ / _ \\  ",
-				"| |__| | (_| | | | | | |  __/  ",
-				" \\_____|\\__,_|_| |_| |_|\\___|  ",
-				"   / __ \\                       ",
-				"  | |  | |_   _____ _ __         ",
-				"  | |  | \\ \\ / / _ \\ '__|       ",
-				"  | |__| |\\ V /  __/ |           ",
-				"   \\____/  \\_/ \\___|_|           "
-
-			};
+	static void LegacyComposeRow(Engine::FrameCompositor& compositor, const LevelMap& levelData, const map<GridPosition, char>& entityMap, int row) {
+		for (int x = 0; x < (int)GameFieldWidth; ++x) {
+			GridPosition gp{ x, row };
+			char ch = entityMap.count(gp) ? entityMap.at(gp) : levelData.At(gp);
+			compositor.Put(2 + x, row, ch, ContentTable::Default().Color(ch));
+		}
+	}
 
-			int logoHeight = (int)logo.size();
-			int startY = (GameFieldHeight - logoHeight) / 2;
+	// Startup cost of compiling the content table: the built-in file, and a generated one with
+	// archetypes archetypes (as many as there are free glyphs, up to 219) each with its own spawn
+	// rule. Reports the mean and the slowest of rounds compiles against the 1 ms budget.
+	static void ContentCompile(int archetypes, int rounds) {
+		using namespace std::chrono;
+		string generated = "[tile wall]\ncolor = 8\n\n[tile player]\ncolor = 9\n";
+		int defined = 0;
 
-			for (int i = 0; i < logoHeight; i++) {
-				int startX = (GameFieldWidth - (int)logo[i].size()) / 2;
-				COORD p = { (SHORT)startX, (SHORT)(startY + i) };
-				SetConsoleCursorPosition(consoleHandle, p);
-				SetConsoleTextAttribute(consoleHandle, 12);
-				std::cout << logo[i];
+		for (int glyph = 33; glyph < 255 && defined < archetypes; ++glyph) {
+			if (glyph == TileWall || glyph == TilePlayer || glyph == 127) {
+				continue;
 			}
-
-			SetConsoleTextAttribute(consoleHandle, 7);
-			Sleep(1000);
-			COORD pos = { 0, 0 };
-			SetConsoleCursorPosition(consoleHandle, pos);
+			string name = "kind" + to_string(defined);
+			generated += "\n[archetype " + name + "]\nglyph = " + string(1, (char)glyph) + "\ncolor = " + to_string(defined % 16)
+				+ "\nrole = " + (defined % 50 == 49 ? "merchant" : defined % 10 == 9 ? "boss" : "enemy")
+				+ "\nname = Kind " + to_string(defined) + "\nencounter = Encountered kind " + to_string(defined) + "!"
+				+ "\nhp = " + to_string(40 + defined) + "\nattack = " + to_string(7 + defined % 13)
+				+ "\ndefense = " + to_string(2 + defined % 7) + "\nreward = " + to_string(10 + defined) + "\n"
+				+ "\n[spawn " + name + "]\nbase = 1\nper_waves = " + to_string(2 + defined % 5)
+				+ "\nevery = " + to_string(1 + defined % 3) + "\nfirst = " + to_string(1 + defined % 20) + "\n";
+			++defined;
 		}
+		auto time = [&](const string& source, const char* label) {
+			ContentTable table;
+			string error;
+			double totalUs = 0, worstUs = 0;
+
+			for (int round = 0; round < rounds; ++round) {
+				auto start = steady_clock::now();
+				bool compiled = ContentTable::Compile(source, table, error);
+				double us = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0;
+
+				if (!compiled) {
+					cout << label << ": " << error << "\n";
+					return;
+				}
+				totalUs += us;
+				worstUs = max(worstUs, us);
+			}
+			vector<ContentTable::Spawn> spawns;
+			table.WaveSpawns(60, spawns);
+			cout << label << ": " << table.Types().size() << " archetypes, " << table.Schedule().size() << " spawn rules, "
+				<< source.size() << " bytes  compile: " << totalUs / rounds << " us mean, " << worstUs << " us worst"
+				<< (worstUs < 1000.0 ? " (under 1 ms)" : " (over 1 ms)") << "  wave 60 spawns " << spawns.size() << " types\n";
+		};
+		cout << fixed << setprecision(1);
+		time(ContentTable::DefaultSource, "built-in");
+		time(generated, "generated");
+	}
 
-		static void HandleGameOver() {
-			ShowGameOver();
-			exit(0);
+	// Cost of placing a wave of enemies on each of a batch of levels: the scan of every tile into a
+	// fresh list and a full shuffle the game used before the open tile index, against drawing from
+	// the index with the game's spawn rules. The new placements are checked against the rules.
+	static void Placement(int levels, unsigned int seed) {
+		using namespace std::chrono;
+		typedef Game::EntityManager Entities;
+		const int enemies = 20;
+		vector<LevelMap> generated(levels);
+		vector<vector<char>> layouts(levels);
+		mt19937 generator(seed);
+
+		for (int i = 0; i < levels; ++i) {
+			layouts[i] = Engine::LevelGenerator::GenerateLevel(GameFieldWidth, GameFieldHeight, generator);
+			generated[i].Load(layouts[i]);
 		}
-	};
+		size_t openTiles = 0;
+		auto start = steady_clock::now();
+		for (LevelMap& level : generated) {
+			openTiles += level.OpenTiles().tiles.size();
+		}
+		double indexUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0 / levels;
+		EntityGrid grid;
+		GridPosition player{ 1, 1 };
+
+		generator.seed(seed);
+		start = steady_clock::now();
+		for (LevelMap& level : generated) {
+			grid.Clear();
+			grid.Set(player, TilePlayer);
+			LegacyPlaceEntities(level, grid, TileEnemy, enemies, generator);
+		}
+		double legacyUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0 / levels;
+
+		Entities::PlacementRules rules;
+		rules.avoid = player;
+		rules.minDistance = Game::SpawnDistance;
+		rules.spread = true;
+		long violations = 0, placed = 0;
+		double indexedUs = 0;
+		generator.seed(seed);
+
+		for (LevelMap& level : generated) {
+			grid.Clear();
+			grid.Set(player, TilePlayer);
+			start = steady_clock::now();
+			Entities::PlaceEntitiesRandomly(level, grid, ContentTable::Default(), TileEnemy, enemies, generator, rules);
+			indexedUs += (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0;
+			int perRegion[LevelMap::RegionCount] = {};
+
+			grid.ForEach([&](EntityGrid::EntityId id) {
+				GridPosition pos = grid.Position(id);
+				if (grid.Type(id) == TilePlayer) {
+					return;
+				}
+				++placed;
+				++perRegion[level.RegionOf(pos)];
+				violations += !level.IsGround(pos) || abs(pos.x - player.x) + abs(pos.y - player.y) < rules.minDistance;
+				});
+			auto fewest = min_element(perRegion, perRegion + LevelMap::RegionCount);
+			auto most = max_element(perRegion, perRegion + LevelMap::RegionCount);
+			violations += *most - *fewest > 1;
+		}
+		indexedUs /= levels;
+		cout << "levels: " << levels << "  enemies per level: " << enemies << "  seed: " << seed << "\n";
+		cout << "scan+shuffle: " << legacyUs << " us/level  index: " << indexedUs << " us/level  speedup: "
+			<< legacyUs / indexedUs << "x\n";
+		cout << "index build: " << indexUs << " us/level for " << openTiles / levels
+			<< " open tiles, once per level on the level queue thread\n";
+		cout << "placed: " << placed << "  rule violations: " << violations << "\n";
+	}
 
-	class WaveManager {
-	public:
-		int currentWave = 0;
+	static void LegacyPlaceEntities(const LevelMap& levelData, EntityGrid& entityMap, char entityChar, int count, mt19937& generator) {
+		auto walkable = Game::EntityManager::GetWalkableTiles(levelData);
+		shuffle(walkable.begin(), walkable.end(), generator);
+		int placed = 0;
+		EntityGrid::Stats stats = ContentTable::Default()[entityChar].Stats();
 
-		struct WaveInfo {
-			int enemies;
-			int minibosses;
-			int bosses;
-			int merchants;
-		};
+		for (auto& pos : walkable) {
+			if (entityMap.Has(pos)) {
+				continue;
+			}
+			entityMap.Set(pos, entityChar, stats);
 
-		WaveManager() {}
+			if (++placed >= count) {
+				break;
+			}
+		}
+	}
 
-		WaveInfo GetNextWave() {
-			currentWave++;
-			WaveInfo wave{ 0, 0, 0, 1 };
-			wave.enemies = 4 + currentWave / 2;
+	static void LevelGeneration(int levels, unsigned int seed) {
+		using namespace std::chrono;
+		mt19937 generator(seed);
+		uint64_t levelHash = 14695981039346656037ull;
+		auto start = steady_clock::now();
+
+		for (int i = 0; i < levels; ++i) {
+			vector<char> level = Engine::LevelGenerator::GenerateLevel(GameFieldWidth, GameFieldHeight, generator);
+			for (char tile : level) {
+				levelHash = (levelHash ^ (unsigned char)tile) * 1099511628211ull;
+			}
+		}
+		double totalUs = (double)duration_cast<microseconds>(steady_clock::now() - start).count();
+		cout << "levels: " << levels << " seed: " << seed << "\n";
+		cout << "per level: " << totalUs / levels << " us\n";
+		cout << "level hash: " << levelHash << "\n";
+	}
 
-			if (currentWave % 10 == 0) {
-				wave.minibosses = currentWave / 10;
-				wave.enemies = max(0, wave.enemies - wave.minibosses);
+	// Levels per second from the generator on one thread and then on threads, each level from
+	// its own LevelStream(seed, i) as a run's LevelQueue makes them. Level hashes are combined
+	// in level order, so every thread count must give the same hash.
+	static void BatchGeneration(int levels, unsigned int seed, unsigned threads) {
+		using namespace std::chrono;
+		vector<uint64_t> hashes(levels);
+		unsigned threadCounts[] = { 1, threads };
+		double singleRate = 0;
+		uint64_t singleHash = 0;
+
+		cout << "levels: " << levels << " seed: " << seed << "\n";
+		for (unsigned count : threadCounts) {
+			if (count == 1 && singleRate > 0) {
+				break;
+			}
+			auto start = steady_clock::now();
+			ThreadPool::ParallelFor((size_t)levels, count, [&](size_t index, unsigned) {
+				mt19937 generator = Engine::LevelGenerator::LevelStream(seed, (uint32_t)index);
+				vector<char> level = Engine::LevelGenerator::GenerateLevel(GameFieldWidth, GameFieldHeight, generator);
+				uint64_t levelHash = 14695981039346656037ull;
+				for (char tile : level) {
+					levelHash = (levelHash ^ (unsigned char)tile) * 1099511628211ull;
+				}
+				hashes[index] = levelHash;
+				});
+			double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+			uint64_t batchHash = 14695981039346656037ull;
+			for (uint64_t levelHash : hashes) {
+				batchHash = (batchHash ^ levelHash) * 1099511628211ull;
+			}
+			double rate = levels / seconds;
+			cout << "threads " << count << ": " << rate << " levels/s";
+			if (singleRate > 0) {
+				cout << "  speedup: " << rate / singleRate << "x  hash matches: " << (batchHash == singleHash ? "yes" : "no");
+			}
+			cout << "\n";
+			if (singleRate == 0) {
+				singleRate = rate;
+				singleHash = batchHash;
+				cout << "level hash: " << batchHash << "\n";
 			}
+		}
+	}
 
-			if (currentWave == 100) {
-				wave.bosses = 1;
-				wave.enemies = 0;
-				wave.minibosses = 0;
+	// Snapshot size and the cost of encoding, an atomic save and a mapped load, for a whole 80x30
+	// level and a streamed 4096x4096 world. Every load is encoded again and must match.
+	static void Snapshots(unsigned int seed) {
+		using namespace std::chrono;
+		typedef Game::Snapshot Snapshot;
+		const int sizes[][2] = { { 80, 30 }, { 4096, 4096 } };
+		const int rounds = 200;
+		const string path = "asciidungeon-bench.sav";
+
+		for (const auto& size : sizes) {
+			Game::Options options = SeededOptions(seed);
+			options.worldWidth = size[0];
+			options.worldHeight = size[1];
+			HeadlessTerminal terminal;
+			Game game(terminal, options);
+			vector<char> bytes = Snapshot::Encode(game);
+			double encodeUs = 0, saveUs = 0, loadUs = 0;
+			int mismatches = 0;
+
+			for (int round = 0; round < rounds; ++round) {
+				auto start = steady_clock::now();
+				bytes = Snapshot::Encode(game);
+				auto encoded = steady_clock::now();
+				bool saved = Snapshot::Save(game, path);
+				auto written = steady_clock::now();
+				bool loaded = Snapshot::Load(game, path);
+				auto read = steady_clock::now();
+				encodeUs += duration_cast<nanoseconds>(encoded - start).count() / 1000.0;
+				saveUs += duration_cast<nanoseconds>(written - encoded).count() / 1000.0;
+				loadUs += duration_cast<nanoseconds>(read - written).count() / 1000.0;
+
+				if (!saved || !loaded || Snapshot::Encode(game) != bytes) {
+					++mismatches;
+				}
 			}
+			cout << "world " << size[0] << "x" << size[1] << ": " << bytes.size() << " bytes, " << game.EntityMap.Size()
+				<< " entities  encode " << encodeUs / rounds << " us  save " << saveUs / rounds << " us  load "
+				<< loadUs / rounds << " us  mismatched round trips: " << mismatches << "\n";
+		}
+		remove(path.c_str());
+	}
 
-			return wave;
+	static void Rendering(int frames, unsigned int seed) {
+		mt19937 generator(seed);
+		LevelMap level;
+		level.Load(Engine::LevelGenerator::GenerateLevel(GameFieldWidth, GameFieldHeight, generator));
+		EntityGrid entities;
+		entities.Set({ 1, 1 }, TilePlayer);
+		Game::EntityManager::PlaceEntitiesRandomly(level, entities, ContentTable::Default(), TileEnemy, 20, generator);
+		Engine::FrameCompositor compositor;
+		Engine::LevelRenderer renderer(compositor, ContentTable::Default());
+		renderer.DrawInitialMap(level, entities);
+		Engine::FrameCompositor::FrameStats initial = compositor.lastFrame;
+		compositor.totals = Engine::FrameCompositor::FrameStats();
+		compositor.framesPresented = 0;
+		const GridPosition steps[] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+		size_t legacyCalls = 0;
+
+		for (int frame = 0; frame < frames; ++frame) {
+			GridPosition from = entities.Position((EntityGrid::EntityId)Engine::LevelGenerator::RandomInt(generator, 0, entities.Slots() - 1));
+			GridPosition step = steps[Engine::LevelGenerator::RandomInt(generator, 0, 3)];
+			GridPosition to{ from.x + step.x, from.y + step.y };
+
+			if (!Game::CanMove(to, level) || entities.Has(to)) {
+				continue;
+			}
+			entities.Move(from, to);
+			renderer.ComposeCell(level, entities, from);
+			renderer.ComposeCell(level, entities, to);
+			compositor.Present();
+			legacyCalls += (from.y != to.y ? 2 : 1) * (GameFieldWidth + 2);
 		}
-	};
-	WaveManager waveManager;
+		size_t presented = max<size_t>(1, compositor.framesPresented);
+		const Engine::FrameCompositor::FrameStats& totals = compositor.totals;
+		cout << "initial map: " << initial.bytes << " bytes, " << initial.syscalls << " syscalls\n";
+		cout << "frames: " << compositor.framesPresented << "\n";
+		cout << "per frame: " << (double)totals.bytes / presented << " bytes, "
+			<< (double)totals.syscalls / presented << " syscalls, "
+			<< (double)totals.cellsWritten / presented << " cells\n";
+		cout << "per-tile renderer: " << (double)legacyCalls / presented << " console calls per frame\n";
+	}
 
-	class GameWinManager {
-	public:
-		static void ShowGameWin() {
-			HANDLE consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-			std::vector<std::string> logo = {
-				"__      ___      _                   _",
-				"\\ \\    / (_)    | |                 | |",
-				" \\ \\  / / _  ___| |_ ___  _ __ _   _| |",
-				"  \\ \\/ / | |/ __| __/ _ \\| '__| | | | |",
-				"   \\  /  | | (__| || (_) | |  | |_| |_|",
-				"    \\/   |_|\\___|\\__\\___/|_|   \\__, (_)",
-				"                                 __/ |",
-				"                                |___/"
+	// Whole-level reachability from the player start: the tile queue the generator used to run
+	// against Bitboard::FloodFill, on the same generated levels.
+	static void Connectivity(int levels, unsigned int seed) {
+		using namespace std::chrono;
+		mt19937 generator(seed);
+		const int width = (int)GameFieldWidth, height = (int)GameFieldHeight, start = width + 1;
+		vector<vector<char>> generated;
 
-			};
+		for (int i = 0; i < levels; ++i) {
+			generated.push_back(Engine::LevelGenerator::GenerateLevel(width, height, generator));
+		}
+		vector<bool> visited(width * height);
+		vector<int> frontier;
+		frontier.reserve(width * height);
+		long queueTotal = 0;
+		auto begin = steady_clock::now();
+
+		for (const vector<char>& level : generated) {
+			queueTotal += QueueFloodFill(level, width, start, visited, frontier);
+		}
+		double queueNs = (double)duration_cast<nanoseconds>(steady_clock::now() - begin).count() / levels;
+		vector<Bitboard> open;
+
+		for (const vector<char>& level : generated) {
+			open.emplace_back(width, height);
+			for (int i = 0; i < width * height; ++i) {
+				if (level[i] == TileGround) {
+					open.back().Set(i % width, i / width);
+				}
+			}
+		}
+		Bitboard region(width, height);
+		long bitTotal = 0;
+		begin = steady_clock::now();
+
+		for (const Bitboard& level : open) {
+			region.Clear();
+			region.Set(start % width, start / width);
+			bitTotal += Bitboard::FloodFill(level, region);
+		}
+		double bitNs = (double)duration_cast<nanoseconds>(steady_clock::now() - begin).count() / levels;
+		cout << "levels: " << levels << " seed: " << seed << "\n";
+		cout << "queue flood fill: " << queueNs / 1000.0 << " us/level\n";
+		cout << "bitboard flood fill: " << bitNs / 1000.0 << " us/level (" << open[0].WordsPerRow() * height * 8 << " bytes)\n";
+		cout << "reachable tiles match: " << (queueTotal == bitTotal ? "yes" : "no") << "\n";
+	}
 
-			int logoHeight = (int)logo.size();
-			int startY = (GameFieldHeight - logoHeight) / 2;
+	static int QueueFloodFill(const vector<char>& level, int width, int start, vector<bool>& visited, vector<int>& frontier) {
+		const int offsets[] = { 1, -1, width, -width };
+		fill(visited.begin(), visited.end(), false);
+		frontier.clear();
+		frontier.push_back(start);
+		visited[start] = true;
 
-			for (int i = 0; i < logoHeight; i++) {
-				int startX = (GameFieldWidth - (int)logo[i].size()) / 2;
-				COORD p = { (SHORT)startX, (SHORT)(startY + i) };
-				SetConsoleCursorPosition(consoleHandle, p);
-				SetConsoleTextAttribute(consoleHandle, 2);
-				std::cout << logo[i];
+		for (size_t head = 0; head < frontier.size(); ++head) {
+			for (int offset : offsets) {
+				int next = frontier[head] + offset;
+
+				if (!visited[next] && level[next] == TileGround) {
+					visited[next] = true;
+					frontier.push_back(next);
+				}
 			}
+		}
+		return (int)frontier.size();
+	}
 
-			SetConsoleTextAttribute(consoleHandle, 7);
-			std::cout << "\n\n";
-			std::cout << "Congratulations! You defeated the boss!\n";
-			std::cout << "Press any key to exit...";
-			_getch();
-			exit(0);
+	// Cost of a world as it grows: level generation, an entity tick with a fixed number of
+	// entities, and walking the player one chunk to the right, which streams in a column of new
+	// chunks. Per-tick cost and memory should follow the active area, not the world size.
+	static void WorldScaling(unsigned int seed) {
+		using namespace std::chrono;
+		HeadlessTerminal terminal;
+		Game game(terminal, SeededOptions(seed));
+		const int sizes[][2] = { { 80, 30 }, { 1024, 1024 }, { 4096, 4096 }, { 16384, 16384 } };
+		const int entityCount = 200, ticks = 200;
+
+		for (const auto& size : sizes) {
+			game.rng.seed(seed);
+			LevelMap level(size[0], size[1]);
+			EntityGrid grid(size[0], size[1]);
+			GridPosition playerPos{ 1, 1 };
+			auto start = steady_clock::now();
+			Engine::LevelGenerator::GenerateLevel(level, playerPos, game.rng);
+			double generateUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0;
+			level.Set({ 2, 1 }, TileWall);
+			level.Set({ 1, 2 }, TileWall);
+			grid.Set(playerPos, TilePlayer);
+			Game::EntityManager::PlaceEntitiesRandomly(level, grid, game.content, TileEnemy, entityCount, game.rng);
+			game.renderer.camera = { 0, 0 };
+			game.renderer.DrawInitialMap(level, grid);
+
+			start = steady_clock::now();
+			for (int tick = 0; tick < ticks; ++tick) {
+				Game::EntityManager::MoveEntities(game, level, grid, playerPos);
+				game.compositor.Present();
+			}
+			double tickUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0 / ticks;
+
+			start = steady_clock::now();
+			bool streamed = Engine::LevelGenerator::ActivateAround(level, { playerPos.x + LevelMap::ChunkSize, playerPos.y });
+			double streamUs = (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0;
+			const GridRect& area = level.ActiveArea();
+
+			cout << "world " << size[0] << "x" << size[1] << ": generate " << generateUs << " us, active area "
+				<< area.width << "x" << area.height << ", chunks " << level.AllocatedChunks() << "/"
+				<< level.ChunksX() * level.ChunksY() << ", memory " << (level.MemoryBytes() + grid.MemoryBytes()) / 1024
+				<< " KiB, tick " << tickUs << " us";
+			if (streamed) {
+				cout << ", one chunk east " << streamUs << " us";
+			}
+			cout << "\n";
 		}
-	};
+	}
+};
 
-	static void ShowLogo(int marginX = 2) {
-		HANDLE consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-		vector<string> logo = {
-			"            _____  _____ _____ _____            ",
-			"     /\\    / ____|/ ____|_   _|_   _|           ",
-			"    /  \\  | (___ | |      | |   | |             ",
-			"   / /\\ \\  \\___ \\| |      | |   | |             ",
-			"  / ____ \\ ____) | |____ _| |_ _| |_            ",
-			" /_/___ \\_\\_____/ \\_____|_____|_____|___  _   _ ",
-			" |  __ \\| |  | | \\ | |/ ____|  ____/ __ \\| \\ | |",
-			" | |  | | |  | |  \\| | |  __| |__ | |  | |  \\| |",
-			" | |  | | |  | | . ` | | |_ |  __|| |  | | . ` |",
-			" | |__| | |__| | |\\  | |__| | |___| |__| | |\\  |",
-			" |_____/ \\____/|_| \\_|\\_____|______\\____/|_| \\_|"
-		};
-		int logoHeight = (int)logo.size();
-		int startY = (GameFieldHeight - logoHeight) / 2;
+#ifndef ASCIIDUNGEON_NO_MAIN
+// Reads text as a whole decimal number from low to high into value. Anything else, trailing
+// characters included, is reported against option and gives false.
+static bool NumberArgument(const string& option, const char* text, long long low, long long high, long long& value) {
+	char* end = nullptr;
+	errno = 0;
+	long long parsed = strtoll(text, &end, 10);
+
+	if (end == text || *end != '\0' || errno == ERANGE || parsed < low || parsed > high) {
+		cerr << option << " takes a whole number from " << low << " to " << high << ", not " << text << "\n";
+		return false;
+	}
+	value = parsed;
+	return true;
+}
 
-		for (int i = 0; i < logoHeight; i++) {
-			int startX = (GameFieldWidth - (int)logo[i].size()) / 2 + marginX;
-			COORD p = { (SHORT)startX, (SHORT)(startY + i) };
-			SetConsoleCursorPosition(consoleHandle, p);
+// Reads the optional value at argv[index] after a --bench-* flag; a missing value keeps the default.
+static bool BenchArgument(int argc, char* argv[], int index, const char* name, long long low, long long high, long long& value) {
+	return index >= argc || NumberArgument(string(argv[1]) + " " + name, argv[index], low, high, value);
+}
 
-			if (i <= 4) {
-				SetConsoleTextAttribute(consoleHandle, 11);
+int main(int argc, char* argv[]) {
+	if (argc >= 2 && string(argv[1]) == "--bench-levelgen") {
+		long long levels = 1000, seed = 1;
+		if (!BenchArgument(argc, argv, 2, "levels", 1, INT_MAX, levels) || !BenchArgument(argc, argv, 3, "seed", 0, UINT32_MAX, seed)) {
+			return 1;
+		}
+		Benchmark::LevelGeneration((int)levels, (unsigned int)seed);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-batchgen") {
+		long long levels = 10000, seed = 1, threads = ThreadPool::DefaultThreads();
+		if (!BenchArgument(argc, argv, 2, "levels", 1, INT_MAX, levels) || !BenchArgument(argc, argv, 3, "seed", 0, UINT32_MAX, seed)
+			|| !BenchArgument(argc, argv, 4, "threads", 1, 1024, threads)) {
+			return 1;
+		}
+		Benchmark::BatchGeneration((int)levels, (unsigned int)seed, (unsigned)threads);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-entities") {
+		long long seed = 1;
+		if (!BenchArgument(argc, argv, 2, "seed", 0, UINT32_MAX, seed)) {
+			return 1;
+		}
+		Benchmark::EntityTick((unsigned int)seed);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-pursuit") {
+		long long seed = 1;
+		if (!BenchArgument(argc, argv, 2, "seed", 0, UINT32_MAX, seed)) {
+			return 1;
+		}
+		Benchmark::Pursuit((unsigned int)seed);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-astar") {
+		long long queries = 20000, seed = 1;
+		if (!BenchArgument(argc, argv, 2, "queries", 1, INT_MAX, queries) || !BenchArgument(argc, argv, 3, "seed", 0, UINT32_MAX, seed)) {
+			return 1;
+		}
+		Benchmark::Pathfinding((int)queries, (unsigned int)seed);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-target") {
+		long long queries = 20000, seed = 1;
+		if (!BenchArgument(argc, argv, 2, "queries", 1, INT_MAX, queries) || !BenchArgument(argc, argv, 3, "seed", 0, UINT32_MAX, seed)) {
+			return 1;
+		}
+		Benchmark::TargetSelection((int)queries, (unsigned int)seed);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-fill") {
+		long long levels = 1000, seed = 1;
+		if (!BenchArgument(argc, argv, 2, "levels", 1, INT_MAX, levels) || !BenchArgument(argc, argv, 3, "seed", 0, UINT32_MAX, seed)) {
+			return 1;
+		}
+		Benchmark::Connectivity((int)levels, (unsigned int)seed);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-place") {
+		long long levels = 1000, seed = 1;
+		if (!BenchArgument(argc, argv, 2, "levels", 1, INT_MAX, levels) || !BenchArgument(argc, argv, 3, "seed", 0, UINT32_MAX, seed)) {
+			return 1;
+		}
+		Benchmark::Placement((int)levels, (unsigned int)seed);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-content") {
+		long long archetypes = 200, rounds = 100;
+		if (!BenchArgument(argc, argv, 2, "archetypes", 1, INT_MAX, archetypes) || !BenchArgument(argc, argv, 3, "rounds", 1, INT_MAX, rounds)) {
+			return 1;
+		}
+		Benchmark::ContentCompile((int)archetypes, (int)rounds);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-world") {
+		long long seed = 1;
+		if (!BenchArgument(argc, argv, 2, "seed", 0, UINT32_MAX, seed)) {
+			return 1;
+		}
+		Benchmark::WorldScaling((unsigned int)seed);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-snapshot") {
+		long long seed = 1;
+		if (!BenchArgument(argc, argv, 2, "seed", 0, UINT32_MAX, seed)) {
+			return 1;
+		}
+		Benchmark::Snapshots((unsigned int)seed);
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "--bench-render") {
+		long long frames = 10000, seed = 1;
+		if (!BenchArgument(argc, argv, 2, "frames", 1, INT_MAX, frames) || !BenchArgument(argc, argv, 3, "seed", 0, UINT32_MAX, seed)) {
+			return 1;
+		}
+		Benchmark::Rendering((int)frames, (unsigned int)seed);
+		return 0;
+	}
+	bool headless = false;
+	bool balance = false;
+	bool serve = false;
+	long hostSessions = 0;
+	long hostTicks = 1000;
+	bool seeded = false;
+	unsigned int seed = 0;
+	long maxFrames = 1000000;
+	int runs = 10000;
+	unsigned threads = ThreadPool::DefaultThreads();
+	Simulation::UpgradePolicy policy = Simulation::UpgradePolicy::Balanced;
+	string script;
+	Game::Options options;
+	ContentTable content;
+	string loadPath, savePath, recordPath, replayPath;
+	bool fastForward = false;
+	long long number = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--all-pursue") {
+			options.everyEnemyPursues = true;
+		}
+		else if (arg == "--live-menus") {
+			options.liveMenus = true;
+		}
+		else if (arg == "--pursuers" && hasValue) {
+			if (!NumberArgument(arg, argv[++i], 1, EntityGrid::NoEntity, number)) {
+				return 1;
 			}
-			else if (i == 5) {
-				SetConsoleTextAttribute(consoleHandle, 7);
+			options.pursuers = (int)number;
+		}
+		else if (arg == "--headless") {
+			headless = true;
+		}
+		else if (arg == "--frame-stats" && hasValue) {
+			options.frameStatsPath = argv[++i];
+		}
+		else if (arg == "--profile") {
+			options.profile = true;
+		}
+		else if (arg == "--trace" && hasValue) {
+			options.tracePath = argv[++i];
+		}
+		else if (arg == "--load" && hasValue) {
+			loadPath = argv[++i];
+		}
+		else if (arg == "--save" && hasValue) {
+			savePath = argv[++i];
+		}
+		else if (arg == "--record" && hasValue) {
+			recordPath = argv[++i];
+		}
+		else if (arg == "--replay" && hasValue) {
+			replayPath = argv[++i];
+		}
+		else if (arg == "--fast-forward") {
+			fastForward = true;
+		}
+		else if (arg == "--balance") {
+			balance = true;
+		}
+		else if ((arg == "--host" || arg == "--serve") && hasValue) {
+			if (!NumberArgument(arg, argv[++i], 1, INT_MAX, number)) {
+				return 1;
 			}
-			else {
-				SetConsoleTextAttribute(consoleHandle, 14);
+			hostSessions = (long)number;
+			serve = arg == "--serve";
+		}
+		else if (arg == "--runs" && hasValue) {
+			if (!NumberArgument(arg, argv[++i], 1, INT_MAX, number)) {
+				return 1;
+			}
+			runs = (int)number;
+		}
+		else if (arg == "--threads" && hasValue) {
+			if (!NumberArgument(arg, argv[++i], 1, 1024, number)) {
+				return 1;
+			}
+			threads = (unsigned)number;
+		}
+		else if (arg == "--policy" && hasValue) {
+			if (!Simulation::ParsePolicy(argv[++i], policy)) {
+				cerr << "unknown policy " << argv[i] << " (balanced, attack, defense, health, none)\n";
+				return 1;
+			}
+		}
+		else if (arg == "--seed" && hasValue) {
+			if (!NumberArgument(arg, argv[++i], 0, UINT32_MAX, number)) {
+				return 1;
+			}
+			seed = (unsigned int)number;
+			seeded = true;
+		}
+		else if (arg == "--world" && hasValue) {
+			string size = argv[++i];
+			size_t split = size.find('x');
+			string width = size.substr(0, split);
+			string height = split == string::npos ? width : size.substr(split + 1);
+			if (!NumberArgument(arg + " width", width.c_str(), GameFieldWidth, MaxWorldSize, number)) {
+				return 1;
+			}
+			options.worldWidth = (int)number;
+			if (!NumberArgument(arg + " height", height.c_str(), GameFieldHeight, MaxWorldSize, number)) {
+				return 1;
+			}
+			options.worldHeight = (int)number;
+		}
+		else if (arg == "--frames" && hasValue) {
+			if (!NumberArgument(arg, argv[++i], 1, LONG_MAX, number)) {
+				return 1;
+			}
+			maxFrames = hostTicks = (long)number;
+		}
+		else if (arg == "--content" && hasValue) {
+			string error;
+
+			if (!ContentTable::Load(argv[++i], content, error)) {
+				cerr << error << "\n";
+				return 1;
 			}
+			options.content = &content;
+		}
+		else if (arg == "--script" && hasValue) {
+			ifstream file(argv[++i], ios::binary);
 
-			cout << logo[i];
-			SetConsoleTextAttribute(consoleHandle, 7);
+			if (!file) {
+				cerr << "could not read script " << argv[i] << "\n";
+				return 1;
+			}
+			script.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
 		}
-		Sleep(1000);
-		COORD pos = { 0, 0 };
-		SetConsoleCursorPosition(consoleHandle, pos);
-		SetConsoleTextAttribute(consoleHandle, 7);
+	}
+	if (balance) {
+		Simulation::RunBalance(options.content ? *options.content : ContentTable::Default(), seeded ? seed : 1, runs, threads, policy);
+		return 0;
+	}
+	if (hostSessions > 0) {
+		options.seed = seeded ? seed : 1;
 
+		if (serve) {
+			SessionHost::Serve(options, (size_t)hostSessions, threads);
+		}
+		else {
+			SessionHost::RunBenchmark(options, (size_t)hostSessions, hostTicks, threads);
+		}
+		return 0;
+	}
+	if (!replayPath.empty()) {
+		return Simulation::Replay(replayPath, fastForward, options) ? 0 : 1;
 	}
+	options.seed = seeded ? seed : 1;
 
-};
+	if (headless) {
+		Simulation::RunHeadless(options, maxFrames, script, loadPath, savePath, recordPath);
+		return 0;
+	}
+	if (!seeded) {
+		options.seed = random_device()();
+	}
+	TerminalBackend& console = Engine::Console();
+	console.Setup(GameFieldWidth, GameFieldHeight, 2);
+	Game::ShowLogo(console);
+	RecordingTerminal recorder(console);
+	Game game(recordPath.empty() ? console : recorder, options);
+	bool loaded = !loadPath.empty() && Game::Snapshot::Load(game, loadPath);
+
+	if (!loadPath.empty() && !loaded) {
+		game.encounters.ShowMessage(game, "Could not load " + loadPath);
+	}
+	game.savePath = savePath;
 
-bool Game::InputManager::up = false;
-bool Game::InputManager::down = false;
-bool Game::InputManager::left = false;
-bool Game::InputManager::right = false;
-int Game::EntityManager::AIController::stepCounter = 0;
-GridPosition Game::EntityManager::AIController::currentTarget{};
-bool Game::EntityManager::AIController::hasTarget = false;
-vector<GridPosition> Game::EntityManager::AIController::currentPath;
-int Game::EntityManager::AIController::reevalInterval = 2;
-bool Game::EntityManager::Encounters::showingMessage = false;
-chrono::steady_clock::time_point Game::EntityManager::Encounters::lastMessageTime;
-string Game::EntityManager::Encounters::currentMessage = "";
-string Game::HUDBar::lastMessage = "";
-
-int main() {
-	Engine::HideCursor();
-	Engine::SetConsoleSize(GameFieldWidth, GameFieldHeight, 2);
-	Game::ShowLogo(2);
-	Game game;
+	if (!recordPath.empty()) {
+		Simulation::StartRecording(recorder.recording, options, loaded ? &game : nullptr);
+		game.recorder = &recorder;
+	}
 	game.Run(game);
+
+	if (!recordPath.empty() && !recorder.recording.Save(recordPath)) {
+		cerr << "could not write " << recordPath << "\n";
+	}
+	// Esc ends the run without saving it; save a run that is still going.
+	if (!savePath.empty() && game.player.hp > 0 && !game.bossDefeated) {
+		Game::Snapshot::Save(game, savePath);
+	}
+	game.WriteReports();
 }
+#endif